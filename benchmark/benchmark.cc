@@ -26,10 +26,13 @@ void prepare_data(int n) {
   }
 }
 
+// DictInterface picks the backend from dict_type at runtime, a backend
+// as _Dict fixes it at compile time
+template <template <typename> class _Dict = DictInterface>
 void benchmark(std::string name, ZsetDictType dict_type) {
   printf("\n\t===== Benchmark %s \t=====\n", name.data());
   timer.tick();
-  Zset<int> z(name, dict_type);
+  Zset<int, 1024, 32, false, _Dict> z(name, dict_type);
   for (auto& kv: rand_kv_list) {
     z.Zadd(kv.first, kv.second);
   }
@@ -43,6 +46,14 @@ void benchmark(std::string name, ZsetDictType dict_type) {
   }
   assert(count >= z.Zcard());
   printf("\tZscore \tOPS = \t%f\n", rand_kv_list.size() / timer.tock());
+
+  timer.tick();
+  count = 0;
+  for (auto& kv: rand_kv_list) {
+    count += z.Zrank(kv.first) > 0;
+  }
+  assert(count >= z.Zcard());
+  printf("\tZrank \tOPS = \t%f\n", rand_kv_list.size() / timer.tock());
 }
 
 using hrc = std::chrono::high_resolution_clock;
@@ -50,6 +61,9 @@ using hrc = std::chrono::high_resolution_clock;
 int main() {
   prepare_data(1000'000);
   benchmark("ROBIN_MAP_DICT", ROBIN_MAP_DICT);
+  benchmark<RobinMapDict>("RobinMapDict", ROBIN_MAP_DICT);
   benchmark("ROCKSDB_DICT", ROCKSDB_DICT);
+  benchmark<RocksdbDict>("RocksdbDict", ROCKSDB_DICT);
+  benchmark("LOG_DICT", LOG_DICT);
   puts("");
 }
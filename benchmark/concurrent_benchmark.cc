@@ -0,0 +1,81 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <thread>
+
+#include "zset/concurrent_zset.h"
+
+using namespace ZSET;
+using hrc = std::chrono::high_resolution_clock;
+
+static constexpr int kReadsPerThread = 200'000;
+
+pairs<int> rand_kv_list;
+
+void prepare_data(int n) {
+  for (int i = 1; i <= n; i ++) {
+    rand_kv_list.emplace_back(std::to_string(rand()), rand());
+  }
+}
+
+// Run Zscore + Zrank from reader_count threads, optionally with a writer
+double read_ops(ConcurrentZset<int>& z, int reader_count, bool with_writer) {
+  std::atomic<bool> stop(false);
+  std::thread writer;
+  if (with_writer) {
+    writer = std::thread([&]() {
+      for (uint32_t i = 0; !stop; i ++) {
+        z.Zincrby(rand_kv_list[i % rand_kv_list.size()].first, 1);
+      }
+    });
+  }
+  auto start_time = hrc::now();
+  std::vector<std::thread> readers;
+  std::atomic<uint32_t> found_count(0);
+  for (int t = 0; t < reader_count; t ++) {
+    readers.emplace_back([&, t]() {
+      uint32_t seed = t * 7919 + 1, count = 0;
+      for (int i = 0; i < kReadsPerThread; i ++) {
+        seed = seed * 1103515245 + 12345;
+        auto& member = rand_kv_list[seed % rand_kv_list.size()].first;
+        count += z.Zscore(member).first;
+        count += z.Zrank(member) > 0;
+      }
+      found_count += count;
+    });
+  }
+  for (auto& t : readers) {
+    t.join();
+  }
+  double seconds = std::chrono::duration_cast<std::chrono::microseconds>
+    (hrc::now() - start_time).count() / 1e6;
+  stop = true;
+  if (writer.joinable()) {
+    writer.join();
+  }
+  assert(found_count > 0);
+  return 2.0 * kReadsPerThread * reader_count / seconds;
+}
+
+void benchmark(std::string name, ZsetDictType dict_type) {
+  printf("\n\t===== Benchmark %s \t=====\n", name.data());
+  ConcurrentZset<int> z(name, dict_type);
+  for (auto& kv: rand_kv_list) {
+    z.Zadd(kv.first, kv.second);
+  }
+  int max_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int with_writer = 0; with_writer < 2; with_writer ++) {
+    for (int n = 1; n <= max_threads; n <<= 1) {
+      printf("\t%d readers%s \tOPS = \t%f\n", n,
+             with_writer ? " + 1 writer" : "",
+             read_ops(z, n, with_writer));
+    }
+  }
+}
+
+int main() {
+  prepare_data(1000'000);
+  benchmark("CONCURRENT_ROBIN_MAP_DICT", ROBIN_MAP_DICT);
+  benchmark("CONCURRENT_ROCKSDB_DICT", ROCKSDB_DICT);
+  puts("");
+}
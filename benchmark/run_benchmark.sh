@@ -7,3 +7,5 @@ rm -rf build && mkdir build && cd build && cmake .. && make
 
 # Run
 ./benchmark
+./concurrent_benchmark
+./workload_benchmark --sizes=10000,1000000 --json=workload_benchmark.json
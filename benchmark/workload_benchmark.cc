@@ -0,0 +1,509 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <new>
+#include <random>
+
+#include "zset/zset.h"
+
+/*
+  Latency benchmark of every zset API and of YCSB-style mixes.
+
+    ./workload_benchmark --dicts=robin,rocksdb,log --sizes=10000,1000000
+                         --dists=uniform,zipfian --scores=random,sequential
+                         --ops=100000 --json=result.json
+
+  Each configuration loads a fresh zset, then runs one phase per API
+  and one per mix, reporting OPS, p50/p99/p999 latency and heap
+  allocations per operation. With --json, all phases are also written
+  as one JSON array, to diff two builds before rollout.
+*/
+
+using namespace ZSET;
+using hrc = std::chrono::high_resolution_clock;
+
+////////////////////////////// BEGIN Allocation counter //////////////////////////////
+
+static std::atomic<uint64_t> alloc_count(0);
+
+void* operator new(size_t size) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+// Not inlined, so that the compiler does not pair free with new
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  free(p);
+}
+void operator delete[](void* p) noexcept {
+  operator delete(p);
+}
+void operator delete(void* p, size_t) noexcept {
+  operator delete(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+  operator delete(p);
+}
+
+////////////////////////////// END Allocation counter //////////////////////////////
+
+////////////////////////////// BEGIN Latency histogram //////////////////////////////
+
+/*
+  Log-linear buckets of nanoseconds: 16 sub-buckets per power of two,
+  so that a percentile is within ~6% at a fixed memory cost, whatever
+  the number of operations.
+*/
+struct Histogram {
+  static constexpr int kSubBits = 4;
+  static constexpr int kBucketCount = 64 << kSubBits;
+  uint64_t buckets[kBucketCount] = {};
+  uint64_t count = 0;
+  uint64_t max_ns = 0;
+
+  static int Index(uint64_t ns) {
+    if (ns < (1u << kSubBits)) {
+      return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return ((msb - kSubBits + 1) << kSubBits) +
+           ((ns >> (msb - kSubBits)) & ((1 << kSubBits) - 1));
+  }
+  static uint64_t Lower(int index) {
+    if (index < (1 << kSubBits)) {
+      return index;
+    }
+    int msb = (index >> kSubBits) + kSubBits - 1;
+    return (uint64_t(1) << msb) |
+           (uint64_t(index & ((1 << kSubBits) - 1)) << (msb - kSubBits));
+  }
+  void Add(uint64_t ns) {
+    buckets[Index(ns)] ++;
+    count ++;
+    max_ns = std::max(max_ns, ns);
+  }
+  double Percentile(double p) const {
+    uint64_t target = std::ceil(count * p), seen = 0;
+    for (int i = 0; i < kBucketCount; i ++) {
+      seen += buckets[i];
+      if (seen >= target && seen) {
+        return Lower(i) / 1e3;
+      }
+    }
+    return max_ns / 1e3;
+  }
+};
+
+////////////////////////////// END Latency histogram //////////////////////////////
+
+////////////////////////////// BEGIN Key generators //////////////////////////////
+
+/*
+  Zipfian over [0, n) with the YCSB constant 0.99 (Gray et al.,
+  "Quickly Generating Billion-Record Synthetic Databases"). Ranks are
+  scrambled by a hash so that hot keys spread over the key space.
+*/
+class Zipfian {
+ public:
+  Zipfian(uint64_t n, double theta = 0.99) : n_(n), theta_(theta) {
+    zetan_ = Zeta(n);
+    alpha_ = 1.0 / (1.0 - theta);
+    eta_ = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - Zeta(2) / zetan_);
+  }
+  uint64_t Rank(std::mt19937_64& rng) const {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetan_;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < 1.0 + std::pow(0.5, theta_)) {
+      return 1;
+    }
+    return std::min<uint64_t>(n_ - 1, n_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+  }
+  uint64_t Scrambled(std::mt19937_64& rng) const {
+    uint64_t x = Rank(rng) * 0x9E3779B97F4A7C15ull;
+    return (x ^ (x >> 29)) % n_;
+  }
+
+ private:
+  double Zeta(uint64_t n) const {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i ++) {
+      sum += 1 / std::pow(i, theta_);
+    }
+    return sum;
+  }
+  uint64_t n_;
+  double theta_, zetan_, alpha_, eta_;
+};
+
+struct Config {
+  std::string dict_name;
+  // Unique per configuration, so that no run recovers another
+  std::string db_path;
+  ZsetDictType dict_type;
+  uint64_t size;
+  std::string dist;
+  std::string scores;
+  uint64_t ops;
+};
+
+class Workload {
+ public:
+  Workload(const Config& config)
+    : config_(config), rng_(config.size), zipfian_(config.size),
+      next_id_(config.size) {}
+
+  // Short enough for SSO, so that allocs/op counts the zset only
+  std::string Member(uint64_t id) const {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "m%012lu", (unsigned long)id);
+    return buffer;
+  }
+  int Score(uint64_t id) {
+    return config_.scores == "sequential" ? int(id) : int(rng_() % config_.size);
+  }
+  // An existing member, by the configured distribution
+  uint64_t Existing() {
+    if (config_.dist == "zipfian") {
+      return zipfian_.Scrambled(rng_);
+    }
+    return rng_() % config_.size;
+  }
+  // Recently inserted members are the hottest (YCSB workload D)
+  uint64_t Latest() {
+    uint64_t back = zipfian_.Rank(rng_);
+    return next_id_ > back ? next_id_ - 1 - back : 0;
+  }
+  uint64_t Insert() {
+    return next_id_ ++;
+  }
+  uint64_t Uniform(uint64_t n) {
+    return rng_() % n;
+  }
+
+ private:
+  const Config& config_;
+  std::mt19937_64 rng_;
+  Zipfian zipfian_;
+  uint64_t next_id_;
+};
+
+////////////////////////////// END Key generators //////////////////////////////
+
+////////////////////////////// BEGIN Phases //////////////////////////////
+
+struct Result {
+  std::string phase;
+  uint64_t ops;
+  double seconds;
+  Histogram latency;
+  uint64_t allocs;
+};
+
+std::vector<std::pair<Config, Result>> results;
+
+// Time op per call; op returns false to exclude its call from the phase
+void RunPhase(const Config& config, const std::string& phase, uint64_t ops,
+              const std::function<bool()>& op) {
+  Result result;
+  result.phase = phase;
+  result.ops = 0;
+  result.seconds = 0;
+  uint64_t allocs = alloc_count.load();
+  for (uint64_t i = 0; i < ops; i ++) {
+    auto start = hrc::now();
+    bool counted = op();
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+      (hrc::now() - start).count();
+    if (counted) {
+      result.latency.Add(ns);
+      result.seconds += ns / 1e9;
+      result.ops ++;
+    }
+  }
+  result.allocs = alloc_count.load() - allocs;
+  printf("\t%-24s OPS = %12.0f  p50 = %9.2fus  p99 = %9.2fus  p999 = %9.2fus  allocs/op = %6.1f\n",
+         phase.data(), result.ops / std::max(result.seconds, 1e-9),
+         result.latency.Percentile(0.5), result.latency.Percentile(0.99),
+         result.latency.Percentile(0.999),
+         double(result.allocs) / std::max<uint64_t>(result.ops, 1));
+  results.emplace_back(config, std::move(result));
+}
+
+void ApiPhases(const Config& config, Zset<int>& z, Workload& w) {
+  uint64_t n = config.size, ops = config.ops;
+  strs members;
+  pairs<int> mss;
+  RunPhase(config, "Zscore", ops, [&]() {
+    return z.Zscore(w.Member(w.Existing())).first;
+  });
+  RunPhase(config, "Zrank", ops, [&]() {
+    return z.Zrank(w.Member(w.Existing())) > 0;
+  });
+  RunPhase(config, "Zrevrank", ops, [&]() {
+    return z.Zrevrank(w.Member(w.Existing())) > 0;
+  });
+  for (auto [name, offset] : {std::make_pair("Zrange head", uint64_t(1)),
+                              std::make_pair("Zrange middle", n / 2),
+                              std::make_pair("Zrange tail", n - 9)}) {
+    RunPhase(config, std::string(name) + " x10", ops, [&, offset = offset]() {
+      z.Zrange(&mss, offset, offset + 9);
+      return true;
+    });
+  }
+  RunPhase(config, "Zrevrange x10", ops, [&]() {
+    uint64_t start = w.Uniform(n - 9) + 1;
+    z.Zrevrange(&members, start, start + 9);
+    return true;
+  });
+  RunPhase(config, "Zrangebyscore x10", ops, [&]() {
+    int min_score = w.Uniform(n);
+    z.Zrangebyscore(&mss, min_score, min_score + 9);
+    return true;
+  });
+  RunPhase(config, "Zcount", ops, [&]() {
+    int min_score = w.Uniform(n);
+    z.Zcount(min_score, min_score + int(n / 100));
+    return true;
+  });
+  RunPhase(config, "Zincrby", ops, [&]() {
+    z.Zincrby(w.Member(w.Existing()), 1);
+    return true;
+  });
+  // Removals put the members back uncounted, to keep the size stable
+  bool removed = false;
+  std::string member;
+  RunPhase(config, "Zrem", ops * 2, [&]() {
+    if (removed) {
+      z.Zadd(member, w.Score(w.Uniform(n)));
+      return removed = false;
+    }
+    member = w.Member(w.Existing());
+    return removed = z.Zrem(member);
+  });
+  RunPhase(config, "Zpopmax", ops * 2, [&]() {
+    if (removed) {
+      z.Zadd(mss[0].first, mss[0].second);
+      return removed = false;
+    }
+    return removed = z.Zpopmax(&mss);
+  });
+  RunPhase(config, "Zremrangebyrank x10", std::min<uint64_t>(ops, n / 10) * 2, [&]() {
+    if (removed) {
+      for (auto& [m, s] : mss) {
+        z.Zadd(m, s);
+      }
+      return removed = false;
+    }
+    uint64_t start = w.Uniform(n - 9) + 1;
+    z.Zrange(&mss, start, start + 9);
+    z.Zremrangebyrank(start, start + 9);
+    return removed = true;
+  });
+  // Set ops against a second zset of a tenth of the members
+  Zset<int> other(config.db_path + "_other", config.dict_type);
+  pairs<int> other_pairs;
+  for (uint64_t i = 0; i < std::max<uint64_t>(n / 10, 1); i ++) {
+    uint64_t id = w.Uniform(n);
+    other_pairs.emplace_back(w.Member(id), w.Score(id));
+  }
+  other.BulkLoad(std::move(other_pairs));
+  int round = 0;
+  RunPhase(config, "Zinterstore", 3, [&]() {
+    auto name = config.db_path + "_inter_" + std::to_string(round ++);
+    auto inter = z.Zinterstore(&other, name, config.dict_type);
+    inter.reset();
+    std::filesystem::remove_all(name);
+    return true;
+  });
+  RunPhase(config, "Zunionstore", 3, [&]() {
+    auto name = config.db_path + "_union_" + std::to_string(round ++);
+    auto u = z.Zunionstore(&other, name, config.dict_type);
+    u.reset();
+    std::filesystem::remove_all(name);
+    return true;
+  });
+}
+
+/*
+  YCSB core workloads, mapped to zset calls:
+    A  50% Zscore, 50% Zincrby                update heavy
+    B  95% Zscore,  5% Zincrby                read mostly
+    C 100% Zscore                             read only
+    D  95% Zscore of latest,  5% Zadd new     read latest
+    E  95% Zrangebyscore x100, 5% Zadd new    short ranges
+    F  50% Zscore, 50% Zscore + Zadd          read-modify-write
+*/
+void YcsbPhases(const Config& config, Zset<int>& z, Workload& w) {
+  pairs<int> mss;
+  auto read = [&](uint64_t id) {
+    z.Zscore(w.Member(id));
+    return true;
+  };
+  auto insert = [&]() {
+    uint64_t id = w.Insert();
+    z.Zadd(w.Member(id), w.Score(id % config.size));
+    return true;
+  };
+  RunPhase(config, "YCSB-A", config.ops, [&]() {
+    if (w.Uniform(100) < 50) {
+      return read(w.Existing());
+    }
+    z.Zincrby(w.Member(w.Existing()), 1);
+    return true;
+  });
+  RunPhase(config, "YCSB-B", config.ops, [&]() {
+    if (w.Uniform(100) < 95) {
+      return read(w.Existing());
+    }
+    z.Zincrby(w.Member(w.Existing()), 1);
+    return true;
+  });
+  RunPhase(config, "YCSB-C", config.ops, [&]() {
+    return read(w.Existing());
+  });
+  RunPhase(config, "YCSB-D", config.ops, [&]() {
+    return w.Uniform(100) < 95 ? read(w.Latest()) : insert();
+  });
+  RunPhase(config, "YCSB-E", config.ops, [&]() {
+    if (w.Uniform(100) < 5) {
+      return insert();
+    }
+    auto [found, score] = z.Zscore(w.Member(w.Existing()));
+    z.Zrangebyscore(&mss, score, std::numeric_limits<int>::max(),
+                    w.Uniform(100) + 1);
+    return true;
+  });
+  RunPhase(config, "YCSB-F", config.ops, [&]() {
+    std::string member = w.Member(w.Existing());
+    auto [found, score] = z.Zscore(member);
+    if (w.Uniform(100) < 50) {
+      z.Zadd(member, score + 1);
+    }
+    return true;
+  });
+}
+
+////////////////////////////// END Phases //////////////////////////////
+
+void Benchmark(const Config& config) {
+  printf("\n\t===== Benchmark %s size=%lu dist=%s scores=%s \t=====\n",
+         config.dict_name.data(), (unsigned long)config.size,
+         config.dist.data(), config.scores.data());
+  std::filesystem::remove_all(config.db_path);
+  std::filesystem::remove_all(config.db_path + "_other");
+  {
+    Workload w(config);
+    Zset<int> z(config.db_path, config.dict_type);
+    uint64_t id = 0;
+    RunPhase(config, "Zadd", config.size, [&]() {
+      z.Zadd(w.Member(id), w.Score(id));
+      id ++;
+      return true;
+    });
+    ApiPhases(config, z, w);
+    YcsbPhases(config, z, w);
+  }
+  std::filesystem::remove_all(config.db_path);
+  std::filesystem::remove_all(config.db_path + "_other");
+}
+
+void WriteJson(const std::string& path) {
+  FILE* f = fopen(path.data(), "w");
+  if (!f) {
+    perror(path.data());
+    return;
+  }
+  fprintf(f, "[\n");
+  for (size_t i = 0; i < results.size(); i ++) {
+    auto& [config, r] = results[i];
+    fprintf(f, "  {\"dict\": \"%s\", \"size\": %lu, \"dist\": \"%s\", \"scores\": \"%s\", "
+               "\"phase\": \"%s\", \"ops\": %lu, \"ops_per_sec\": %.1f, "
+               "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, "
+               "\"allocs_per_op\": %.2f}%s\n",
+            config.dict_name.data(), (unsigned long)config.size, config.dist.data(),
+            config.scores.data(), r.phase.data(), (unsigned long)r.ops,
+            r.ops / std::max(r.seconds, 1e-9), r.latency.Percentile(0.5),
+            r.latency.Percentile(0.99), r.latency.Percentile(0.999),
+            r.latency.max_ns / 1e3, double(r.allocs) / std::max<uint64_t>(r.ops, 1),
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "]\n");
+  fclose(f);
+}
+
+std::vector<std::string> Split(const std::string& s) {
+  std::vector<std::string> items;
+  size_t begin = 0;
+  for (size_t end; (end = s.find(',', begin)) != std::string::npos; begin = end + 1) {
+    items.push_back(s.substr(begin, end - begin));
+  }
+  items.push_back(s.substr(begin));
+  return items;
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> dicts = {"robin", "rocksdb"};
+  std::vector<std::string> sizes = {"1000000"};
+  std::vector<std::string> dists = {"uniform", "zipfian"};
+  std::vector<std::string> scores = {"random"};
+  uint64_t ops = 100'000;
+  std::string json;
+  for (int i = 1; i < argc; i ++) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    std::string name = arg.substr(0, eq), value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    if (name == "--dicts") {
+      dicts = Split(value);
+    } else if (name == "--sizes") {
+      sizes = Split(value);
+    } else if (name == "--dists") {
+      dists = Split(value);
+    } else if (name == "--scores") {
+      scores = Split(value);
+    } else if (name == "--ops") {
+      ops = std::stoull(value);
+    } else if (name == "--json") {
+      json = value;
+    } else {
+      fprintf(stderr, "usage: %s [--dicts=robin,rocksdb,log] [--sizes=10000,...] "
+                      "[--dists=uniform,zipfian] [--scores=random,sequential] "
+                      "[--ops=N] [--json=path]\n", argv[0]);
+      return 1;
+    }
+  }
+  for (auto& dict : dicts) {
+    for (auto& size : sizes) {
+      for (auto& dist : dists) {
+        for (auto& score : scores) {
+          Config config;
+          config.dict_name = dict == "rocksdb" ? "ROCKSDB_DICT" :
+                             dict == "log" ? "LOG_DICT" : "ROBIN_MAP_DICT";
+          config.db_path = config.dict_name + "_" + std::to_string(results.size());
+          config.dict_type = dict == "rocksdb" ? ROCKSDB_DICT :
+                             dict == "log" ? LOG_DICT : ROBIN_MAP_DICT;
+          config.size = std::max<uint64_t>(std::stoull(size), 100);
+          config.dist = dist;
+          config.scores = score;
+          config.ops = ops;
+          Benchmark(config);
+        }
+      }
+    }
+  }
+  if (!json.empty()) {
+    WriteJson(json);
+  }
+  puts("");
+}
@@ -23,6 +23,22 @@ struct CustomScore {
   }
 };
 
+// Optional: index the scores in rocksdb, so that long ranges are read
+// in score order by one iterator. Encode x then y, as operator< compares
+template <>
+struct ZSET::ScoreTraits<CustomScore> {
+  static constexpr bool kOrdered = true;
+  static constexpr size_t kSize = ScoreTraits<int>::kSize + ScoreTraits<double>::kSize;
+  static void Encode(const CustomScore& score, char* buf) {
+    ScoreTraits<int>::Encode(score.x, buf);
+    ScoreTraits<double>::Encode(score.y, buf + ScoreTraits<int>::kSize);
+  }
+  static CustomScore Decode(const char* buf) {
+    return CustomScore(ScoreTraits<int>::Decode(buf),
+                       ScoreTraits<double>::Decode(buf + ScoreTraits<int>::kSize));
+  }
+};
+
 int main() {
   eval(has_less);
   eval(has_plus_assign);
@@ -33,4 +49,11 @@ int main() {
   z.Zadd("B", CustomScore(1, 2.3));
   z.Zadd("C", CustomScore(4, 5.6));
   assert(2 == z.Zrank("B"));
+
+  for (int i = 0; i < 100; i ++) {
+    z.Zadd(std::to_string(i), CustomScore(i % 10, -i));
+  }
+  pairs<CustomScore> result;
+  z.Zrange(&result, 1, 22);
+  assert("90" == result[0].first && "91" == result[10].first && "B" == result[21].first);
 }
@@ -1,7 +1,18 @@
 
  // coldcolacos@gmail.com
 
+#include <climits>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <thread>
+
+// Small segments, so that the tests roll and merge them
+#define LOG_DICT_SEGMENT_SIZE (size_t(64) << 10)
+
 #include "gtest/gtest.h"
+#include "zset/concurrent_zset.h"
 #include "zset/zset.h"
 
 using namespace ZSET;
@@ -206,6 +217,15 @@ TEST_P(TestZset, case_6_Zrangebyscore_Zremrangebyscore) {
   test_zset.Zremrangebyscore(7690, 8000);
   test_zset.Zremrangebyscore(-30, 500);
   EXPECT_EQ(count, test_zset.Zcard());
+
+  // Empty zsets have no links to walk
+  Zset<int> empty_zset("test_case_6_empty", GetParam());
+  ZSET::strs members;
+  EXPECT_EQ(0, empty_zset.Zrangebyscore(&result, 0, 10));
+  EXPECT_EQ(0, empty_zset.Zrangebyscore(&members, 0, 10, 1));
+  EXPECT_EQ(0, empty_zset.Zrevrangebyscore(&members, 10, 0));
+  EXPECT_EQ(0, empty_zset.Zrevrangebyscore(&members, 10, 0, 1));
+  EXPECT_TRUE(result.empty() && members.empty());
 }
 
 TEST_P(TestZset, case_7_Zpopmax_Zpopmin) {
@@ -269,4 +289,1292 @@ TEST_P(TestZset, case_8_Zinterstore_Zunionstore) {
   CheckZset(union_map, *union_zset);
 }
 
-INSTANTIATE_TEST_CASE_P(Zset, TestZset, testing::Values(ROBIN_MAP_DICT, ROCKSDB_DICT));
+TEST_P(TestZset, case_9_long_members) {
+  std::unordered_map<std::string, int> std_map;
+  {
+    Zset<int> test_zset("test_case_9", GetParam());
+    for (int i = 1; i <= 5000; i ++) {
+      std::string mbr = "https://example.com/" + std::string(rand() % 180, 'x')
+                      + std::to_string(i);
+      int score = rand() % 1000;
+      std_map[mbr] = score;
+      test_zset.Zadd(mbr, score);
+    }
+    CheckZset(std_map, test_zset);
+    EXPECT_THROW(test_zset.Zadd(std::string(1025, 'y'), 1), std::length_error);
+  }
+  if (GetParam() == ROCKSDB_DICT) {
+    Zset<int> test_zset("test_case_9", GetParam());
+    CheckZset(std_map, test_zset);
+  }
+}
+
+TEST(TestZsetStore, case_10_shared_store) {
+  std::vector<std::unordered_map<std::string, int>> std_maps(3);
+  {
+    auto store = std::make_shared<RocksdbStore>("test_case_10");
+    std::vector<std::unique_ptr<Zset<int>>> zsets;
+    for (int k = 0; k < 3; k ++) {
+      zsets.emplace_back(new Zset<int>(store, "zset_" + std::to_string(k)));
+    }
+    for (int i = 0; i < 30000; i ++) {
+      int k = rand() % 3;
+      std::string mbr = std::to_string(rand() % 2000);
+      if (rand() % 10 == 1) {
+        std_maps[k].erase(mbr);
+        zsets[k]->Zrem(mbr);
+      } else {
+        int score = rand() % 5000;
+        std_maps[k][mbr] = score;
+        zsets[k]->Zadd(mbr, score);
+      }
+    }
+    for (int k = 0; k < 3; k ++) {
+      CheckZset(std_maps[k], *zsets[k]);
+    }
+    EXPECT_THROW(Zset<int>(store, "zset_0", true), std::invalid_argument);
+  }
+  auto store = std::make_shared<RocksdbStore>("test_case_10");
+  for (int k = 0; k < 3; k ++) {
+    Zset<int> test_zset(store, "zset_" + std::to_string(k));
+    CheckZset(std_maps[k], test_zset);
+  }
+}
+
+TEST_P(TestZset, case_11_concurrent_zset) {
+  ConcurrentZset<int> test_zset("test_case_11", GetParam());
+  for (int i = 0; i < 1000; i ++) {
+    test_zset.Zadd(std::to_string(i), i);
+  }
+  std::vector<std::thread> readers;
+  std::atomic<int> errors(0);
+  for (int t = 0; t < 4; t ++) {
+    readers.emplace_back([&]() {
+      for (int i = 0; i < 20000; i ++) {
+        int x = i % 1000;
+        auto [found, score] = test_zset.Zscore(std::to_string(x));
+        errors += !found || score != x;
+        errors += test_zset.Zrank(std::to_string(x)) != uint32_t(x + 1);
+        ZSET::strs result;
+        test_zset.Zrange(&result, 1, 3);
+        errors += result.size() != 3 || result[0] != "0";
+      }
+    });
+  }
+  // Members above 1000 never move members below
+  for (int i = 1000; i < 3000; i ++) {
+    test_zset.Zadd(std::to_string(i), i);
+    test_zset.Zincrby(std::to_string(i), 1);
+  }
+  for (auto& t : readers) {
+    t.join();
+  }
+  EXPECT_EQ(0, errors);
+  EXPECT_EQ(3000, test_zset.Zcard());
+  EXPECT_EQ(2000, test_zset.Read([](const Zset<int>& z) {
+    return z.Zcount(1001, 3000);
+  }));
+}
+
+TEST_P(TestZset, case_12_ZaddMany_ZscoreMany_ZremMany) {
+  std::unordered_map<std::string, int> std_map;
+  Zset<int> test_zset("test_case_12", GetParam());
+  for (int round = 0; round < 50; round ++) {
+    ZSET::pairs<int> batch;
+    ZSET::strs members;
+    for (int i = 0; i < 2000; i ++) {
+      std::string mbr = std::to_string(rand() % 20000);
+      int score = rand() % 3000;
+      batch.emplace_back(mbr, score);
+      members.push_back(mbr);
+    }
+    uint32_t added = 0;
+    for (auto& [mbr, score] : batch) {
+      added += std_map.count(mbr) == 0;
+      std_map[mbr] = score;
+    }
+    EXPECT_EQ(added, test_zset.ZaddMany(batch));
+
+    std::vector<std::pair<bool, int>> scores;
+    test_zset.ZscoreMany(members, &scores);
+    EXPECT_EQ(members.size(), scores.size());
+    for (size_t i = 0; i < members.size(); i ++) {
+      EXPECT_TRUE(scores[i].first);
+      EXPECT_EQ(std_map[members[i]], scores[i].second);
+    }
+
+    members.resize(500);
+    members.push_back("not-a-member");
+    uint32_t removed = 0;
+    for (auto& mbr : members) {
+      removed += std_map.erase(mbr);
+    }
+    EXPECT_EQ(removed, test_zset.ZremMany(members));
+    EXPECT_EQ(std_map.size(), test_zset.Zcard());
+  }
+  CheckZset(std_map, test_zset);
+}
+
+TEST_P(TestZset, case_13_BulkLoad) {
+  std::unordered_map<std::string, int> std_map;
+  {
+    Zset<int> test_zset("test_case_13", GetParam());
+    ZSET::pairs<int> members_and_scores;
+    for (int i = 0; i < 50000; i ++) {
+      std::string mbr = std::to_string(rand() % 30000);
+      int score = rand() % 5000;
+      members_and_scores.emplace_back(mbr, score);
+      std_map[mbr] = score;
+    }
+    EXPECT_EQ(std_map.size(), test_zset.BulkLoad(members_and_scores));
+    CheckZset(std_map, test_zset);
+    EXPECT_THROW(test_zset.BulkLoad({{"a", 1}}), std::logic_error);
+    for (int i = 0; i < 5000; i ++) {
+      std::string mbr = std::to_string(rand() % 30000);
+      if (rand() % 2) {
+        std_map.erase(mbr);
+        test_zset.Zrem(mbr);
+      } else {
+        int score = rand() % 5000;
+        std_map[mbr] = score;
+        test_zset.Zadd(mbr, score);
+      }
+    }
+    CheckZset(std_map, test_zset);
+  }
+  if (GetParam() == ROCKSDB_DICT) {
+    Zset<int> test_zset("test_case_13", GetParam());
+    CheckZset(std_map, test_zset);
+  }
+  Zset<int> sorted_zset("test_case_13_sorted", GetParam());
+  EXPECT_THROW(sorted_zset.BulkLoad({{"b", 1}, {"a", 1}}, true),
+               std::invalid_argument);
+  EXPECT_EQ(2, sorted_zset.BulkLoad({{"a", 1}, {"b", 1}, {"a", 2}}));
+  EXPECT_EQ(2, sorted_zset.Zscore("a").second);
+  EXPECT_EQ(2, sorted_zset.Zrank("a"));
+}
+
+TEST_P(TestZset, case_14_cursors) {
+  Zset<int> test_zset("test_case_14", GetParam());
+  char buffer[10];
+  for (int i = 1; i <= 20000; i ++) {
+    sprintf(buffer, "%06d", i);
+    test_zset.Zadd(buffer, i / 4);
+  }
+  ZSET::pairs<int> expected;
+  test_zset.Zrange(&expected, 1234, 5678);
+  for (int reverse = 0; reverse < 2; reverse ++) {
+    ZSET::pairs<int> result;
+    std::vector<uint32_t> ranks;
+    for (auto c = test_zset.ZrangeCursor(1234, 5678, reverse); c.Valid(); c.Next()) {
+      result.emplace_back(c.member(), c.score());
+      ranks.push_back(c.rank());
+    }
+    if (reverse) {
+      std::reverse(result.begin(), result.end());
+      std::reverse(ranks.begin(), ranks.end());
+    }
+    EXPECT_EQ(expected, result);
+    for (int i = 0; i < ranks.size(); i ++) {
+      EXPECT_EQ(1234 + i, ranks[i]);
+    }
+  }
+
+  // Pause, write, then resume from the rank of the last member seen
+  ZSET::strs members;
+  auto c = test_zset.ZrangebyscoreCursor(100, 199);
+  uint32_t last_rank = 0;
+  for (int i = 0; i < 150; i ++, c.Next()) {
+    members.emplace_back(c.member());
+    last_rank = c.rank();
+  }
+  test_zset.Zadd("999999", 5000);
+  for (c = test_zset.ZrangeCursor(last_rank + 1, test_zset.Zcount(-1, 199));
+       c.Valid(); c.Next()) {
+    members.emplace_back(c.member());
+  }
+  ZSET::strs expected_members;
+  test_zset.Zrangebyscore(&expected_members, 100, 199);
+  EXPECT_EQ(expected_members, members);
+
+  EXPECT_FALSE(test_zset.ZrangebyscoreCursor(7, 6).Valid());
+  EXPECT_FALSE(test_zset.ZrangeCursor(30000, 40000).Valid());
+  auto lc = test_zset.ZrangebylexCursor("000010", false, "000013", true, true);
+  for (int i = 13; i > 10; i --, lc.Next()) {
+    sprintf(buffer, "%06d", i);
+    EXPECT_TRUE(lc.Valid());
+    EXPECT_EQ(buffer, lc.member());
+  }
+  EXPECT_FALSE(lc.Valid());
+}
+
+TEST_P(TestZset, case_15_reverse_traversal) {
+  std::unordered_map<std::string, int> std_map;
+  {
+    Zset<int> test_zset("test_case_15", GetParam());
+    for (int i = 0; i < 30000; i ++) {
+      std::string mbr = std::to_string(rand() % 10000);
+      if (rand() % 5 == 1) {
+        std_map.erase(mbr);
+        test_zset.Zrem(mbr);
+      } else {
+        int score = rand() % 3000;
+        std_map[mbr] = score;
+        test_zset.Zadd(mbr, score);
+      }
+    }
+    ZSET::pairs<int> popped;
+    EXPECT_EQ(50, test_zset.Zpopmax(&popped, 50));
+    for (int i = 0; i < popped.size(); i ++) {
+      EXPECT_EQ(std_map[popped[i].first], popped[i].second);
+      std_map.erase(popped[i].first);
+    }
+    CheckZset(std_map, test_zset);
+    ZSET::strs members;
+    std::pair<int, std::string> max_pair;
+    for (auto& [mbr, score] : std_map) {
+      max_pair = std::max(max_pair, std::make_pair(score, mbr));
+    }
+    EXPECT_EQ(1, test_zset.Zpopmax(&members));
+    EXPECT_EQ(max_pair.second, members[0]);
+    std_map.erase(members[0]);
+  }
+  Zset<int> test_zset("test_case_15", GetParam());
+  if (GetParam() == ROBIN_MAP_DICT) {
+    for (auto& [mbr, score] : std_map) {
+      test_zset.Zadd(mbr, score);
+    }
+  }
+  CheckZset(std_map, test_zset);
+
+  ZSET::strs forward, backward;
+  test_zset.Zrange(&forward, 1, test_zset.Zcard());
+  EXPECT_EQ(forward.size(), test_zset.Zrevrange(&backward, 1, test_zset.Zcard()));
+  std::reverse(backward.begin(), backward.end());
+  EXPECT_EQ(forward, backward);
+
+  test_zset.Zrevrange(&backward, 3, 12, 5);
+  EXPECT_EQ(5, backward.size());
+  for (int i = 0; i < backward.size(); i ++) {
+    EXPECT_EQ(3 + i, test_zset.Zrevrank(backward[i]));
+  }
+
+  test_zset.Zrangebyscore(&forward, 100, 200);
+  test_zset.Zrevrangebyscore(&backward, 200, 100);
+  std::reverse(backward.begin(), backward.end());
+  EXPECT_EQ(forward, backward);
+  EXPECT_EQ(7, test_zset.Zrevrangebyscore(&backward, 200, 100, 7));
+  EXPECT_EQ(forward.back(), backward.front());
+
+  ZSET::strs all;
+  EXPECT_EQ(std_map.size(), test_zset.Zpopmax(&all, test_zset.Zcard() + 1));
+  EXPECT_EQ(0, test_zset.Zcard());
+  test_zset.Zadd("a", 1);
+  EXPECT_EQ(1, test_zset.Zrevrange(&all, 1, 1));
+  EXPECT_EQ("a", all[0]);
+}
+
+TEST(TestZsetStore, case_16_node_cache_budget) {
+  auto store = std::make_shared<RocksdbStore>("test_case_16", false,
+                                              64 << 20, 1 << 20);
+  std::unordered_map<std::string, int> std_map;
+  Zset<int> test_zset(store, "zset");
+  for (int i = 0; i < 50000; i ++) {
+    std::string mbr = std::to_string(rand() % 20000);
+    if (rand() % 10 == 1) {
+      std_map.erase(mbr);
+      test_zset.Zrem(mbr);
+    } else {
+      int score = rand() % 5000;
+      std_map[mbr] = score;
+      test_zset.Zadd(mbr, score);
+    }
+  }
+  CheckZset(std_map, test_zset);
+  auto stats = test_zset.CacheStats();
+  EXPECT_GT(stats.hit_count, 0);
+  EXPECT_GT(stats.miss_count, 0);
+  EXPECT_LT(stats.charge, 2 << 20);
+  EXPECT_GT(stats.pinned_charge, 0);
+
+  // A full sweep does not flush the nodes of upper levels
+  ZSET::strs members;
+  test_zset.Zrange(&members, 1, test_zset.Zcard());
+  EXPECT_GT(test_zset.CacheStats().pinned_charge, 0);
+}
+
+TEST(TestZsetStore, case_17_durability) {
+  for (auto mode : {DURABILITY_BATCH, DURABILITY_SYNC,
+                    DURABILITY_GROUP_COMMIT, DURABILITY_NO_WAL}) {
+    std::string path = "test_case_17_" + std::to_string(mode);
+    std::unordered_map<std::string, int> std_map;
+    auto store = std::make_shared<RocksdbStore>(path);
+    {
+      Zset<int> test_zset(store, "zset");
+      Durability durability;
+      durability.mode = mode;
+      durability.batch_size = 100;
+      test_zset.SetDurability(durability);
+      for (int i = 0; i < 5000; i ++) {
+        std::string mbr = std::to_string(rand() % 2000);
+        if (rand() % 10 == 1) {
+          std_map.erase(mbr);
+          test_zset.Zrem(mbr);
+        } else {
+          int score = rand() % 5000;
+          std_map[mbr] = score;
+          test_zset.Zadd(mbr, score);
+        }
+      }
+      CheckZset(std_map, test_zset);
+      if (mode == DURABILITY_GROUP_COMMIT) {
+        // Written in background within interval_ms, with no further call
+        test_zset.Zadd("group-commit", 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        std::string value;
+        EXPECT_TRUE(store->db()->Get(ROCKSDB_NAMESPACE::ReadOptions(),
+                                     RocksdbStore::KeyPrefix("zset") + "group-commit",
+                                     &value).ok());
+        test_zset.Zrem("group-commit");
+      }
+    }
+    Zset<int> test_zset(store, "zset");
+    CheckZset(std_map, test_zset);
+  }
+
+  // Group commit lookups read the nodes of batches not yet written
+  // rather than wait for them, even once evicted from a tiny cache
+  auto store = std::make_shared<RocksdbStore>("test_case_17_pending", false, 64 << 20, 1);
+  std::unordered_map<std::string, int> std_map;
+  {
+    Zset<int> test_zset(store, "zset");
+    Durability durability;
+    durability.mode = DURABILITY_GROUP_COMMIT;
+    durability.batch_size = 1000000;
+    durability.interval_ms = 60000;
+    test_zset.SetDurability(durability);
+    auto flushes = test_zset.Stats().dict.flushes;
+    for (int i = 0; i < 3000; i ++) {
+      std::string mbr = std::to_string(i);
+      std_map[mbr] = i;
+      test_zset.Zadd(mbr, i);
+    }
+    for (int i = 0; i < 3000; i ++) {
+      std::string mbr = std::to_string(rand() % 3000);
+      if (i % 5 == 0) {
+        std_map.erase(mbr);
+        test_zset.Zrem(mbr);
+      } else {
+        std_map[mbr] = rand() % 5000;
+        test_zset.Zadd(mbr, std_map[mbr]);
+      }
+      EXPECT_EQ(std_map.count(mbr) == 1, test_zset.Zscore(mbr).first);
+    }
+    EXPECT_EQ(flushes, test_zset.Stats().dict.flushes);
+    CheckZset(std_map, test_zset);
+  }
+  Zset<int> test_zset(store, "zset");
+  CheckZset(std_map, test_zset);
+}
+
+TEST_P(TestZset, case_18_multiway_store) {
+  std::vector<std::unique_ptr<Zset<int>>> zsets;
+  std::vector<Zset<int>*> others;
+  std::vector<double> weights = {1, 2, 3, -1};
+  std::unordered_map<std::string, std::vector<int>> std_scores;
+  for (int z = 0; z < 4; z ++) {
+    zsets.emplace_back(new Zset<int>("test_case_18_" + std::to_string(z), GetParam()));
+    if (z) {
+      others.push_back(zsets.back().get());
+    }
+    for (int i = 0; i < 2000; i ++) {
+      std::string mbr = std::to_string(rand() % 1000);
+      int score = rand() % 1000;
+      if (zsets[z]->Zadd(mbr, score) == 0) {
+        std_scores[mbr].pop_back();
+      }
+      std_scores[mbr].push_back(score * weights[z]);
+    }
+  }
+  for (auto aggregate : {AGGREGATE_SUM, AGGREGATE_MIN, AGGREGATE_MAX}) {
+    std::unordered_map<std::string, int> inter_map, union_map;
+    for (auto& [mbr, scores] : std_scores) {
+      int score = scores[0];
+      for (size_t i = 1; i < scores.size(); i ++) {
+        score = aggregate == AGGREGATE_SUM ? score + scores[i]
+              : aggregate == AGGREGATE_MIN ? std::min(score, scores[i])
+                                           : std::max(score, scores[i]);
+      }
+      union_map[mbr] = score;
+      if (scores.size() == zsets.size()) {
+        inter_map[mbr] = score;
+      }
+    }
+    std::string name = "test_case_18_" + std::to_string(aggregate);
+    auto inter_zset = zsets[0]->Zinterstore(others, name + "_inter",
+                                            GetParam(), weights, aggregate);
+    CheckZset(inter_map, *inter_zset);
+    auto union_zset = zsets[0]->Zunionstore(others, name + "_union",
+                                            GetParam(), weights, aggregate);
+    CheckZset(union_map, *union_zset);
+  }
+  EXPECT_THROW(zsets[0]->Zunionstore(others, "test_case_18_bad", GetParam(), {1, 2}),
+               std::invalid_argument);
+}
+
+TEST_P(TestZset, case_19_stats) {
+  ConcurrentZset<int> test_zset("test_case_19", GetParam());
+  test_zset.SetStatsLevel(STATS_LATENCY);
+  for (int i = 0; i < 1000; i ++) {
+    test_zset.Zadd(std::to_string(i), i);
+  }
+  for (int i = 0; i < 100; i ++) {
+    test_zset.Zincrby(std::to_string(i), 1);
+    test_zset.Zscore(std::to_string(i));
+  }
+  auto stats = test_zset.Stats();
+  EXPECT_EQ(1000, stats.ops[OP_ZADD].calls);
+  // Zadd called by Zincrby is recorded as Zincrby only
+  EXPECT_EQ(100, stats.ops[OP_ZINCRBY].calls);
+  EXPECT_EQ(100, stats.ops[OP_ZSCORE].calls);
+  EXPECT_GE(stats.ops[OP_ZSCORE].dict_finds, 100);
+  EXPECT_GT(stats.ops[OP_ZADD].p50_ns, 0);
+  EXPECT_LE(stats.ops[OP_ZADD].p50_ns, stats.ops[OP_ZADD].p999_ns);
+  EXPECT_EQ(0, stats.ops[OP_ZRANK].calls);
+  if (GetParam() == ROCKSDB_DICT) {
+    EXPECT_GT(stats.dict.dirty_count, 0);
+    EXPECT_FALSE(stats.store.empty());
+    // Flush the write batch
+    test_zset.SetDurability(Durability());
+    stats = test_zset.Stats();
+    EXPECT_EQ(0, stats.dict.dirty_count);
+    EXPECT_GT(stats.dict.flushes, 0);
+    EXPECT_GT(stats.dict.flushed_keys, 0);
+  }
+  EXPECT_NE(std::string::npos, stats.ToString().find("Zincrby"));
+
+  test_zset.SetStatsLevel(STATS_NONE);
+  test_zset.Zrank("1");
+  EXPECT_EQ(0, test_zset.Stats().ops[OP_ZRANK].calls);
+
+  // Snapshots through the lock
+  test_zset.SaveSnapshot("test_case_19.snap");
+  ConcurrentZset<int> loaded("test_case_19_loaded", GetParam());
+  EXPECT_EQ(1000, loaded.LoadSnapshot("test_case_19.snap"));
+  EXPECT_EQ(test_zset.Zscore("1"), loaded.Zscore("1"));
+  if (GetParam() != ROCKSDB_DICT) {
+    EXPECT_TRUE(test_zset.BgSaveSnapshot("test_case_19.snap").get());
+  }
+}
+
+template <typename _T>
+void CheckScoreOrder(const std::vector<_T>& ascending) {
+  std::string prev;
+  for (auto& score : ascending) {
+    std::string key(ScoreTraits<_T>::kSize, '\0');
+    ScoreTraits<_T>::Encode(score, &key[0]);
+    EXPECT_EQ(score, ScoreTraits<_T>::Decode(key.data()));
+    if (!prev.empty()) {
+      EXPECT_LT(prev, key);
+    }
+    prev = key;
+  }
+}
+
+TEST(TestZsetStore, case_20_score_index) {
+  CheckScoreOrder<int>({INT_MIN, -70000, -1, 0, 1, 255, 256, INT_MAX});
+  CheckScoreOrder<uint16_t>({0, 1, 255, 256, 65535});
+  CheckScoreOrder<double>({-INFINITY, -1e300, -1.5, -1e-300, 0, 1e-300, 2.5, INFINITY});
+  std::string zero(8, '\0'), negative_zero(8, '\0');
+  ScoreTraits<double>::Encode(0.0, &zero[0]);
+  ScoreTraits<double>::Encode(-0.0, &negative_zero[0]);
+  EXPECT_EQ(zero, negative_zero);
+
+  auto store = std::make_shared<RocksdbStore>("test_case_20");
+  std::set<std::pair<double, std::string>> std_set;
+  std::unordered_map<std::string, double> std_map;
+  auto check = [&](Zset<double>& test_zset) {
+    std::vector<std::pair<double, std::string>> v(std_set.begin(), std_set.end());
+    pairs<double> result;
+    strs members;
+    for (int t = 0; t < 20; t ++) {
+      uint32_t start = rand() % (v.size() + 2), stop = start + rand() % 200;
+      uint32_t expected = start > v.size() ? 0 : std::min<uint32_t>(stop, v.size()) + 1 - std::max(1u, start);
+      test_zset.Zrange(&result, start, stop);
+      ASSERT_EQ(expected, result.size());
+      for (uint32_t i = std::max(1u, start); i <= std::min<uint32_t>(stop, v.size()); i ++) {
+        ASSERT_EQ(v[i - 1].second, result[i - std::max(1u, start)].first);
+        EXPECT_EQ(v[i - 1].first, result[i - std::max(1u, start)].second);
+      }
+      test_zset.Zrevrange(&members, start, stop);
+      ASSERT_EQ(expected, members.size());
+      for (uint32_t i = std::max(1u, start); i <= std::min<uint32_t>(stop, v.size()); i ++) {
+        ASSERT_EQ(v[v.size() - i].second, members[i - std::max(1u, start)]);
+      }
+      double min_score = rand() % 2000 - 1000, max_score = min_score + rand() % 300;
+      test_zset.Zrangebyscore(&result, min_score, max_score);
+      auto it = std_set.lower_bound({min_score, ""});
+      for (auto& [member, score] : result) {
+        ASSERT_EQ(it->second, member);
+        it ++;
+      }
+      EXPECT_EQ(test_zset.Zcount(min_score, max_score), result.size());
+      EXPECT_TRUE(it == std_set.end() || it->first > max_score);
+      test_zset.Zrevrangebyscore(&members, max_score, min_score);
+      EXPECT_EQ(result.size(), members.size());
+      for (size_t i = 0; i < members.size(); i ++) {
+        ASSERT_EQ(result[result.size() - 1 - i].first, members[i]);
+      }
+    }
+  };
+  {
+    Zset<double> test_zset(store, "zset");
+    for (int i = 0; i < 5000; i ++) {
+      std::string mbr = std::to_string(rand() % 2000);
+      if (std_map.count(mbr)) {
+        std_set.erase({std_map[mbr], mbr});
+        std_map.erase(mbr);
+      }
+      if (rand() % 10 == 0) {
+        test_zset.Zrem(mbr);
+      } else {
+        double score = (rand() % 2000 - 1000) / 2.0;
+        test_zset.Zadd(mbr, score);
+        std_map[mbr] = score;
+        std_set.emplace(score, mbr);
+      }
+      if (i % 1000 == 0) {
+        check(test_zset);
+      }
+    }
+    check(test_zset);
+    // Served by the index, without a node lookup per member
+    auto finds = test_zset.Stats().ops[OP_ZRANGE].dict_finds;
+    pairs<double> result;
+    EXPECT_EQ(std_set.size(), test_zset.Zrangebyscore(&result, -1000, 1000));
+    EXPECT_EQ(finds, test_zset.Stats().ops[OP_ZRANGE].dict_finds);
+
+    // Updates not yet persisted are merged into the scans, not flushed
+    test_zset.SetDurability(Durability{DURABILITY_BATCH, 1000});
+    auto flushes = test_zset.Stats().dict.flushes;
+    for (int i = 0; i < 100; i ++) {
+      std::string mbr = std::to_string(rand() % 2000);
+      if (std_map.count(mbr)) {
+        std_set.erase({std_map[mbr], mbr});
+        std_map.erase(mbr);
+      }
+      if (i % 3 == 0) {
+        test_zset.Zrem(mbr);
+      } else {
+        double score = (rand() % 2000 - 1000) / 2.0;
+        test_zset.Zadd(mbr, score);
+        std_map[mbr] = score;
+        std_set.emplace(score, mbr);
+      }
+    }
+    check(test_zset);
+    EXPECT_EQ(flushes, test_zset.Stats().dict.flushes);
+  }
+  // Drop the index, it is built again on open
+  std::unique_ptr<ROCKSDB_NAMESPACE::Iterator> it(
+    store->db()->NewIterator(ROCKSDB_NAMESPACE::ReadOptions()));
+  std::string index_prefix = RocksdbStore::KeyPrefix("zset") + '\0';
+  strs index_keys;
+  for (it->Seek(index_prefix); it->Valid() && it->key().starts_with(index_prefix); it->Next()) {
+    index_keys.push_back(it->key().ToString());
+  }
+  it.reset();
+  EXPECT_EQ(std_set.size() + 1, index_keys.size());
+  for (auto& key : index_keys) {
+    store->db()->Delete(ROCKSDB_NAMESPACE::WriteOptions(), key);
+  }
+  Zset<double> test_zset(store, "zset");
+  check(test_zset);
+}
+
+TEST_P(TestZset, case_21_range_splice) {
+  std::unordered_map<std::string, int> std_map;
+  {
+    Zset<int> test_zset("test_case_21", GetParam());
+    for (int round = 0; round < 20; round ++) {
+      for (int i = 0; i < 3000; i ++) {
+        std::string mbr = std::to_string(rand() % 50000);
+        int score = rand() % 1000;
+        std_map[mbr] = score;
+        test_zset.Zadd(mbr, score);
+      }
+      std::vector<std::pair<int, std::string>> std_result;
+      for (auto& [mbr, score] : std_map) {
+        std_result.emplace_back(score, mbr);
+      }
+      std::sort(std_result.begin(), std_result.end());
+      uint32_t start = rand() % std_result.size() + 1;
+      uint32_t stop = start + rand() % 2000;
+      uint32_t removed = std::min<uint32_t>(stop, std_result.size()) - start + 1;
+      ZSET::pairs<int> popped;
+      switch (round % 4) {
+      case 0:
+        EXPECT_EQ(removed, test_zset.Zremrangebyrank(start, stop));
+        break;
+      case 1: {
+        int min_score = rand() % 1000, max_score = min_score + rand() % 100;
+        start = 1;
+        while (start <= std_result.size() && std_result[start - 1].first < min_score) {
+          start ++;
+        }
+        removed = 0;
+        while (start + removed <= std_result.size() &&
+               std_result[start + removed - 1].first <= max_score) {
+          removed ++;
+        }
+        EXPECT_EQ(removed, test_zset.Zremrangebyscore(min_score, max_score));
+        break;
+      }
+      case 2:
+        start = 1;
+        EXPECT_EQ(removed, test_zset.Zpopmin(&popped, removed));
+        break;
+      case 3:
+        start = std_result.size() + 1 - removed;
+        EXPECT_EQ(removed, test_zset.Zpopmax(&popped, removed));
+        std::reverse(popped.begin(), popped.end());
+        break;
+      }
+      for (uint32_t i = 0; i < removed; i ++) {
+        auto& [score, mbr] = std_result[start - 1 + i];
+        if (!popped.empty()) {
+          EXPECT_EQ(mbr, popped[i].first);
+          EXPECT_EQ(score, popped[i].second);
+        }
+        std_map.erase(mbr);
+      }
+      ZSET::strs forward, backward;
+      test_zset.Zrange(&forward, 1, test_zset.Zcard());
+      test_zset.Zrevrange(&backward, 1, test_zset.Zcard());
+      std::reverse(backward.begin(), backward.end());
+      EXPECT_EQ(std_map.size(), forward.size());
+      EXPECT_EQ(forward, backward);
+    }
+    CheckZset(std_map, test_zset);
+  }
+  if (GetParam() == ROCKSDB_DICT) {
+    Zset<int> test_zset("test_case_21", GetParam());
+    CheckZset(std_map, test_zset);
+  }
+}
+
+TEST_P(TestZset, case_22_tail_finger) {
+  std::unordered_map<std::string, int> std_map;
+  {
+    Zset<int> test_zset("test_case_22", GetParam());
+    // A timeline, mostly appended, sometimes a little out of order
+    int time = 0;
+    for (int i = 0; i < 50000; i ++) {
+      time += rand() % 3;
+      int score = rand() % 10 ? time : time - rand() % 100;
+      std::string mbr = std::to_string(i);
+      std_map[mbr] = score;
+      test_zset.Zadd(mbr, score);
+    }
+    auto zadd = test_zset.Stats().ops[OP_ZADD];
+    EXPECT_LT(zadd.dict_finds, zadd.calls * 4);
+    CheckZset(std_map, test_zset);
+
+    // Ranks near the end walk forward to the last nodes: linked nodes
+    // take no lookups past the member's own, rocksdb nodes at most one
+    // per member after it
+    ZSET::strs last;
+    test_zset.Zrevrange(&last, 1, 10);
+    for (auto& mbr : last) {
+      uint64_t after = &mbr - &last[0];
+      uint64_t finds = test_zset.Stats().ops[OP_ZRANK].dict_finds;
+      EXPECT_EQ(std_map.size() - after, test_zset.Zrank(mbr));
+      finds = test_zset.Stats().ops[OP_ZRANK].dict_finds - finds;
+      if (GetParam() == ROCKSDB_DICT) {
+        EXPECT_LE(finds, 1 + after);
+      } else {
+        EXPECT_EQ(1, finds);
+      }
+    }
+
+    // Trim both ends, then append again
+    ZSET::pairs<int> popped;
+    test_zset.Zpopmax(&popped, 100);
+    test_zset.Zpopmin(&popped, 100);
+    test_zset.Zremrangebyrank(std_map.size() - 400, std_map.size() - 300);
+    std_map.clear();
+    test_zset.Zrange(&popped, 1, test_zset.Zcard());
+    for (auto& [mbr, score] : popped) {
+      std_map[mbr] = score;
+    }
+    for (int i = 0; i < 1000; i ++) {
+      std::string mbr = "new" + std::to_string(i);
+      std_map[mbr] = time + i;
+      test_zset.Zadd(mbr, time + i);
+      if (i % 3 == 0) {
+        std_map.erase(mbr);
+        test_zset.Zrem(mbr);
+      }
+    }
+    CheckZset(std_map, test_zset);
+  }
+  if (GetParam() == ROCKSDB_DICT) {
+    Zset<int> test_zset("test_case_22", GetParam());
+    CheckZset(std_map, test_zset);
+    test_zset.Zadd("last", INT_MAX);
+    EXPECT_EQ(std_map.size() + 1, test_zset.Zrank("last"));
+  }
+}
+
+TEST_P(TestZset, case_23_score_update) {
+  std::unordered_map<std::string, int> std_map;
+  auto check = [&](Zset<int>& test_zset) {
+    CheckZset(std_map, test_zset);
+    // Scores are read from the tuples of the predecessors
+    ZSET::pairs<int> forward;
+    ZSET::strs backward;
+    test_zset.Zrange(&forward, 1, test_zset.Zcard());
+    test_zset.Zrevrange(&backward, 1, test_zset.Zcard());
+    EXPECT_EQ(forward.size(), backward.size());
+    for (int i = 0; i < forward.size(); i ++) {
+      EXPECT_EQ(std_map[forward[i].first], forward[i].second);
+      EXPECT_EQ(forward[i].first, backward[backward.size() - 1 - i]);
+    }
+  };
+  {
+    Zset<int> test_zset("test_case_23", GetParam());
+    for (int i = 0; i < 20000; i ++) {
+      std_map[std::to_string(i)] = i * 100;
+      test_zset.Zadd(std::to_string(i), i * 100);
+    }
+    // Counters that keep their rank are updated in place
+    auto before = test_zset.Stats().ops[OP_ZINCRBY];
+    for (int i = 0; i < 20000; i ++) {
+      std::string mbr = std::to_string(rand() % 20000);
+      int increment = rand() % 11 - 5;
+      std_map[mbr] += increment;
+      EXPECT_EQ(std_map[mbr], test_zset.Zincrby(mbr, increment));
+    }
+    auto after = test_zset.Stats().ops[OP_ZINCRBY];
+    EXPECT_LT(after.dict_finds - before.dict_finds, (after.calls - before.calls) * 6);
+    check(test_zset);
+    // Others move, up or down
+    for (int i = 0; i < 20000; i ++) {
+      std::string mbr = std::to_string(rand() % 20000);
+      int score = rand() % 3 ? std_map[mbr] + rand() % 1000 - 500 : rand() % 2000000;
+      std_map[mbr] = score;
+      test_zset.Zadd(mbr, score);
+    }
+    check(test_zset);
+  }
+  if (GetParam() == ROCKSDB_DICT) {
+    Zset<int> test_zset("test_case_23", GetParam());
+    check(test_zset);
+  }
+}
+
+TEST_P(TestZset, case_24_span_sums) {
+  using SumZset = Zset<int, 1024, 15, true>;
+  std::unordered_map<std::string, int> std_map;
+  auto check = [&](SumZset& test_zset) {
+    std::vector<std::pair<int, std::string>> std_result;
+    for (auto& [mbr, score] : std_map) {
+      std_result.emplace_back(score, mbr);
+    }
+    std::sort(std_result.begin(), std_result.end());
+    std::vector<int64_t> prefix(1, 0);
+    for (auto& [score, mbr] : std_result) {
+      prefix.push_back(prefix.back() + score);
+    }
+    uint32_t n = std_result.size();
+    EXPECT_EQ(prefix[n], test_zset.ZsumByRank(1, n));
+    for (int i = 0; i < 200; i ++) {
+      uint32_t start = rand() % (n + 2), stop = start + rand() % 5000;
+      int64_t expected = 0;
+      if (start <= n && start <= stop) {
+        expected = prefix[std::min(stop, n)] - prefix[std::max(start, 1u) - 1];
+      }
+      EXPECT_EQ(expected, test_zset.ZsumByRank(start, stop));
+      int min_score = rand() % 20000 - 10000, max_score = min_score + rand() % 2000;
+      expected = 0;
+      for (auto& [score, mbr] : std_result) {
+        if (score >= min_score && score <= max_score) {
+          expected += score;
+        }
+      }
+      EXPECT_EQ(expected, test_zset.ZsumByScore(min_score, max_score));
+    }
+  };
+  {
+    SumZset test_zset("test_case_24", GetParam());
+    for (int round = 0; round < 10; round ++) {
+      for (int i = 0; i < 3000; i ++) {
+        std::string mbr = std::to_string(rand() % 20000);
+        int score = rand() % 20000 - 10000;
+        if (rand() % 4 == 0) {
+          std_map[mbr] += score % 10;
+          test_zset.Zincrby(mbr, score % 10);
+        } else if (rand() % 5 == 0) {
+          std_map.erase(mbr);
+          test_zset.Zrem(mbr);
+        } else {
+          std_map[mbr] = score;
+          test_zset.Zadd(mbr, score);
+        }
+      }
+      ZSET::pairs<int> removed;
+      switch (round % 3) {
+      case 0:
+        test_zset.Zpopmax(&removed, rand() % 100);
+        break;
+      case 1:
+        test_zset.Zpopmin(&removed, rand() % 100);
+        break;
+      case 2: {
+        uint32_t start = rand() % test_zset.Zcard() + 1;
+        test_zset.Zrange(&removed, start, start + rand() % 500);
+        test_zset.Zremrangebyrank(start, start + rand() % 500);
+        removed.clear();
+        break;
+      }
+      }
+      for (auto& [mbr, score] : removed) {
+        std_map.erase(mbr);
+      }
+      if (round % 3 == 2) {
+        std_map.clear();
+        test_zset.Zrange(&removed, 1, test_zset.Zcard());
+        for (auto& [mbr, score] : removed) {
+          std_map[mbr] = score;
+        }
+      }
+      check(test_zset);
+    }
+    SumZset loaded("test_case_24_load", GetParam());
+    ZSET::pairs<int> all;
+    test_zset.Zrange(&all, 1, test_zset.Zcard());
+    loaded.BulkLoad(all);
+    check(loaded);
+  }
+  if (GetParam() == ROCKSDB_DICT) {
+    {
+      SumZset test_zset("test_case_24", GetParam());
+      check(test_zset);
+    }
+    // Sums are built for zsets written without them, and dropped again
+    {
+      Zset<int> test_zset("test_case_24", GetParam());
+      CheckZset(std_map, test_zset);
+      test_zset.Zadd("plain", 12345);
+      std_map["plain"] = 12345;
+    }
+    SumZset test_zset("test_case_24", GetParam());
+    check(test_zset);
+  }
+}
+
+template <template <typename> class _Dict>
+void CheckFixedDict(const std::string& name, ZsetDictType dict_type) {
+  std::unordered_map<std::string, int> std_map;
+  {
+    Zset<int, 1024, 15, false, _Dict> test_zset(name, dict_type);
+    for (int i = 0; i < 20000; i ++) {
+      std::string mbr = std::to_string(rand() % 5000);
+      if (rand() % 5 == 0) {
+        std_map.erase(mbr);
+        test_zset.Zrem(mbr);
+      } else {
+        std_map[mbr] = rand() % 1000;
+        test_zset.Zadd(mbr, std_map[mbr]);
+      }
+    }
+    CheckZset(std_map, test_zset);
+    auto copy = test_zset.Zunionstore({&test_zset}, name + "_union", dict_type,
+                                      {}, AGGREGATE_MAX);
+    CheckZset(std_map, *copy);
+  }
+  if (dict_type != ROBIN_MAP_DICT) {
+    // Written by a fixed backend, read by the runtime one
+    Zset<int> test_zset(name, dict_type);
+    CheckZset(std_map, test_zset);
+  }
+}
+
+TEST_P(TestZset, case_25_fixed_dict) {
+  if (GetParam() == ROBIN_MAP_DICT) {
+    CheckFixedDict<RobinMapDict>("test_case_25", GetParam());
+  } else if (GetParam() == LOG_DICT) {
+    CheckFixedDict<LogDict>("test_case_25", GetParam());
+  } else {
+    CheckFixedDict<RocksdbDict>("test_case_25", GetParam());
+  }
+  try {
+    Zset<int, 1024, 15, false, RobinMapDict> test_zset("test_case_25_mismatch", ROCKSDB_DICT);
+    FAIL();
+  } catch (std::invalid_argument& e) {
+  }
+}
+
+std::string LastLogSegment(const std::string& path) {
+  std::string last;
+  for (auto& entry : std::filesystem::directory_iterator(path)) {
+    if (entry.path().extension() == ".seg" && entry.path().string() > last) {
+      last = entry.path().string();
+    }
+  }
+  return last;
+}
+
+TEST(TestLogDict, case_26_log_recovery) {
+  std::filesystem::remove_all("test_case_26");
+  std::unordered_map<std::string, int> std_map;
+  auto update = [&](Zset<int>& test_zset, int n) {
+    for (int i = 0; i < n; i ++) {
+      std::string mbr = std::to_string(rand() % 5000);
+      if (rand() % 5 == 0) {
+        std_map.erase(mbr);
+        test_zset.Zrem(mbr);
+      } else if (rand() % 2) {
+        std_map[mbr] += 7;
+        test_zset.Zincrby(mbr, 7);
+      } else {
+        std_map[mbr] = rand() % 100000;
+        test_zset.Zadd(mbr, std_map[mbr]);
+      }
+    }
+  };
+  {
+    Zset<int> test_zset("test_case_26", LOG_DICT);
+    update(test_zset, 50000);
+    Durability durability;
+    durability.mode = DURABILITY_GROUP_COMMIT;
+    test_zset.SetDurability(durability);
+    update(test_zset, 20000);
+    durability.mode = DURABILITY_SYNC;
+    test_zset.SetDurability(durability);
+    update(test_zset, 200);
+    CheckZset(std_map, test_zset);
+    auto stats = test_zset.Stats();
+    EXPECT_GT(stats.dict.flushes, 0);
+    EXPECT_NE(std::string::npos, stats.store.find("log.merges"));
+  }
+  {
+    Zset<int> test_zset("test_case_26", LOG_DICT);
+    CheckZset(std_map, test_zset);
+    update(test_zset, 20000);
+  }
+  // A torn record at the end of the log is cut off
+  {
+    std::ofstream segment(LastLogSegment("test_case_26"), std::ios::app | std::ios::binary);
+    segment.write("\x12\x34\x56\x78\xff\x00\x00\x00torn", 12);
+  }
+  {
+    Zset<int> test_zset("test_case_26", LOG_DICT);
+    CheckZset(std_map, test_zset);
+    update(test_zset, 1000);
+  }
+  {
+    Zset<int> test_zset("test_case_26", LOG_DICT);
+    CheckZset(std_map, test_zset);
+  }
+  EXPECT_THROW(Zset<int>("test_case_26", LOG_DICT, true), std::invalid_argument);
+}
+
+TEST_P(TestZset, case_27_snapshot) {
+  std::unordered_map<std::string, int> std_map;
+  Zset<int> test_zset("test_case_27", GetParam());
+  for (int i = 0; i < 30000; i ++) {
+    std::string mbr = std::to_string(rand() % 10000);
+    if (rand() % 5 == 0) {
+      std_map.erase(mbr);
+      test_zset.Zrem(mbr);
+    } else {
+      std_map[mbr] = rand() % 1000 - 500;
+      test_zset.Zadd(mbr, std_map[mbr]);
+    }
+  }
+  test_zset.SaveSnapshot("test_case_27.snap");
+  {
+    Zset<int> loaded("test_case_27_loaded", ROBIN_MAP_DICT);
+    EXPECT_EQ(std_map.size(), loaded.LoadSnapshot("test_case_27.snap"));
+    CheckZset(std_map, loaded);
+    strs a, b;
+    test_zset.Zrange(&a, 1, std_map.size());
+    loaded.Zrange(&b, 1, std_map.size());
+    EXPECT_EQ(a, b);
+    EXPECT_THROW(loaded.LoadSnapshot("test_case_27.snap"), std::logic_error);
+    // Loaded members are updated as any other
+    loaded.Zadd("new", 0);
+    loaded.Zrem(a[0]);
+    EXPECT_EQ(std_map.size(), loaded.Zcard());
+  }
+  {
+    Zset<int, 1024, 15, true> loaded("test_case_27_sums", GetParam());
+    loaded.LoadSnapshot("test_case_27.snap");
+    int64_t sum = 0;
+    for (auto& [mbr, score] : std_map) {
+      sum += score;
+    }
+    EXPECT_EQ(sum, loaded.ZsumByRank(1, std_map.size()));
+  }
+  {
+    std::fstream snap("test_case_27.snap", std::ios::in | std::ios::out | std::ios::binary);
+    snap.seekp(100);
+    snap.put('\xff');
+  }
+  Zset<int> corrupted("test_case_27_corrupted", ROBIN_MAP_DICT);
+  EXPECT_THROW(corrupted.LoadSnapshot("test_case_27.snap"), std::runtime_error);
+  EXPECT_EQ(0, corrupted.Zcard());
+  // Empty and truncated files
+  for (std::string content : {"", "ZSN", "ZSNP\x02\x04"}) {
+    std::ofstream("test_case_27_truncated.snap", std::ios::binary) << content;
+    EXPECT_THROW(corrupted.LoadSnapshot("test_case_27_truncated.snap"), std::runtime_error);
+  }
+  EXPECT_EQ(0, corrupted.Zcard());
+
+  // The background snapshot sees the zset as of the call
+  if (GetParam() == ROCKSDB_DICT) {
+    EXPECT_THROW(test_zset.BgSaveSnapshot("test_case_27.snap"), std::logic_error);
+    return;
+  }
+  auto saved = test_zset.BgSaveSnapshot("test_case_27.snap");
+  for (int i = 0; i < 1000; i ++) {
+    test_zset.Zadd("after_" + std::to_string(i), i);
+  }
+  EXPECT_TRUE(saved.get());
+  Zset<int> loaded("test_case_27_bg", ROBIN_MAP_DICT);
+  loaded.LoadSnapshot("test_case_27.snap");
+  CheckZset(std_map, loaded);
+
+  // A dropped future does not wait, the save still completes
+  unlink("test_case_27_dropped.snap");
+  test_zset.BgSaveSnapshot("test_case_27_dropped.snap");
+  for (int i = 0; i < 1000 && access("test_case_27_dropped.snap", F_OK) != 0; i ++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  Zset<int> dropped("test_case_27_dropped", ROBIN_MAP_DICT);
+  EXPECT_EQ(test_zset.Zcard(), dropped.LoadSnapshot("test_case_27_dropped.snap"));
+}
+
+// Levels of the nodes of a snapshot, in rank order
+std::vector<int> SnapshotLevels(const std::string& path) {
+  std::ifstream snap(path, std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(snap)), std::istreambuf_iterator<char>());
+  std::vector<int> levels;
+  for (size_t p = 15; p + 4 < data.size(); ) {
+    levels.push_back(uint8_t(data[p]));
+    p += 1 + sizeof(int);
+    uint32_t size = 0;
+    const char* q = GetVarint32(data.data() + p, data.data() + data.size(), &size);
+    p = q - data.data() + size;
+  }
+  return levels;
+}
+
+TEST_P(TestZset, case_28_dynamic_height) {
+  Zset<int> test_zset("test_case_28", GetParam());
+  for (int i = 0; i < 10; i ++) {
+    test_zset.Zadd(std::to_string(i), i);
+  }
+  test_zset.SaveSnapshot("test_case_28.snap");
+  // Tiny zsets stay low
+  for (int level : SnapshotLevels("test_case_28.snap")) {
+    EXPECT_LE(level, 4);
+  }
+  for (int i = 10; i < 100000; i ++) {
+    test_zset.Zadd(std::to_string(i), i);
+  }
+  test_zset.SaveSnapshot("test_case_28.snap");
+  auto levels = SnapshotLevels("test_case_28.snap");
+  ASSERT_EQ(100000, levels.size());
+  // About 1 / e of the nodes go up one more level, and the top level
+  // follows log(card)
+  int linked_up = 0;
+  for (int level : levels) {
+    linked_up += level >= 2;
+  }
+  EXPECT_NEAR(linked_up / 100000.0, SKIPLIST_P, 0.01);
+  EXPECT_GE(*std::max_element(levels.begin(), levels.end()), 9);
+  EXPECT_LE(*std::max_element(levels.begin(), levels.end()), 13);
+}
+
+TEST(TestMemberScore, case_29_varint_steps) {
+  using MemberScore = Zset<int>::MemberScore;
+  // A value of format 2, whose steps take 4 bytes
+  std::string legacy;
+  uint16_t score_size = sizeof(int);
+  int score = 7, link_score = 9;
+  uint32_t step = 300;
+  legacy.push_back(2);
+  legacy.push_back(1);
+  PutFixed(legacy, &score_size, sizeof score_size);
+  PutFixed(legacy, &score, sizeof score);
+  PutVarint32(legacy, 4);
+  legacy.append("back");
+  PutFixed(legacy, &link_score, sizeof link_score);
+  PutFixed(legacy, &step, sizeof step);
+  PutVarint32(legacy, 4);
+  legacy.append("next");
+  MemberScore ms;
+  ms.set_value_string(legacy);
+  EXPECT_EQ(7, ms.get_score());
+  EXPECT_EQ(9, ms.get_score(1));
+  EXPECT_EQ(300, ms.get_step(1));
+  EXPECT_STREQ("next", ms.get_member(1));
+  EXPECT_STREQ("back", ms.get_back_member());
+  // Written back with a varint step, 2 bytes here
+  std::string value;
+  ms.get_value_string(value);
+  EXPECT_EQ(4, value[0]);
+  EXPECT_EQ(legacy.size() - 2, value.size());
+  // Steps past 32 bits
+  ms.set_step(1, 5000000000ull);
+  ms.get_value_string(value);
+  MemberScore decoded;
+  decoded.set_value_string(value);
+  EXPECT_EQ(5000000000ull, decoded.get_step(1));
+  EXPECT_STREQ("next", decoded.get_member(1));
+  value.resize(value.size() - 6);
+  EXPECT_THROW(decoded.set_value_string(value), std::runtime_error);
+
+  // Snapshots of version 1 have a 4-byte card
+  Zset<int> test_zset("test_case_29", ROBIN_MAP_DICT);
+  for (int i = 0; i < 1000; i ++) {
+    test_zset.Zadd(std::to_string(i), i);
+  }
+  test_zset.SaveSnapshot("test_case_29.snap");
+  std::ifstream snap("test_case_29.snap", std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(snap)), std::istreambuf_iterator<char>());
+  data[4] = 1;
+  data.erase(11, 4);
+  data.resize(data.size() - 4);
+  uint32_t crc = Crc32(data.data(), data.size());
+  PutFixed(data, &crc, sizeof crc);
+  std::ofstream("test_case_29_v1.snap", std::ios::binary) << data;
+  Zset<int> loaded("test_case_29_loaded", ROBIN_MAP_DICT);
+  EXPECT_EQ(1000, loaded.LoadSnapshot("test_case_29_v1.snap"));
+  EXPECT_EQ(1000, loaded.Zrank("999"));
+}
+
+TEST_P(TestZset, case_30_pointer_links) {
+  std::unordered_map<std::string, int> std_map;
+  // Members longer than any inline string
+  auto update = [&](Zset<int>& test_zset, int n) {
+    for (int i = 0; i < n; i ++) {
+      std::string mbr = std::string(40, 'a' + rand() % 26) + std::to_string(rand() % 3000);
+      if (rand() % 4 == 0) {
+        std_map.erase(mbr);
+        test_zset.Zrem(mbr);
+      } else {
+        std_map[mbr] = rand() % 1000;
+        test_zset.Zadd(mbr, std_map[mbr]);
+      }
+    }
+  };
+  {
+    Zset<int> test_zset("test_case_30", GetParam());
+    update(test_zset, 10000);
+    test_zset.Zremrangebyscore(100, 199);
+    for (auto it = std_map.begin(); it != std_map.end(); ) {
+      it = it->second >= 100 && it->second <= 199 ? std_map.erase(it) : std::next(it);
+    }
+    CheckZset(std_map, test_zset);
+  }
+  if (GetParam() == ROBIN_MAP_DICT) {
+    return;
+  }
+  // Recovered nodes are linked by pointer again, and written through
+  Zset<int> test_zset("test_case_30", GetParam());
+  CheckZset(std_map, test_zset);
+  update(test_zset, 5000);
+  CheckZset(std_map, test_zset);
+}
+
+template <typename _T>
+void CheckNormalizedKeyOrder(const std::vector<_T>& scores) {
+  std::set<std::pair<_T, std::string>> ordered;
+  for (auto& score : scores) {
+    for (auto mbr : {"a", "ab", "abc\xff", "abcdefgh", "abcdefghi", "abcdefghj", "b", "\xff"}) {
+      ordered.emplace(score, mbr);
+    }
+  }
+  auto prev = ordered.begin();
+  for (auto it = std::next(prev); it != ordered.end(); prev = it ++) {
+    auto a = NormalizedKey<_T>::Of(prev->first, prev->second.data());
+    auto b = NormalizedKey<_T>::Of(it->first, it->second.data());
+    EXPECT_FALSE(b < a);
+    EXPECT_TRUE(a < NormalizedKey<_T>::Max());
+    EXPECT_EQ(prev->first, a.Score());
+  }
+}
+
+TEST_P(TestZset, case_31_normalized_keys) {
+  CheckNormalizedKeyOrder<int8_t>({-128, -1, 0, 1, 127});
+  CheckNormalizedKeyOrder<int>({INT_MIN, -1, 0, 1, INT_MAX});
+  CheckNormalizedKeyOrder<double>({-INFINITY, -1.5, 0, 1e-300, 2.5, INFINITY});
+
+  // Few scores and members with long common prefixes, so that most
+  // comparisons tie on the normalized key
+  std::unordered_map<std::string, int> std_map;
+  Zset<int> test_zset("test_case_31", GetParam());
+  for (int i = 0; i < 20000; i ++) {
+    std::string mbr = "member:" + std::to_string(rand() % 5000);
+    if (rand() % 4 == 0) {
+      std_map.erase(mbr);
+      test_zset.Zrem(mbr);
+    } else {
+      std_map[mbr] = rand() % 3 - 1;
+      test_zset.Zadd(mbr, std_map[mbr]);
+    }
+  }
+  CheckZset(std_map, test_zset);
+
+  std::set<std::pair<double, std::string>> std_set;
+  Zset<double> double_zset("test_case_31_double", GetParam());
+  for (int i = 0; i < 2000; i ++) {
+    std::string mbr = "m" + std::to_string(i % 700);
+    double score = (rand() % 5 - 2) * 0.5;
+    if (double_zset.Zscore(mbr).first) {
+      std_set.erase({double_zset.Zscore(mbr).second, mbr});
+    }
+    double_zset.Zadd(mbr, score);
+    std_set.emplace(score, mbr);
+  }
+  pairs<double> result;
+  double_zset.Zrange(&result, 1, std_set.size());
+  ASSERT_EQ(std_set.size(), result.size());
+  auto it = std_set.begin();
+  for (size_t i = 0; i < result.size(); i ++, it ++) {
+    EXPECT_EQ(it->second, result[i].first);
+    EXPECT_EQ(i + 1, double_zset.Zrank(it->second));
+  }
+  // Lex ranges compare member bytes of the keys
+  Zset<int> lex_zset("test_case_31_lex", GetParam());
+  for (auto mbr : {"a", "ab", "abcdefgh", "abcdefghi", "abcdefghj", "b"}) {
+    lex_zset.Zadd(mbr, 0);
+  }
+  EXPECT_EQ(3, lex_zset.Zlexcount("abcdefgh", true, "abcdefghz", false));
+  EXPECT_EQ(1, lex_zset.Zlexcount("abcdefgh", false, "abcdefghj", false));
+
+  // -0.0 is stored as 0.0, so that ranges and Zscore agree
+  Zset<double> zero_zset("test_case_31_zero", GetParam());
+  for (int i = 0; i < 40; i ++) {
+    zero_zset.Zadd("z" + std::to_string(i), i % 2 ? -0.0 : 0.0);
+  }
+  EXPECT_FALSE(std::signbit(zero_zset.Zincrby("z40", -0.0)));
+  EXPECT_FALSE(std::signbit(zero_zset.Zscore("z1").second));
+  auto check_signs = [](const pairs<double>& result) {
+    ASSERT_EQ(41, result.size());
+    for (auto& [mbr, score] : result) {
+      EXPECT_FALSE(std::signbit(score)) << mbr;
+    }
+  };
+  zero_zset.Zrangebyscore(&result, 0, 0);
+  check_signs(result);
+  zero_zset.Zrange(&result, 1, 41);
+  check_signs(result);
+  zero_zset.Zrangebylex(&result, "", true, "z~", true);
+  check_signs(result);
+}
+
+INSTANTIATE_TEST_CASE_P(Zset, TestZset, testing::Values(ROBIN_MAP_DICT, ROCKSDB_DICT, LOG_DICT));
@@ -0,0 +1,82 @@
+ // coldcolacos@gmail.com
+
+#ifndef __CODING_H__
+#define __CODING_H__
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace ZSET {
+
+inline void PutFixed(std::string& dst, const void* src, size_t n) {
+  dst.append(reinterpret_cast<const char*>(src), n);
+}
+
+inline void PutVarint32(std::string& dst, uint32_t v) {
+  while (v >= 0x80) {
+    dst.push_back(char(v | 0x80));
+    v >>= 7;
+  }
+  dst.push_back(char(v));
+}
+
+// Return the position after the varint, or nullptr if it is truncated
+inline const char* GetVarint32(const char* p, const char* limit, uint32_t* v) {
+  uint32_t result = 0;
+  for (int shift = 0; shift <= 28 && p < limit; shift += 7) {
+    uint32_t byte = uint8_t(*p ++);
+    result |= (byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      *v = result;
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+inline void PutVarint64(std::string& dst, uint64_t v) {
+  while (v >= 0x80) {
+    dst.push_back(char(v | 0x80));
+    v >>= 7;
+  }
+  dst.push_back(char(v));
+}
+
+inline const char* GetVarint64(const char* p, const char* limit, uint64_t* v) {
+  uint64_t result = 0;
+  for (int shift = 0; shift <= 63 && p < limit; shift += 7) {
+    uint64_t byte = uint8_t(*p ++);
+    result |= (byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      *v = result;
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+// CRC-32 (IEEE), to tell complete records from torn ones
+inline uint32_t Crc32(const char* p, size_t n, uint32_t crc = 0) {
+  static const auto table = []() {
+    std::array<uint32_t, 256> t;
+    for (uint32_t i = 0; i < 256; i ++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k ++) {
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < n; i ++) {
+    crc = table[(crc ^ uint8_t(p[i])) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+} // namespace ZSET
+
+#endif // __CODING_H__
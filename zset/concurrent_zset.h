@@ -0,0 +1,116 @@
+ // coldcolacos@gmail.com
+
+#ifndef __CONCURRENT_ZSET_H__
+#define __CONCURRENT_ZSET_H__
+
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+
+#include "zset.h"
+
+namespace ZSET {
+
+/*
+  Zset guarded by a reader/writer lock. Writers are exclusive. Readers
+  share the lock when the dict lookups of the zset never mutate shared
+  state (ROBIN_MAP_DICT), so that Zscore, Zrank, Zrange, ... scale with
+  the number of reader threads. Lookups of ROCKSDB_DICT refresh the LRU
+  and may flush the write batch, so its readers are exclusive as well.
+  Not forwarded are the cursors, which point into the zset after the
+  lock is released, and Zunionstore/Zinterstore, which read the other
+  zsets; run those with Read or Write while the others are not written.
+*/
+template <typename _T, int _MaxMemberLen = 1024, int _MaxLevel = 32,
+          bool _SpanSums = false, template <typename> class _Dict = DictInterface>
+class ConcurrentZset {
+ public:
+  using ZsetType = Zset<_T, _MaxMemberLen, _MaxLevel, _SpanSums, _Dict>;
+
+  template <typename... _Args>
+  explicit ConcurrentZset(_Args&&... args)
+    : zset_(std::forward<_Args>(args)...),
+      shared_reads_(zset_.ConcurrentReads()) {}
+  ~ConcurrentZset() = default;
+  ConcurrentZset(const ConcurrentZset& z) = delete;
+  ConcurrentZset& operator=(const ConcurrentZset& z) = delete;
+
+  // Run f(const ZsetType&) under the read lock
+  template <typename _F>
+  auto Read(_F&& f) const {
+    if (shared_reads_) {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      return f(zset_);
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    return f(zset_);
+  }
+
+  // Run f(ZsetType&) under the write lock
+  template <typename _F>
+  auto Write(_F&& f) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    return f(zset_);
+  }
+
+#define ZSET_READ_API(api)                                            \
+  template <typename... _Args>                                        \
+  auto api(_Args&&... args) const {                                   \
+    return Read([&](const ZsetType& z) {                              \
+      return z.api(std::forward<_Args>(args)...);                     \
+    });                                                               \
+  }
+#define ZSET_WRITE_API(api)                                           \
+  template <typename... _Args>                                        \
+  auto api(_Args&&... args) {                                         \
+    return Write([&](ZsetType& z) {                                   \
+      return z.api(std::forward<_Args>(args)...);                     \
+    });                                                               \
+  }
+
+  ZSET_WRITE_API(BulkLoad)
+  ZSET_READ_API(CacheStats)
+  ZSET_WRITE_API(SetDurability)
+  ZSET_WRITE_API(SetStatsLevel)
+  ZSET_READ_API(Stats)
+  // The background save forks under the read lock, then runs unlocked
+  ZSET_READ_API(BgSaveSnapshot)
+  ZSET_WRITE_API(LoadSnapshot)
+  ZSET_READ_API(SaveSnapshot)
+  ZSET_WRITE_API(Zadd)
+  ZSET_WRITE_API(ZaddMany)
+  ZSET_READ_API(Zcard)
+  ZSET_READ_API(Zcount)
+  ZSET_WRITE_API(Zincrby)
+  ZSET_READ_API(Zlexcount)
+  ZSET_WRITE_API(Zpopmax)
+  ZSET_WRITE_API(Zpopmin)
+  ZSET_READ_API(Zrange)
+  ZSET_READ_API(Zrangebylex)
+  ZSET_READ_API(Zrangebyscore)
+  ZSET_READ_API(Zrank)
+  ZSET_WRITE_API(Zrem)
+  ZSET_WRITE_API(ZremMany)
+  ZSET_WRITE_API(Zremrangebylex)
+  ZSET_WRITE_API(Zremrangebyrank)
+  ZSET_WRITE_API(Zremrangebyscore)
+  ZSET_READ_API(Zrevrange)
+  ZSET_READ_API(Zrevrangebyscore)
+  ZSET_READ_API(Zrevrank)
+  ZSET_READ_API(Zscore)
+  ZSET_READ_API(ZscoreMany)
+  ZSET_READ_API(ZsumByRank)
+  ZSET_READ_API(ZsumByScore)
+
+#undef ZSET_WRITE_API
+#undef ZSET_READ_API
+
+ private:
+  ZsetType zset_;
+  const bool shared_reads_;
+  mutable std::shared_mutex mutex_;
+};
+
+} // namespace ZSET
+
+#endif // __CONCURRENT_ZSET_H__
@@ -5,7 +5,9 @@
 #define __DICT_INTERFACE_H__
 
 #include <cstring>
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "tsl/robin_map.h"
@@ -13,11 +15,30 @@
 
 #include "lru.h"
 #include "settings.h"
+#include "stats.h"
 
 namespace ZSET {
 
 const char* kZsetRoot = "";
 
+enum DurabilityMode {
+  DURABILITY_BATCH = 0,     // Write every batch_size updates
+  DURABILITY_SYNC,          // Write and sync every update
+  DURABILITY_GROUP_COMMIT,  // Write and sync in background, every
+                            // interval_ms or batch_size updates
+  DURABILITY_NO_WAL         // As DURABILITY_BATCH, without WAL
+};
+
+struct Durability {
+  DurabilityMode mode = DURABILITY_BATCH;
+#ifdef ROCKSDB_BULK_WRITE_SIZE
+  uint32_t batch_size = ROCKSDB_BULK_WRITE_SIZE;
+#else
+  uint32_t batch_size = 1;
+#endif
+  uint32_t interval_ms = 10;
+};
+
 template<typename _T>
 class DictInterface {
  public:
@@ -28,10 +49,33 @@ class DictInterface {
 
   // Memory operations
   virtual void                  Erase(_T* t) = 0;
+  //   Implementations count every key looked up in thread_counters
   virtual _T*                   Find(const char* key) = 0;
+  // Call f(i, t) for every keys[i] found, t is only valid during the call
+  virtual void                  FindMany(const std::vector<const char*>& keys,
+                                         const std::function<void(size_t, _T*)>& f) {
+    for (size_t i = 0; i < keys.size(); i ++) {
+      _T* t = Find(keys[i]);
+      if (t != nullptr) {
+        f(i, t);
+      }
+    }
+  }
+  // Keep t in memory as if it was just found
+  virtual void                  Touch(_T* t) {}
   [[nodiscard]] virtual _T*     NewKeyBuffer(const char* key,
                                              bool is_root = false) = 0;
-  virtual void                  ResizeLRUCapacity(uint32_t card) {}
+  // True if a buffer keeps its address until it is erased, so that
+  // the skiplist may link nodes by pointer instead of by key
+  virtual bool                  PointerStable() const { return false; }
+  // True if Find never mutates the dict, so that lookups may run
+  // in parallel as long as no one writes
+  virtual bool                  ConcurrentFind() const { return false; }
+  virtual LRUStats              CacheStats() const { return LRUStats(); }
+  virtual DictStats             Stats() const { return DictStats(); }
+  // Statistics of the underlying storage, as text
+  virtual std::string           StoreStatistics() const { return ""; }
+  virtual void                  SetDurability(const Durability& durability) {}
 
   // Persist operations
   virtual void Persist(_T* t) {}
@@ -39,10 +83,38 @@ class DictInterface {
   virtual void BatchDelete(_T* t) {}
   virtual void BatchPersist(bool force = false) {}
 
+  // Bulk load operations, to fill an empty dict with complete nodes
+  //   Buffer to build the node of key, valid until BulkLoadAdd
+  [[nodiscard]] virtual _T* BulkLoadBuffer(const char* key) {
+    return NewKeyBuffer(key);
+  }
+  //   Take the built node, in any key order
+  virtual void BulkLoadAdd(_T* t) {}
+  //   Make all added nodes visible
+  virtual void BulkLoadFinish() {}
+
+  // Score index, a second key space ordered by (score, member)
+  //   Maintain index_key(t) for every node from now on, built from the
+  //   existing nodes if missing
+  virtual void EnableIndex(const std::function<void(_T*, std::string&)>& index_key) {}
+  virtual void IndexAdd(_T* t) {}
+  virtual void IndexDelete(_T* t) {}
+  //   Call f(index_key) from key on, or backwards from key if reverse
+  //   (from the last one if key is empty), while f returns true. Return
+  //   false without calling f if there is no index, or if it lags behind
+  //   updates not yet persisted
+  virtual bool IndexScan(const std::string& key, bool reverse,
+                         const std::function<bool(std::string_view)>& f) {
+    return false;
+  }
+
+  // Iterate over the nodes in key order
   //   Begin
   virtual bool IterBegin(const char* key) { return false; }
   //   Store the current key to std::string
   virtual void IterKey(std::string& key) {}
+  //   Store the current encoded value to std::string
+  virtual void IterValue(std::string& value) {}
   //   Return true if iterator is not at the end
   virtual bool IterValid() { return false; }
   //   Step to the next key
@@ -0,0 +1,775 @@
+ // coldcolacos@gmail.com
+
+#ifndef __LOG_DICT_H__
+#define __LOG_DICT_H__
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "coding.h"
+#include "dict_interface.h"
+
+namespace ZSET {
+
+/*
+  Persistent dict without rocksdb, in the way of Bitcask: every node is
+  kept in memory and indexed by a robin map, as in RobinMapDict, and
+  every update is appended to a log of segment files in the directory
+  of the zset, which is replayed when the zset is opened.
+
+    - One record holds the Put/Delete operations of one BatchPersist,
+      so that recovery never applies half a batch:
+        crc32 (4 bytes) | payload size (4 bytes) | payload
+      payload is a sequence of
+        type (1 byte: 1 Put, 0 Delete) | key size (varint32) | key
+        | value size (varint32) | value (Put only)
+    - Segments NNNNNN.seg are appended to up to LOG_DICT_SEGMENT_SIZE
+      bytes, then sealed. A torn record at the end of the last segment
+      is cut off on recovery.
+    - Once the sealed segments outgrow the last merge, a background
+      thread replays them into NNNNNN.merged, which holds the live nodes
+      of every segment up to NNNNNN, then removes them.
+*/
+template<typename _T>
+class LogDict final: public DictInterface<_T> {
+ public:
+  LogDict(std::string path, bool error_if_exists);
+  ~LogDict() override;
+
+  // Memory operations
+  _T*                   Find(const char* key) override;
+  //  The node is kept until its Delete is appended to the log
+  void                  Erase(_T* t) override;
+  [[nodiscard]] _T*     NewKeyBuffer(const char* key, bool is_root = false) override;
+  bool                  PointerStable() const override { return true; }
+  bool                  ConcurrentFind() const override { return true; }
+  DictStats             Stats() const override;
+  std::string           StoreStatistics() const override;
+  void                  SetDurability(const Durability& durability) override;
+
+  // Persist operations
+  //  1) Append a single key, after the pending ones
+  void Persist(_T* t) override;
+  //  2) Mark a Put for the next record
+  void BatchAdd(_T* t) override;
+  //  3) Mark a Delete for the next record
+  void BatchDelete(_T* t) override;
+  //  4) Append the marked keys to the log as one record
+  void BatchPersist(bool force = false) override;
+
+  // Bulk load as one record
+  void BulkLoadAdd(_T* t) override { BatchAdd(t); }
+  void BulkLoadFinish() override { BatchPersist(true); }
+
+ private:
+  using ReplayFunc = std::function<void(char, std::string_view, std::string_view)>;
+
+  static constexpr char kDelete = 0;
+  static constexpr char kPut = 1;
+  static constexpr size_t kRecordHeaderSize = 8;
+  // Payload size of the records written by merges
+  static constexpr size_t kMergeRecordSize = 1 << 20;
+
+  void                  Recover(bool error_if_exists);
+  std::string           FilePath(uint32_t id, const char* suffix) const;
+  // Records
+  static void           AppendEntry(std::string& records, char type,
+                                    std::string_view key, std::string_view value);
+  //   Fill in the header of the record started at start
+  static void           SealRecord(std::string& records, size_t start);
+  //   Call f(type, key, value) for every entry of the complete records
+  //   of file, and return their size. Only a tail may be torn
+  static size_t         Replay(const std::string& file, bool tail, const ReplayFunc& f);
+  static void           WriteFully(int fd, const std::string& data);
+  // Segments, by the thread which writes records
+  void                  OpenSegment(uint32_t id);
+  void                  WriteRecords(const std::string& records);
+  void                  RollSegment();
+  void                  Sync();
+  void                  SyncDir() const;
+  void                  CountFlush(const std::string& records, uint64_t keys);
+  void                  FreeErased();
+  // Group commit
+  void                  StartFlusher();
+  void                  StopFlusher();
+  void                  FlushLoop();
+  void                  WaitFlushed();
+  // Merge
+  void                  MaybeMerge();
+  void                  Merge(uint32_t merged_id, std::vector<uint32_t> segments);
+
+  std::string path_;
+  tsl::robin_map<std::string_view, _T*> data_;
+  // Nodes marked by BatchAdd/BatchDelete, and erased nodes, which are
+  // freed once their Delete is encoded
+  std::vector<_T*> updated_ptrs_;
+  std::vector<_T*> erased_ptrs_;
+  Durability durability_;
+  // Sync after writes, in DURABILITY_SYNC and DURABILITY_GROUP_COMMIT
+  bool sync_ = false;
+  // Active segment
+  int fd_ = -1;
+  uint32_t segment_id_ = 0;
+  uint64_t segment_bytes_ = 0;
+  // Group commit: records are appended to pending_records_ under mutex_
+  // and written by flusher_, sequences count the BatchPersist calls
+  // appended/written
+  std::thread flusher_;
+  mutable std::mutex mutex_;
+  std::condition_variable flush_cv_;
+  std::condition_variable flushed_cv_;
+  std::string pending_records_;
+  std::string flushing_records_;
+  uint64_t pending_keys_ = 0;
+  uint64_t flushing_keys_ = 0;
+  uint32_t pending_count_ = 0;
+  uint64_t appended_seq_ = 0;
+  uint64_t written_seq_ = 0;
+  bool flush_requested_ = false;
+  bool stop_flusher_ = false;
+  std::string flush_error_;
+  // Counters, guarded by mutex_
+  DictStats stats_;
+  // Merge: sealed segments (id, bytes) newer than the merged file,
+  // guarded by merge_mutex_
+  std::thread merger_;
+  mutable std::mutex merge_mutex_;
+  std::vector<std::pair<uint32_t, uint64_t>> sealed_;
+  uint32_t merged_id_ = 0;
+  uint64_t merged_bytes_ = 0;
+  uint64_t merges_ = 0;
+  bool merging_ = false;
+  std::string merge_error_;
+  // String buffers to encode records and values
+  std::string batch_records_;
+  std::string value_buffer_;
+};
+
+template<typename _T>
+LogDict<_T>::LogDict(std::string path, bool error_if_exists)
+  : path_(path) {
+  Recover(error_if_exists);
+}
+
+template<typename _T>
+LogDict<_T>::~LogDict() {
+  try {
+    BatchPersist(true);
+  } catch (const std::runtime_error& e) {
+    // A failed group commit was already reported to the writer, if any
+  }
+  StopFlusher();
+  if (merger_.joinable()) {
+    merger_.join();
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  std::vector<_T*> nodes;
+  for (auto& [key, t] : data_) {
+    nodes.push_back(t);
+  }
+  data_.clear();
+  for (auto t : nodes) {
+    delete t;
+  }
+  FreeErased();
+}
+
+template<typename _T>
+void LogDict<_T>::Recover(bool error_if_exists) {
+  namespace fs = std::filesystem;
+  fs::create_directories(path_);
+  std::vector<uint32_t> segments, merged;
+  for (auto& entry : fs::directory_iterator(path_)) {
+    auto ext = entry.path().extension().string();
+    uint32_t id = strtoul(entry.path().stem().string().data(), nullptr, 10);
+    if (ext == ".seg") {
+      segments.push_back(id);
+    } else if (ext == ".merged") {
+      merged.push_back(id);
+    } else if (ext == ".tmp") {
+      // Left by an interrupted merge
+      fs::remove(entry.path());
+    }
+  }
+  if (error_if_exists && !(segments.empty() && merged.empty())) {
+    throw std::invalid_argument("log dict already exists: " + path_);
+  }
+  std::sort(segments.begin(), segments.end());
+  std::sort(merged.begin(), merged.end());
+
+  auto apply = [this](char type, std::string_view key, std::string_view value) {
+    auto it = data_.find(key);
+    if (type == kPut) {
+      _T* t = it == data_.end() ? NewKeyBuffer(std::string(key).data()) : it->second;
+      value_buffer_.assign(value);
+      t->set_value_string(value_buffer_);
+      t->set_lru_state(LRU_OK);
+    } else if (it != data_.end()) {
+      _T* t = it->second;
+      data_.erase(it);
+      delete t;
+    }
+  };
+  // Files up to the last merged one were merged into it, but a merge
+  // may have stopped before removing them
+  uint32_t last_id = 0;
+  if (!merged.empty()) {
+    merged_id_ = last_id = merged.back();
+    merged.pop_back();
+    for (auto id : merged) {
+      fs::remove(FilePath(id, ".merged"));
+    }
+    merged_bytes_ = Replay(FilePath(merged_id_, ".merged"), false, apply);
+  }
+  for (size_t i = 0; i < segments.size(); i ++) {
+    auto file = FilePath(segments[i], ".seg");
+    if (segments[i] <= merged_id_) {
+      fs::remove(file);
+      continue;
+    }
+    bool tail = i + 1 == segments.size();
+    size_t size = Replay(file, tail, apply);
+    last_id = segments[i];
+    if (size == 0) {
+      fs::remove(file);
+    } else {
+      if (tail && size != fs::file_size(file)) {
+        fs::resize_file(file, size);
+      }
+      sealed_.emplace_back(segments[i], size);
+    }
+  }
+  auto it = data_.find(kZsetRoot);
+  if (it != data_.end()) {
+    it->second->set_lru_state(LRU_RECOVERY);
+  }
+  OpenSegment(last_id + 1);
+  MaybeMerge();
+}
+
+template<typename _T>
+std::string LogDict<_T>::FilePath(uint32_t id, const char* suffix) const {
+  char name[16];
+  snprintf(name, sizeof name, "%06u", id);
+  return path_ + "/" + name + suffix;
+}
+
+template<typename _T>
+_T* LogDict<_T>::Find(const char* key) {
+  ++ thread_counters.dict_finds;
+  auto it = data_.find(key);
+  return it == data_.end() ? nullptr : it->second;
+}
+
+template<typename _T>
+void LogDict<_T>::Erase(_T* t) {
+  BatchDelete(t);
+  data_.erase(t->get_key_string_view());
+  erased_ptrs_.push_back(t);
+}
+
+template<typename _T>
+_T* LogDict<_T>::NewKeyBuffer(const char* key, bool is_root) {
+  auto it = data_.find(key);
+  if (it != data_.end()) {
+    return it->second;
+  }
+  _T* t = new _T();
+  t->set_key_string(key);
+  data_[t->get_key_string_view()] = t;
+  return t;
+}
+
+template<typename _T>
+void LogDict<_T>::Persist(_T* t) {
+  BatchAdd(t);
+  BatchPersist(true);
+}
+
+template<typename _T>
+void LogDict<_T>::BatchAdd(_T* t) {
+  auto state = t->get_lru_state();
+  if (state != LRU_DIRTY) {
+    t->set_lru_state(LRU_DIRTY);
+    if (!state) {
+      updated_ptrs_.push_back(t);
+    }
+  }
+}
+
+template<typename _T>
+void LogDict<_T>::BatchDelete(_T* t) {
+  auto state = t->get_lru_state();
+  if (state != LRU_EXPIRED) {
+    t->set_lru_state(LRU_EXPIRED);
+    if (!state) {
+      updated_ptrs_.push_back(t);
+    }
+  }
+}
+
+template<typename _T>
+void LogDict<_T>::BatchPersist(bool force) {
+  bool group_commit = flusher_.joinable();
+  if (!force && !group_commit && updated_ptrs_.size() < durability_.batch_size) {
+    return;
+  }
+  if (updated_ptrs_.empty()) {
+    if (force) {
+      WaitFlushed();
+    }
+    return;
+  }
+
+  // Encode the marked keys as one record
+  batch_records_.assign(kRecordHeaderSize, '\0');
+  for (auto t : updated_ptrs_) {
+    auto lru_state = t->get_lru_state();
+    t->set_lru_state(LRU_OK);
+    if (lru_state == LRU_DIRTY) {
+      t->get_value_string(value_buffer_);
+      AppendEntry(batch_records_, kPut, t->get_key_string_view(), value_buffer_);
+    } else if (lru_state == LRU_EXPIRED) {
+      AppendEntry(batch_records_, kDelete, t->get_key_string_view(), "");
+    }
+  }
+  SealRecord(batch_records_, 0);
+  uint64_t keys = updated_ptrs_.size();
+  updated_ptrs_.clear();
+  FreeErased();
+
+  if (group_commit) {
+    // Leave the write and the sync to flusher_
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!flush_error_.empty()) {
+      throw std::runtime_error("group commit failed: " + flush_error_);
+    }
+    pending_records_.append(batch_records_);
+    pending_keys_ += keys;
+    ++ appended_seq_;
+    if (++ pending_count_ >= durability_.batch_size || force) {
+      flush_requested_ = true;
+      flush_cv_.notify_one();
+    }
+    lock.unlock();
+    if (force) {
+      WaitFlushed();
+    }
+    return;
+  }
+  WriteRecords(batch_records_);
+  if (sync_) {
+    Sync();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  CountFlush(batch_records_, keys);
+}
+
+template<typename _T>
+void LogDict<_T>::SetDurability(const Durability& durability) {
+  BatchPersist(true);
+  StopFlusher();
+  durability_ = durability;
+  durability_.batch_size = std::max(1u, durability_.batch_size);
+  if (durability_.mode == DURABILITY_SYNC) {
+    durability_.batch_size = 1;
+  }
+  // There is no WAL apart from the log, DURABILITY_NO_WAL is DURABILITY_BATCH
+  sync_ = durability_.mode == DURABILITY_SYNC ||
+          durability_.mode == DURABILITY_GROUP_COMMIT;
+  if (sync_) {
+    Sync();
+  }
+  if (durability_.mode == DURABILITY_GROUP_COMMIT) {
+    StartFlusher();
+  }
+}
+
+template<typename _T>
+void LogDict<_T>::FreeErased() {
+  for (auto t : erased_ptrs_) {
+    delete t;
+  }
+  erased_ptrs_.clear();
+}
+
+////////////////////////////// BEGIN Records //////////////////////////////
+template<typename _T>
+void LogDict<_T>::AppendEntry(std::string& records, char type,
+                              std::string_view key, std::string_view value) {
+  records.push_back(type);
+  PutVarint32(records, key.size());
+  records.append(key);
+  if (type == kPut) {
+    PutVarint32(records, value.size());
+    records.append(value);
+  }
+}
+
+template<typename _T>
+void LogDict<_T>::SealRecord(std::string& records, size_t start) {
+  const char* payload = records.data() + start + kRecordHeaderSize;
+  uint32_t size = records.size() - start - kRecordHeaderSize;
+  uint32_t crc = Crc32(payload, size);
+  memcpy(&records[start], &crc, sizeof crc);
+  memcpy(&records[start + sizeof crc], &size, sizeof size);
+}
+
+template<typename _T>
+size_t LogDict<_T>::Replay(const std::string& file, bool tail, const ReplayFunc& f) {
+  FILE* fp = fopen(file.data(), "rb");
+  if (fp == nullptr) {
+    throw std::runtime_error("cannot open log file " + file);
+  }
+  size_t file_size = std::filesystem::file_size(file);
+  size_t valid = 0;
+  bool corrupted = false;
+  std::string payload;
+  char header[kRecordHeaderSize];
+  while (fread(header, 1, kRecordHeaderSize, fp) == kRecordHeaderSize) {
+    uint32_t crc, size;
+    memcpy(&crc, header, sizeof crc);
+    memcpy(&size, header + sizeof crc, sizeof size);
+    if (valid + kRecordHeaderSize + size > file_size) {
+      break;
+    }
+    payload.resize(size);
+    if (fread(payload.data(), 1, size, fp) != size ||
+        Crc32(payload.data(), size) != crc) {
+      break;
+    }
+    const char* p = payload.data();
+    const char* limit = p + size;
+    while (p < limit && !corrupted) {
+      char type = *p ++;
+      uint32_t key_size = 0, value_size = 0;
+      p = GetVarint32(p, limit, &key_size);
+      if (p == nullptr || p + key_size > limit) {
+        corrupted = true;
+        break;
+      }
+      std::string_view key(p, key_size);
+      p += key_size;
+      if (type == kPut) {
+        p = GetVarint32(p, limit, &value_size);
+        if (p == nullptr || p + value_size > limit) {
+          corrupted = true;
+          break;
+        }
+      }
+      f(type, key, std::string_view(p, value_size));
+      p += value_size;
+    }
+    if (corrupted) {
+      break;
+    }
+    valid += kRecordHeaderSize + size;
+  }
+  fclose(fp);
+  if (corrupted || (valid != file_size && !tail)) {
+    throw std::runtime_error("corrupted log file " + file);
+  }
+  return valid;
+}
+
+template<typename _T>
+void LogDict<_T>::WriteFully(int fd, const std::string& data) {
+  const char* p = data.data();
+  size_t n = data.size();
+  while (n > 0) {
+    ssize_t written = write(fd, p, n);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(std::string("log write failed: ") + strerror(errno));
+    }
+    p += written;
+    n -= written;
+  }
+}
+////////////////////////////// END Records //////////////////////////////
+
+////////////////////////////// BEGIN Segments //////////////////////////////
+template<typename _T>
+void LogDict<_T>::OpenSegment(uint32_t id) {
+  fd_ = open(FilePath(id, ".seg").data(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error(std::string("cannot open log segment: ") + strerror(errno));
+  }
+  segment_id_ = id;
+  segment_bytes_ = 0;
+  if (sync_) {
+    SyncDir();
+  }
+}
+
+template<typename _T>
+void LogDict<_T>::WriteRecords(const std::string& records) {
+  WriteFully(fd_, records);
+  segment_bytes_ += records.size();
+  if (segment_bytes_ >= LOG_DICT_SEGMENT_SIZE) {
+    RollSegment();
+  }
+}
+
+template<typename _T>
+void LogDict<_T>::RollSegment() {
+  if (sync_) {
+    Sync();
+  }
+  close(fd_);
+  {
+    std::lock_guard<std::mutex> lock(merge_mutex_);
+    sealed_.emplace_back(segment_id_, segment_bytes_);
+  }
+  OpenSegment(segment_id_ + 1);
+  MaybeMerge();
+}
+
+template<typename _T>
+void LogDict<_T>::Sync() {
+  if (fdatasync(fd_) != 0) {
+    throw std::runtime_error(std::string("log sync failed: ") + strerror(errno));
+  }
+}
+
+// Make created and renamed files durable
+template<typename _T>
+void LogDict<_T>::SyncDir() const {
+  int fd = open(path_.data(), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+template<typename _T>
+void LogDict<_T>::CountFlush(const std::string& records, uint64_t keys) {
+  ++ stats_.flushes;
+  stats_.flushed_keys += keys;
+  stats_.flushed_bytes += records.size();
+}
+
+template<typename _T>
+DictStats LogDict<_T>::Stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  DictStats stats = stats_;
+  stats.dirty_count = updated_ptrs_.size() + pending_keys_ + flushing_keys_;
+  return stats;
+}
+
+template<typename _T>
+std::string LogDict<_T>::StoreStatistics() const {
+  std::lock_guard<std::mutex> lock(merge_mutex_);
+  uint64_t sealed_bytes = 0;
+  for (auto& [id, bytes] : sealed_) {
+    sealed_bytes += bytes;
+  }
+  std::string s;
+  s += "log.sealed.segments COUNT : " + std::to_string(sealed_.size()) + "\n";
+  s += "log.sealed.bytes COUNT : " + std::to_string(sealed_bytes) + "\n";
+  s += "log.merged.bytes COUNT : " + std::to_string(merged_bytes_) + "\n";
+  s += "log.merges COUNT : " + std::to_string(merges_) + "\n";
+  if (!merge_error_.empty()) {
+    s += "log.merge.error : " + merge_error_ + "\n";
+  }
+  return s;
+}
+////////////////////////////// END Segments //////////////////////////////
+
+////////////////////////////// BEGIN Group Commit //////////////////////////////
+template<typename _T>
+void LogDict<_T>::StartFlusher() {
+  stop_flusher_ = false;
+  flusher_ = std::thread([this]() { FlushLoop(); });
+}
+
+template<typename _T>
+void LogDict<_T>::StopFlusher() {
+  if (!flusher_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_flusher_ = true;
+  }
+  flush_cv_.notify_one();
+  flusher_.join();
+}
+
+template<typename _T>
+void LogDict<_T>::FlushLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    flush_cv_.wait_for(lock, std::chrono::milliseconds(durability_.interval_ms),
+                       [this]() { return stop_flusher_ || flush_requested_; });
+    flush_requested_ = false;
+    if (pending_count_ == 0) {
+      if (stop_flusher_) {
+        break;
+      }
+      continue;
+    }
+    std::swap(pending_records_, flushing_records_);
+    std::swap(pending_keys_, flushing_keys_);
+    uint64_t seq = appended_seq_;
+    pending_count_ = 0;
+    lock.unlock();
+    std::string error;
+    try {
+      WriteRecords(flushing_records_);
+      Sync();
+    } catch (const std::runtime_error& e) {
+      error = e.what();
+    }
+    lock.lock();
+    CountFlush(flushing_records_, flushing_keys_);
+    flushing_records_.clear();
+    flushing_keys_ = 0;
+    if (!error.empty()) {
+      flush_error_ = error;
+    }
+    written_seq_ = seq;
+    flushed_cv_.notify_all();
+  }
+}
+
+// Block until every appended record has been written and synced
+template<typename _T>
+void LogDict<_T>::WaitFlushed() {
+  if (!flusher_.joinable()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  uint64_t seq = appended_seq_;
+  if (written_seq_ < seq) {
+    flush_requested_ = true;
+    flush_cv_.notify_one();
+    flushed_cv_.wait(lock, [&]() { return written_seq_ >= seq; });
+  }
+}
+////////////////////////////// END Group Commit //////////////////////////////
+
+////////////////////////////// BEGIN Merge //////////////////////////////
+// Merge once the sealed segments outgrow the merged file, so that the
+// log stays within about twice the live nodes
+template<typename _T>
+void LogDict<_T>::MaybeMerge() {
+  std::lock_guard<std::mutex> lock(merge_mutex_);
+  uint64_t sealed_bytes = 0;
+  for (auto& [id, bytes] : sealed_) {
+    sealed_bytes += bytes;
+  }
+  if (merging_ || sealed_.empty() ||
+      sealed_bytes < std::max<uint64_t>(merged_bytes_, LOG_DICT_SEGMENT_SIZE)) {
+    return;
+  }
+  if (merger_.joinable()) {
+    merger_.join();
+  }
+  std::vector<uint32_t> segments;
+  for (auto& [id, bytes] : sealed_) {
+    segments.push_back(id);
+  }
+  merging_ = true;
+  merger_ = std::thread([this, merged_id = merged_id_, segments]() {
+    Merge(merged_id, segments);
+  });
+}
+
+// Replay the merged file and the segments, which are no longer written,
+// and write the nodes left as the merged file of the last segment
+template<typename _T>
+void LogDict<_T>::Merge(uint32_t merged_id, std::vector<uint32_t> segments) {
+  namespace fs = std::filesystem;
+  std::string error;
+  uint64_t bytes = 0;
+  try {
+    tsl::robin_map<std::string, std::string> live;
+    auto apply = [&](char type, std::string_view key, std::string_view value) {
+      if (type == kPut) {
+        live[std::string(key)] = value;
+      } else {
+        live.erase(std::string(key));
+      }
+    };
+    if (merged_id) {
+      Replay(FilePath(merged_id, ".merged"), false, apply);
+    }
+    for (auto id : segments) {
+      Replay(FilePath(id, ".seg"), false, apply);
+    }
+
+    auto tmp = FilePath(segments.back(), ".tmp");
+    int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      throw std::runtime_error(std::string("cannot open merge file: ") + strerror(errno));
+    }
+    std::string records(kRecordHeaderSize, '\0');
+    auto write_record = [&]() {
+      SealRecord(records, 0);
+      WriteFully(fd, records);
+      bytes += records.size();
+      records.assign(kRecordHeaderSize, '\0');
+    };
+    try {
+      for (auto& [key, value] : live) {
+        AppendEntry(records, kPut, key, value);
+        if (records.size() >= kMergeRecordSize) {
+          write_record();
+        }
+      }
+      if (records.size() > kRecordHeaderSize) {
+        write_record();
+      }
+      if (fdatasync(fd) != 0) {
+        throw std::runtime_error(std::string("merge sync failed: ") + strerror(errno));
+      }
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+    // The merged file replaces the files it was made of from here on
+    fs::rename(tmp, FilePath(segments.back(), ".merged"));
+    SyncDir();
+    if (merged_id) {
+      fs::remove(FilePath(merged_id, ".merged"));
+    }
+    for (auto id : segments) {
+      fs::remove(FilePath(id, ".seg"));
+    }
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+
+  std::lock_guard<std::mutex> lock(merge_mutex_);
+  if (error.empty()) {
+    merged_id_ = segments.back();
+    merged_bytes_ = bytes;
+    sealed_.erase(sealed_.begin(), sealed_.begin() + segments.size());
+    ++ merges_;
+  }
+  // The segments are kept on failure, and merged again on the next roll
+  merge_error_ = error;
+  merging_ = false;
+}
+////////////////////////////// END Merge //////////////////////////////
+
+} // namespace ZSET
+
+#endif // __LOG_DICT_H__
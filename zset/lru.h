@@ -1,4 +1,3 @@
-
  // coldcolacos@gmail.com
 
 #ifndef __LRU_H__
@@ -23,16 +22,42 @@ enum LRUState {
   LRU_RECOVERY  // Recovery from existing rocksdb
 };
 
+struct LRUStats {
+  uint64_t hit_count = 0;
+  uint64_t miss_count = 0;
+  size_t   charge = 0;
+  size_t   pinned_charge = 0;
+};
+
+/*
+  Segmented LRU bounded by a memory budget in bytes.
+    - probation: keys seen once, the only segment evicted in the normal
+      case, so that a sweep over cold keys (Zrange) only churns here
+    - protected: keys hit again while in probation
+    - pinned: keys of nodes with level >= pin_level, which every descent
+      of the skiplist passes through
+  Overflowing pinned keys are demoted to protected, and overflowing
+  protected keys to probation. The charge of a key is the memory size
+  of its value, updated whenever the key is refreshed.
+*/
 template <typename _T>
 class LRU {
  public:
-  LRU(lru_size_t cap): root_(0), count_(0), iterator_valid_(false) {
-    capacity_ = cap;
-    nodes_.resize(capacity_ + 1);
+  LRU(size_t capacity, int pin_level)
+    : capacity_(capacity), pin_level_(pin_level), count_(0),
+      iterator_valid_(false), last_(0) {
+    // Nodes are allocated on demand, so idle zsets stay cheap
+    nodes_.resize(kSegmentCount);
+    for (lru_size_t i = 0; i < kSegmentCount; i ++) {
+      nodes_[i].prev = nodes_[i].next = i;
+    }
+    segment_capacity_[kProbation] = capacity;
+    segment_capacity_[kProtected] = capacity / 2;
+    segment_capacity_[kPinned] = capacity / 4;
   }
   ~LRU() {
-    for (int i = 0; i < capacity_; i ++) {
-      delete nodes_[i].ptr;
+    for (auto& node : nodes_) {
+      delete node.ptr;
     }
   }
   LRU(const LRU& lru) = delete;
@@ -47,31 +72,57 @@ class LRU {
   bool      Has(const char* s);
   _T*       Refresh(const char* s);
   void      Remove(const char* s);
-  void      Resize(uint32_t zset_card);
+  LRUStats  Stats() const;
 
  private:
+  enum Segment : uint8_t {
+    kProbation = 0,
+    kProtected,
+    kPinned,
+    kSegmentCount
+  };
+  // Never evict below this count, so that the few nodes a single
+  // operation holds at a time stay valid even with a tiny budget
+  static constexpr lru_size_t kMinCount = 1 << 10;
+
   struct Node {
     lru_size_t prev;
     lru_size_t next;
     _T* ptr;
-    Node(): prev(0), next(0), ptr(nullptr) {}
+    uint32_t charge;
+    uint8_t segment;
+    Node(): prev(0), next(0), ptr(nullptr), charge(0), segment(kProbation) {}
   };
 
-  lru_size_t capacity_;
+  void        Attach(lru_size_t cur, uint8_t segment);
+  void        Detach(lru_size_t cur);
+  void        Recharge(lru_size_t cur);
+  void        Rebalance();
+  lru_size_t  Victim() const;
+
+  size_t capacity_;
+  int pin_level_;
   std::vector<Node> nodes_;
   std::vector<lru_size_t> free_list_;
-  lru_size_t root_;
   lru_size_t count_;
+  size_t charge_ = 0;
+  size_t segment_charge_[kSegmentCount] = {};
+  size_t segment_capacity_[kSegmentCount];
+  LRUStats stats_;
 
   lru_map_t kv_;
   lru_map_t::iterator iterator_;
   bool iterator_valid_;
+  // The key returned by the last Refresh, whose value may have changed
+  lru_size_t last_;
 };
 
 template <typename _T>
 inline bool LRU<_T>::Full() const {
-  return count_ == capacity_ &&
-    nodes_[nodes_[root_].prev].ptr->get_lru_state();
+  if (charge_ < capacity_ || count_ <= kMinCount) {
+    return false;
+  }
+  return nodes_[Victim()].ptr->get_lru_state();
 }
 
 template <typename _T>
@@ -83,62 +134,56 @@ bool LRU<_T>::Has(const char* s) {
 
 template <typename _T>
 _T* LRU<_T>::Refresh(const char* s) {
+  Recharge(last_);
   auto it = iterator_valid_ ? iterator_ : kv_.find(s);
+  iterator_valid_ = false;
   // Already in lru
   if (it != kv_.end()) {
-    iterator_valid_ = false;
+    ++ stats_.hit_count;
     lru_size_t cur = it->second;
-    auto node = nodes_[cur];
-    if (cur == nodes_[root_].next) {
-      return nodes_[cur].ptr;
+    uint8_t segment = nodes_[cur].segment == kProbation ? uint8_t(kProtected)
+                                                        : nodes_[cur].segment;
+    if (nodes_[cur].ptr->get_level() >= pin_level_) {
+      segment = kPinned;
     }
-    lru_size_t prev = nodes_[cur].prev;
-    lru_size_t next = nodes_[cur].next;
-    lru_size_t head = nodes_[root_].next;
-    nodes_[root_].next = cur;
-    nodes_[cur].prev = root_;
-    nodes_[cur].next = head;
-    nodes_[head].prev = cur;
-    nodes_[prev].next = next;
-    nodes_[next].prev = prev;
+    Detach(cur);
+    Attach(cur, segment);
+    Rebalance();
+    last_ = cur;
     return nodes_[cur].ptr;
   }
-  // Not in lru, two cases:
-  //   (1) and lru is full
-  if (count_ == capacity_) {
-    lru_size_t tail = nodes_[root_].prev;
-    _T* old_ptr = nodes_[tail].ptr;
-    char* old_key = old_ptr->get_key_string();
-    kv_.erase(kv_.find(old_key));
-    old_ptr->set_key_string(s);
-    kv_[old_key] = tail;
-
-    lru_size_t tail_prev = nodes_[tail].prev;
-    lru_size_t head = nodes_[root_].next;
-    nodes_[tail_prev].next = root_;
-    nodes_[root_].prev = tail_prev;
-    nodes_[root_].next = tail;
-    nodes_[tail].prev = root_;
-    nodes_[tail].next = head;
-    nodes_[head].prev = tail;
-    return old_ptr;
+  // Not in lru
+  ++ stats_.miss_count;
+  lru_size_t cur = 0;
+  //   (1) reuse the buffer of a victim if lru is full
+  while (charge_ >= capacity_ && count_ > kMinCount) {
+    lru_size_t victim = Victim();
+    if (nodes_[victim].ptr->get_lru_state()) {
+      // Never evict dirty data
+      break;
+    }
+    kv_.erase(kv_.find(nodes_[victim].ptr->get_key_string()));
+    Detach(victim);
+    -- count_;
+    if (cur) {
+      free_list_.push_back(cur);
+    }
+    cur = victim;
   }
-  //   (2) and lru is not full
-  lru_size_t cur = ++ count_;
-  if (!free_list_.empty()) {
+  //   (2) or a free buffer, or a new one
+  if (!cur && !free_list_.empty()) {
     cur = free_list_.back();
     free_list_.pop_back();
-  } else {
+  } else if (!cur) {
+    cur = nodes_.size();
+    nodes_.emplace_back();
     nodes_[cur].ptr = new _T();
   }
-  lru_size_t head = nodes_[root_].next;
-  nodes_[root_].next = cur;
-  nodes_[cur].prev = root_;
-  nodes_[cur].next = head;
-  nodes_[head].prev = cur;
-
+  ++ count_;
   nodes_[cur].ptr->set_key_string(s);
-  kv_[nodes_[cur].ptr->get_key_string()] = cur;
+  kv_[nodes_[cur].ptr->get_key_string_view()] = cur;
+  Attach(cur, kProbation);
+  last_ = cur;
   return nodes_[cur].ptr;
 }
 
@@ -152,21 +197,85 @@ void LRU<_T>::Remove(const char* s) {
     iterator_valid_ = false;
   }
   lru_size_t cur = it->second;
+  if (cur == last_) {
+    last_ = 0;
+  }
   -- count_;
   kv_.erase(it);
   free_list_.push_back(cur);
-  lru_size_t prev = nodes_[cur].prev;
-  lru_size_t next = nodes_[cur].next;
-  nodes_[prev].next = next;
-  nodes_[next].prev = prev;
+  Detach(cur);
+}
+
+template <typename _T>
+LRUStats LRU<_T>::Stats() const {
+  LRUStats stats = stats_;
+  stats.charge = charge_;
+  stats.pinned_charge = segment_charge_[kPinned];
+  return stats;
+}
+
+// Link cur as the head of segment and charge it
+template <typename _T>
+void LRU<_T>::Attach(lru_size_t cur, uint8_t segment) {
+  Node& node = nodes_[cur];
+  node.segment = segment;
+  node.charge = node.ptr->get_memory_size();
+  charge_ += node.charge;
+  segment_charge_[segment] += node.charge;
+  lru_size_t head = nodes_[segment].next;
+  node.prev = segment;
+  node.next = head;
+  nodes_[head].prev = cur;
+  nodes_[segment].next = cur;
+}
+
+template <typename _T>
+void LRU<_T>::Detach(lru_size_t cur) {
+  Node& node = nodes_[cur];
+  charge_ -= node.charge;
+  segment_charge_[node.segment] -= node.charge;
+  nodes_[node.prev].next = node.next;
+  nodes_[node.next].prev = node.prev;
+}
+
+// The value of cur may have been loaded or changed since it was charged
+template <typename _T>
+void LRU<_T>::Recharge(lru_size_t cur) {
+  if (cur == 0 || cur >= nodes_.size() || nodes_[cur].ptr == nullptr) {
+    return;
+  }
+  Node& node = nodes_[cur];
+  uint32_t charge = node.ptr->get_memory_size();
+  charge_ = charge_ - node.charge + charge;
+  segment_charge_[node.segment] = segment_charge_[node.segment] - node.charge + charge;
+  node.charge = charge;
+  if (node.segment == kProbation && node.ptr->get_level() >= pin_level_) {
+    Detach(cur);
+    Attach(cur, kPinned);
+    Rebalance();
+  }
 }
 
 template <typename _T>
-inline void LRU<_T>::Resize(uint32_t zset_card) {
-  if ((zset_card >> 3) > capacity_) {
-    capacity_ <<= 1;
-    nodes_.resize(capacity_ + 1);
+void LRU<_T>::Rebalance() {
+  for (uint8_t segment = kPinned; segment > kProbation; -- segment) {
+    while (segment_charge_[segment] > segment_capacity_[segment]) {
+      lru_size_t tail = nodes_[segment].prev;
+      Detach(tail);
+      Attach(tail, segment - 1);
+    }
+  }
+}
+
+// The first key to evict: the tail of the lowest non-empty segment
+template <typename _T>
+lru_size_t LRU<_T>::Victim() const {
+  for (lru_size_t segment = kProbation; segment < kSegmentCount; segment ++) {
+    if (nodes_[segment].prev != segment) {
+      return nodes_[segment].prev;
+    }
   }
+  return 0;
 }
 
 } // namespace ZSET
@@ -12,7 +12,7 @@
 namespace ZSET {
 
 template<typename _T>
-class RobinMapDict: public DictInterface<_T> {
+class RobinMapDict final: public DictInterface<_T> {
  public:
   RobinMapDict() = default;
   ~RobinMapDict();
@@ -21,6 +21,8 @@ class RobinMapDict: public DictInterface<_T> {
   _T*                   Find(const char* key) override;
   void                  Erase(_T* t) override;
   [[nodiscard]] _T*     NewKeyBuffer(const char* key, bool is_root = false) override;
+  bool                  PointerStable() const override { return true; }
+  bool                  ConcurrentFind() const override { return true; }
 
   // No persist operations
 
@@ -40,6 +42,7 @@ RobinMapDict<_T>::~RobinMapDict() {
 
 template<typename _T>
 _T* RobinMapDict<_T>::Find(const char* key) {
+  ++ thread_counters.dict_finds;
   auto it = data_.find(key);
   return it == data_.end() ? nullptr : it->second;
 }
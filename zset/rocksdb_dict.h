@@ -4,29 +4,44 @@
 #ifndef __ROCKSDB_DICT_H__
 #define __ROCKSDB_DICT_H__
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
-#include "rocksdb/db.h"
-#include "rocksdb/filter_policy.h"
-#include "rocksdb/options.h"
-#include "rocksdb/slice.h"
-#include "rocksdb/table.h"
+#include "rocksdb/sst_file_writer.h"
 
 #include "dict_interface.h"
+#include "rocksdb_store.h"
 
 namespace ZSET {
 
 template<typename _T>
-class RocksdbDict: public DictInterface<_T> {
+class RocksdbDict final: public DictInterface<_T> {
  public:
+  // Own a rocksdb instance at db_path
   RocksdbDict(std::string db_path, bool error_if_exists);
+  // Share the rocksdb instance of store, keys prefixed by zset_key
+  RocksdbDict(std::shared_ptr<RocksdbStore> store, std::string zset_key);
   ~RocksdbDict() override;
 
   // Memory operations
   void                  Erase(_T* t) override {}
   _T*                   Find(const char* key) override;
+  //  Lookup lru first, then MultiGet the missing keys from rocksdb
+  void                  FindMany(const std::vector<const char*>& keys,
+                                 const std::function<void(size_t, _T*)>& f) override;
+  void                  Touch(_T* t) override;
   [[nodiscard]] _T*     NewKeyBuffer(const char* key, bool is_root = false) override;
-  void                  ResizeLRUCapacity(uint32_t zset_card) override;
+  LRUStats              CacheStats() const override { return lru_->Stats(); }
+  DictStats             Stats() const override;
+  std::string           StoreStatistics() const override;
+  void                  SetDurability(const Durability& durability) override;
 
   // Persist operations
   //  1) Persist single key
@@ -38,57 +53,118 @@ class RocksdbDict: public DictInterface<_T> {
   //  4) Persist a batch of Put/Delete operations
   void BatchPersist(bool force = false) override;
 
+  // Bulk load through an external sst file
+  [[nodiscard]] _T* BulkLoadBuffer(const char* key) override;
+  void BulkLoadAdd(_T* t) override;
+  void BulkLoadFinish() override;
+
+  // Score index, next to the nodes in the key space of the zset
+  void EnableIndex(const std::function<void(_T*, std::string&)>& index_key) override;
+  void IndexAdd(_T* t) override;
+  void IndexDelete(_T* t) override;
+  bool IndexScan(const std::string& key, bool reverse,
+                 const std::function<bool(std::string_view)>& f) override;
+
   bool IterBegin(const char* key) override;
   void IterKey(std::string& key) override;
+  void IterValue(std::string& value) override;
   bool IterValid() override;
   void IterNext() override;
 
  private:
-  // Use lru as write buffer
+  void                          Recover();
+  ROCKSDB_NAMESPACE::Slice      PrefixedKey(const char* key);
+  // Group commit
+  void                          StartFlusher();
+  void                          StopFlusher();
+  void                          FlushLoop();
+  void                          WaitFlushed();
+  //   The value of key in a batch not yet written, false if there is
+  //   none, deleted if the batch deletes it
+  bool                          FindPending(const char* key, std::string& value,
+                                            bool* deleted);
+  void                          CountFlush(const ROCKSDB_NAMESPACE::WriteBatch& batch);
+
+  // Use lru as node cache and write buffer
   std::unique_ptr<LRU<_T>> lru_;
   _T root_;
   // Batch write
   ROCKSDB_NAMESPACE::WriteBatch write_batch_;
   std::vector<_T*> updated_ptrs_;
+  Durability durability_;
+  // Group commit: write_batch_ is appended to under mutex_ and written
+  // by flusher_, sequences count the BatchPersist calls appended/written
+  std::thread flusher_;
+  mutable std::mutex mutex_;
+  std::condition_variable flush_cv_;
+  std::condition_variable flushed_cv_;
+  ROCKSDB_NAMESPACE::WriteBatch flushing_batch_;
+  // Nodes of write_batch_/flushing_batch_ by key, until written_seq_
+  // covers their sequence, so that lookups never wait for the write
+  struct PendingWrite {
+    uint64_t seq;
+    bool put;
+    std::string value;
+  };
+  std::unordered_map<std::string, PendingWrite> pending_writes_;
+  uint32_t pending_count_ = 0;
+  uint64_t appended_seq_ = 0;
+  uint64_t written_seq_ = 0;
+  bool flush_requested_ = false;
+  bool stop_flusher_ = false;
+  ROCKSDB_NAMESPACE::Status flush_status_;
+  // Counters, the flush ones guarded by mutex_ under group commit
+  DictStats stats_;
+  // Score index: keys are prefix_ + '\0' + index_key_(node), after the
+  // root key and before every node, since members never start with '\0'.
+  // index_prefix_ alone marks that the index is complete
+  std::function<void(_T*, std::string&)> index_key_;
+  std::string index_prefix_;
+  //   Put (true) or Delete (false), not yet appended to write_batch_
+  std::vector<std::pair<std::string, bool>> index_updates_;
+  // Bulk load
+  _T bulk_load_buffer_;
+  std::vector<std::pair<std::string, std::string>> bulk_load_kvs_;
   // Iterator
   std::unique_ptr<ROCKSDB_NAMESPACE::Iterator> iterator_;
   // String buffer to Get from rocksdb
   std::string string_buffer_;
+  // String buffer to encode values for Put
+  std::string value_buffer_;
+  // Rocksdb instance, owned by store_
+  std::shared_ptr<RocksdbStore> store_;
+  ROCKSDB_NAMESPACE::DB* rocksdb_;
+  // Prefix of all keys of this zset, empty if the instance is not shared
+  std::string prefix_;
+  std::string key_buffer_;
   // Rocksdb options
-  std::unique_ptr<ROCKSDB_NAMESPACE::DB> rocksdb_;
-  ROCKSDB_NAMESPACE::Options options_;
   ROCKSDB_NAMESPACE::ReadOptions read_options_;
   ROCKSDB_NAMESPACE::Status status_;
   ROCKSDB_NAMESPACE::WriteOptions write_options_;
 };
 
 template<typename _T>
-RocksdbDict<_T>::RocksdbDict(std::string db_path, bool error_if_exists) {
+RocksdbDict<_T>::RocksdbDict(std::string db_path, bool error_if_exists)
+  : store_(new RocksdbStore(db_path, error_if_exists)) {
+  rocksdb_ = store_->db();
+  Recover();
+}
+
+template<typename _T>
+RocksdbDict<_T>::RocksdbDict(std::shared_ptr<RocksdbStore> store,
+                             std::string zset_key)
+  : store_(store), prefix_(RocksdbStore::KeyPrefix(zset_key)) {
+  rocksdb_ = store_->db();
+  Recover();
+}
+
+template<typename _T>
+void RocksdbDict<_T>::Recover() {
   // Read options
   read_options_.verify_checksums = false;
-  // Db options
-  // options_.compression = ROCKSDB_NAMESPACE::kNoCompression;
-  options_.create_if_missing = true;
-  options_.error_if_exists = error_if_exists;
-  options_.bytes_per_sync = 1 << 20;
-  options_.max_background_compactions = 4;
-  options_.max_background_flushes = 2;
-  // Table options
-  ROCKSDB_NAMESPACE::BlockBasedTableOptions table_options;
-  //   1) Bloom filter
-  table_options.filter_policy.reset(
-    ROCKSDB_NAMESPACE::NewBloomFilterPolicy(10, false));
-  //   2) Block cache
-  table_options.block_cache = ROCKSDB_NAMESPACE::NewLRUCache(64 << 20);
-  options_.table_factory.reset(
-    ROCKSDB_NAMESPACE::NewBlockBasedTableFactory(table_options));
-  // Open rocksdb
-  ROCKSDB_NAMESPACE::DB* db_ptr = nullptr;
-  status_ = ROCKSDB_NAMESPACE::DB::Open(options_, db_path, &db_ptr);
-  assert(status_.ok());
-  rocksdb_.reset(db_ptr);
-  // Do recovery if db dir already exists
-  status_ = rocksdb_->Get(read_options_, kZsetRoot, &string_buffer_);
+  // Do recovery if root key already exists
+  status_ = rocksdb_->Get(read_options_, PrefixedKey(kZsetRoot),
+                          &string_buffer_);
   if (status_.ok()) {
     // Load root key from rocksdb
     root_.set_value_string(string_buffer_);
@@ -97,64 +173,124 @@ RocksdbDict<_T>::RocksdbDict(std::string db_path, bool error_if_exists) {
     root_.set_lru_state(LRU_OK);
   }
   // LRU
-  lru_.reset(new LRU<_T>(1 << 10));
+  lru_.reset(new LRU<_T>(store_->node_cache_size(),
+                         ROCKSDB_NODE_CACHE_PIN_LEVEL));
 }
 
 template<typename _T>
 RocksdbDict<_T>::~RocksdbDict() {
-
-#ifdef ROCKSDB_BULK_WRITE_SIZE
-  BatchPersist(true);
-#endif
-  iterator_.release();
+  try {
+    BatchPersist(true);
+  } catch (const std::runtime_error& e) {
+    // A failed group commit was already reported to the writer, if any
+  }
+  StopFlusher();
+  iterator_.reset();
 }
 
 template<typename _T>
 _T* RocksdbDict<_T>::Find(const char* key) {
   assert(*key != '\0');
+  ++ thread_counters.dict_finds;
 
-#ifdef ROCKSDB_BULK_WRITE_SIZE
   BatchPersist();
-#endif
 
   // Lookup key in lru
   if (lru_->Has(key)) {
     _T* t = lru_->Refresh(key);
     return t->get_lru_state() == LRU_EXPIRED ? nullptr : t;
   }
-  // Lookup key in rocksdb
-  status_ = rocksdb_->Get(read_options_, key, &string_buffer_);
-  if (status_.ok()) {
-    _T* t = lru_->Refresh(key);
-    t->set_value_string(string_buffer_);
-    return t;
+  // Lookup key in the batches not yet written, then in rocksdb
+  bool deleted = false;
+  if (FindPending(key, string_buffer_, &deleted)) {
+    if (deleted) {
+      return nullptr;
+    }
+  } else {
+    ++ thread_counters.store_reads;
+    ++ stats_.store_reads;
+    status_ = rocksdb_->Get(read_options_, PrefixedKey(key), &string_buffer_);
+    if (!status_.ok()) {
+      // Not found
+      return nullptr;
+    }
+  }
+  _T* t = lru_->Refresh(key);
+  t->set_value_string(string_buffer_);
+  return t;
+}
+
+template<typename _T>
+void RocksdbDict<_T>::FindMany(const std::vector<const char*>& keys,
+                               const std::function<void(size_t, _T*)>& f) {
+  std::vector<size_t> missed;
+  std::vector<std::string> missed_keys;
+  thread_counters.dict_finds += keys.size();
+  for (size_t i = 0; i < keys.size(); i ++) {
+    assert(*keys[i] != '\0');
+    if (lru_->Has(keys[i])) {
+      _T* t = lru_->Refresh(keys[i]);
+      if (t->get_lru_state() != LRU_EXPIRED) {
+        f(i, t);
+      }
+      continue;
+    }
+    bool deleted = false;
+    if (FindPending(keys[i], string_buffer_, &deleted)) {
+      if (!deleted) {
+        BatchPersist();
+        _T* t = lru_->Refresh(keys[i]);
+        t->set_value_string(string_buffer_);
+        f(i, t);
+      }
+    } else {
+      missed.push_back(i);
+      missed_keys.emplace_back(PrefixedKey(keys[i]).ToString());
+    }
+  }
+  if (missed.empty()) {
+    return;
+  }
+  thread_counters.store_reads += missed.size();
+  stats_.store_reads += missed.size();
+  std::vector<ROCKSDB_NAMESPACE::Slice> slices(missed_keys.begin(),
+                                               missed_keys.end());
+  std::vector<std::string> values;
+  auto statuses = rocksdb_->MultiGet(read_options_, slices, &values);
+  for (size_t j = 0; j < missed.size(); j ++) {
+    if (statuses[j].ok()) {
+      // Never evict dirty data from lru
+      BatchPersist();
+
+      _T* t = lru_->Refresh(keys[missed[j]]);
+      t->set_value_string(values[j]);
+      f(missed[j], t);
+    }
+  }
+}
+
+template<typename _T>
+void RocksdbDict<_T>::Touch(_T* t) {
+  if (t != &root_) {
+    lru_->Refresh(t->get_key_string());
   }
-  // Not found
-  return nullptr;
 }
 
 template<typename _T>
 _T* RocksdbDict<_T>::NewKeyBuffer(const char* key, bool is_root) {
   if (!is_root) {
-
-#ifdef ROCKSDB_BULK_WRITE_SIZE
     BatchPersist();
-#endif
-
     return lru_->Refresh(key);
   }
   return &root_;
 }
 
-template<typename _T>
-void RocksdbDict<_T>::ResizeLRUCapacity(uint32_t zset_card) {
-  lru_->Resize(zset_card);
-}
-
 template<typename _T>
 void RocksdbDict<_T>::Persist(_T* t) {
-  rocksdb_->Put(write_options_, t->get_key_string(),
-                                t->get_value_string_view());
+  WaitFlushed();
+  t->get_value_string(value_buffer_);
+  rocksdb_->Put(write_options_, PrefixedKey(t->get_key_string()),
+                value_buffer_);
 }
 
 template<typename _T>
@@ -181,59 +317,400 @@ void RocksdbDict<_T>::BatchDelete(_T* t) {
 
 template<typename _T>
 void RocksdbDict<_T>::BatchPersist(bool force) {
-
-#ifdef ROCKSDB_BULK_WRITE_SIZE
-  if (!force && !lru_->Full() &&
-      updated_ptrs_.size() < ROCKSDB_BULK_WRITE_SIZE) {
+  bool group_commit = flusher_.joinable();
+  if (!force && !group_commit && !lru_->Full() &&
+      updated_ptrs_.size() < durability_.batch_size) {
+    return;
+  }
+  if (updated_ptrs_.empty()) {
+    if (force) {
+      WaitFlushed();
+    }
     return;
   }
-#endif
 
   // Flush dirty data in write buffer
+  std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+  if (group_commit) {
+    lock.lock();
+    if (!flush_status_.ok()) {
+      throw std::runtime_error("group commit failed: " + flush_status_.ToString());
+    }
+  }
   for (auto t : updated_ptrs_) {
     auto key = t->get_key_string();
     auto lru_state = t->get_lru_state();
     if (lru_state == LRU_DIRTY) {
       t->set_lru_state(LRU_OK);
-      write_batch_.Put(key, t->get_value_string_view());
+      t->get_value_string(value_buffer_);
+      write_batch_.Put(PrefixedKey(key), value_buffer_);
+      if (group_commit) {
+        pending_writes_[key] = {appended_seq_ + 1, true, value_buffer_};
+      }
     } else if (lru_state == LRU_EXPIRED) {
       t->set_lru_state(LRU_OK);
-      write_batch_.Delete(key);
+      write_batch_.Delete(PrefixedKey(key));
+      if (group_commit) {
+        pending_writes_[key] = {appended_seq_ + 1, false, ""};
+      }
       lru_->Remove(key);
     }
   }
+  updated_ptrs_.clear();
+  // The index entries go in the same batch as their nodes
+  for (auto& [key, put] : index_updates_) {
+    if (put) {
+      write_batch_.Put(key, ROCKSDB_NAMESPACE::Slice());
+    } else {
+      write_batch_.Delete(key);
+    }
+  }
+  index_updates_.clear();
+  if (group_commit) {
+    // Leave the write to flusher_
+    ++ appended_seq_;
+    if (++ pending_count_ >= durability_.batch_size || force) {
+      flush_requested_ = true;
+      flush_cv_.notify_one();
+    }
+    lock.unlock();
+    if (force) {
+      WaitFlushed();
+    }
+    return;
+  }
   // Persist to disk
+  CountFlush(write_batch_);
   rocksdb_->Write(write_options_, &write_batch_);
-  updated_ptrs_.clear();
   write_batch_.Clear();
 }
 
+template<typename _T>
+void RocksdbDict<_T>::SetDurability(const Durability& durability) {
+  BatchPersist(true);
+  StopFlusher();
+  durability_ = durability;
+  durability_.batch_size = std::max(1u, durability_.batch_size);
+  if (durability_.mode == DURABILITY_SYNC) {
+    durability_.batch_size = 1;
+  }
+  write_options_.sync = durability_.mode == DURABILITY_SYNC ||
+                        durability_.mode == DURABILITY_GROUP_COMMIT;
+  write_options_.disableWAL = durability_.mode == DURABILITY_NO_WAL;
+  if (durability_.mode == DURABILITY_GROUP_COMMIT) {
+    StartFlusher();
+  }
+}
+
+////////////////////////////// BEGIN Group Commit //////////////////////////////
+template<typename _T>
+void RocksdbDict<_T>::StartFlusher() {
+  stop_flusher_ = false;
+  flusher_ = std::thread([this]() { FlushLoop(); });
+}
+
+template<typename _T>
+void RocksdbDict<_T>::StopFlusher() {
+  if (!flusher_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_flusher_ = true;
+  }
+  flush_cv_.notify_one();
+  flusher_.join();
+}
+
+template<typename _T>
+void RocksdbDict<_T>::FlushLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    flush_cv_.wait_for(lock, std::chrono::milliseconds(durability_.interval_ms),
+                       [this]() { return stop_flusher_ || flush_requested_; });
+    flush_requested_ = false;
+    if (pending_count_ == 0) {
+      if (stop_flusher_) {
+        break;
+      }
+      continue;
+    }
+    std::swap(write_batch_, flushing_batch_);
+    uint64_t seq = appended_seq_;
+    pending_count_ = 0;
+    lock.unlock();
+    auto status = rocksdb_->Write(write_options_, &flushing_batch_);
+    lock.lock();
+    CountFlush(flushing_batch_);
+    flushing_batch_.Clear();
+    if (!status.ok()) {
+      flush_status_ = status;
+    }
+    written_seq_ = seq;
+    for (auto it = pending_writes_.begin(); it != pending_writes_.end();) {
+      it = it->second.seq <= seq ? pending_writes_.erase(it) : std::next(it);
+    }
+    flushed_cv_.notify_all();
+  }
+}
+
+// Block until every appended batch has been written
+template<typename _T>
+void RocksdbDict<_T>::WaitFlushed() {
+  if (!flusher_.joinable()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  uint64_t seq = appended_seq_;
+  if (written_seq_ < seq) {
+    flush_requested_ = true;
+    flush_cv_.notify_one();
+    flushed_cv_.wait(lock, [&]() { return written_seq_ >= seq; });
+  }
+}
+template<typename _T>
+bool RocksdbDict<_T>::FindPending(const char* key, std::string& value,
+                                  bool* deleted) {
+  if (!flusher_.joinable()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = pending_writes_.find(key);
+  if (it == pending_writes_.end()) {
+    return false;
+  }
+  *deleted = !it->second.put;
+  value = it->second.value;
+  return true;
+}
+////////////////////////////// END Group Commit //////////////////////////////
+
+template<typename _T>
+void RocksdbDict<_T>::CountFlush(const ROCKSDB_NAMESPACE::WriteBatch& batch) {
+  ++ stats_.flushes;
+  stats_.flushed_keys += batch.Count();
+  stats_.flushed_bytes += batch.GetDataSize();
+}
+
+template<typename _T>
+DictStats RocksdbDict<_T>::Stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  DictStats stats = stats_;
+  stats.dirty_count = updated_ptrs_.size() + write_batch_.Count() +
+                      flushing_batch_.Count();
+  return stats;
+}
+
+template<typename _T>
+std::string RocksdbDict<_T>::StoreStatistics() const {
+  auto& statistics = store_->options().statistics;
+  return statistics ? statistics->ToString() : "";
+}
+
+
+template<typename _T>
+_T* RocksdbDict<_T>::BulkLoadBuffer(const char* key) {
+  bulk_load_buffer_.set_key_string(key);
+  return &bulk_load_buffer_;
+}
+
+template<typename _T>
+void RocksdbDict<_T>::BulkLoadAdd(_T* t) {
+  t->get_value_string(value_buffer_);
+  bulk_load_kvs_.emplace_back(PrefixedKey(t->get_key_string()).ToString(),
+                              value_buffer_);
+  if (index_key_) {
+    bulk_load_kvs_.emplace_back(index_prefix_, "");
+    index_key_(t, bulk_load_kvs_.back().first);
+  }
+}
+
+template<typename _T>
+void RocksdbDict<_T>::BulkLoadFinish() {
+  // Flush pending deletes first, or they would shadow the ingested keys
+  BatchPersist(true);
+  if (bulk_load_kvs_.empty()) {
+    return;
+  }
+  // Sst files take keys in ascending order
+  std::sort(bulk_load_kvs_.begin(), bulk_load_kvs_.end());
+  std::string sst_path = rocksdb_->GetName() + "/bulk_load_" +
+    std::to_string(reinterpret_cast<uintptr_t>(this)) + ".sst";
+  ROCKSDB_NAMESPACE::SstFileWriter writer(ROCKSDB_NAMESPACE::EnvOptions(),
+                                          store_->options());
+  status_ = writer.Open(sst_path);
+  for (size_t i = 0; status_.ok() && i < bulk_load_kvs_.size(); i ++) {
+    status_ = writer.Put(bulk_load_kvs_[i].first, bulk_load_kvs_[i].second);
+  }
+  if (status_.ok()) {
+    status_ = writer.Finish();
+  }
+  bulk_load_kvs_.clear();
+  bulk_load_kvs_.shrink_to_fit();
+  if (status_.ok()) {
+    ROCKSDB_NAMESPACE::IngestExternalFileOptions ingest_options;
+    ingest_options.move_files = true;
+    status_ = rocksdb_->IngestExternalFile({sst_path}, ingest_options);
+  }
+  if (!status_.ok()) {
+    throw std::runtime_error("bulk load failed: " + status_.ToString());
+  }
+}
+
+////////////////////////////// BEGIN Score Index //////////////////////////////
+template<typename _T>
+void RocksdbDict<_T>::EnableIndex(const std::function<void(_T*, std::string&)>& index_key) {
+  index_key_ = index_key;
+  index_prefix_ = prefix_ + '\0';
+  if (rocksdb_->Get(read_options_, index_prefix_, &string_buffer_).ok()) {
+    return;
+  }
+  // Index the nodes written before, in batches. The marker goes last,
+  // so that an interrupted build starts over on the next open
+  ROCKSDB_NAMESPACE::WriteBatch batch;
+  _T node;
+  std::string member, value, key;
+  for (bool valid = IterBegin(kZsetRoot); valid; IterNext(), valid = IterValid()) {
+    IterKey(member);
+    IterValue(value);
+    node.set_key_string(member.data());
+    node.set_value_string(value);
+    key.assign(index_prefix_);
+    index_key_(&node, key);
+    batch.Put(key, ROCKSDB_NAMESPACE::Slice());
+    if (batch.Count() >= ROCKSDB_BULK_WRITE_SIZE) {
+      rocksdb_->Write(write_options_, &batch);
+      batch.Clear();
+    }
+  }
+  iterator_.reset();
+  batch.Put(index_prefix_, ROCKSDB_NAMESPACE::Slice());
+  rocksdb_->Write(write_options_, &batch);
+}
+
+template<typename _T>
+void RocksdbDict<_T>::IndexAdd(_T* t) {
+  if (index_key_) {
+    index_updates_.emplace_back(index_prefix_, true);
+    index_key_(t, index_updates_.back().first);
+  }
+}
+
+template<typename _T>
+void RocksdbDict<_T>::IndexDelete(_T* t) {
+  if (index_key_) {
+    index_updates_.emplace_back(index_prefix_, false);
+    index_key_(t, index_updates_.back().first);
+  }
+}
+
+template<typename _T>
+bool RocksdbDict<_T>::IndexScan(const std::string& key, bool reverse,
+                                const std::function<bool(std::string_view)>& f) {
+  if (!index_key_) {
+    return false;
+  }
+  if (flusher_.joinable()) {
+    // Never wait for a synced write on the read path
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!index_updates_.empty() || written_seq_ < appended_seq_) {
+      return false;
+    }
+  }
+  // Updates not yet persisted are merged over the scan rather than
+  // flushed, the last one of a key wins
+  std::map<std::string_view, bool> pending;
+  for (auto& [index_key, put] : index_updates_) {
+    pending[index_key] = put;
+  }
+  std::string lower = index_prefix_, upper = prefix_ + '\x01';
+  ROCKSDB_NAMESPACE::Slice lower_bound(lower), upper_bound(upper);
+  ROCKSDB_NAMESPACE::ReadOptions read_options = read_options_;
+  read_options.iterate_lower_bound = &lower_bound;
+  read_options.iterate_upper_bound = &upper_bound;
+  read_options.readahead_size = ROCKSDB_INDEX_READAHEAD_SIZE;
+  std::unique_ptr<ROCKSDB_NAMESPACE::Iterator> it(rocksdb_->NewIterator(read_options));
+  std::string target = index_prefix_ + key;
+  auto pending_it = pending.end();
+  if (reverse && key.empty()) {
+    it->SeekToLast();
+  } else if (reverse) {
+    it->SeekForPrev(target);
+    pending_it = pending.upper_bound(target);
+  } else {
+    it->Seek(target);
+    pending_it = pending.lower_bound(target);
+  }
+  // Backwards, pending_it is one past the next pending update
+  bool pending_valid = reverse ? pending_it != pending.begin() : pending_it != pending.end();
+  for (;;) {
+    bool valid = it->Valid() && it->key().starts_with(index_prefix_);
+    if (!valid && !pending_valid) {
+      break;
+    }
+    std::string_view k, pending_key;
+    if (valid) {
+      k = std::string_view(it->key().data(), it->key().size());
+    }
+    if (pending_valid) {
+      pending_key = (reverse ? std::prev(pending_it) : pending_it)->first;
+    }
+    // Which comes first, < 0 for the persisted key and > 0 for the
+    // pending update, 0 for the same key
+    int cmp = !valid ? 1 : !pending_valid ? -1 :
+              reverse ? pending_key.compare(k) : k.compare(pending_key);
+    bool put = true;
+    if (cmp >= 0) {
+      // The pending update replaces the persisted key, if any
+      put = (reverse ? std::prev(pending_it) : pending_it)->second;
+      k = pending_key;
+    }
+    // Skip the marker
+    if (put && k.size() > index_prefix_.size() &&
+        !f(k.substr(index_prefix_.size()))) {
+      break;
+    }
+    if (cmp >= 0) {
+      reverse ? -- pending_it : ++ pending_it;
+      pending_valid = reverse ? pending_it != pending.begin() : pending_it != pending.end();
+    }
+    if (cmp <= 0) {
+      reverse ? it->Prev() : it->Next();
+    }
+  }
+  return true;
+}
+////////////////////////////// END Score Index //////////////////////////////
 
 ////////////////////////////// BEGIN Iterator //////////////////////////////
 template<typename _T>
 bool RocksdbDict<_T>::IterBegin(const char* key) {
-
-#ifdef ROCKSDB_BULK_WRITE_SIZE
-    BatchPersist(true);
-#endif
+  BatchPersist(true);
 
   iterator_.reset(rocksdb_->NewIterator(read_options_));
-  iterator_->Seek(key);
-  // Skip root key
-  if (IterValid() && iterator_->key().size() == 0) {
-    IterNext();
+  // The root key and the score index sort before every member
+  if (*key == '\0') {
+    iterator_->Seek(prefix_ + '\x01');
+  } else {
+    iterator_->Seek(PrefixedKey(key));
   }
   return IterValid();
 }
 
 template<typename _T>
 void RocksdbDict<_T>::IterKey(std::string& key) {
-  key.assign(iterator_->key().data(), iterator_->key().size());
+  key.assign(iterator_->key().data() + prefix_.size(),
+             iterator_->key().size() - prefix_.size());
+}
+
+template<typename _T>
+void RocksdbDict<_T>::IterValue(std::string& value) {
+  value.assign(iterator_->value().data(), iterator_->value().size());
 }
 
 template<typename _T>
 bool RocksdbDict<_T>::IterValid() {
-  return iterator_->Valid();
+  return iterator_->Valid() && iterator_->key().starts_with(prefix_);
 }
 
 template<typename _T>
@@ -242,6 +719,16 @@ void RocksdbDict<_T>::IterNext() {
 }
 ////////////////////////////// END Iterator //////////////////////////////
 
+template<typename _T>
+ROCKSDB_NAMESPACE::Slice RocksdbDict<_T>::PrefixedKey(const char* key) {
+  if (prefix_.empty()) {
+    return key;
+  }
+  key_buffer_.assign(prefix_);
+  key_buffer_.append(key);
+  return key_buffer_;
+}
+
 
 } // namespace ZSET
 
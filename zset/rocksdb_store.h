@@ -0,0 +1,104 @@
+ // coldcolacos@gmail.com
+
+#ifndef __ROCKSDB_STORE_H__
+#define __ROCKSDB_STORE_H__
+
+#include <cassert>
+#include <memory>
+#include <string>
+
+#include "rocksdb/db.h"
+#include "rocksdb/filter_policy.h"
+#include "rocksdb/options.h"
+#include "rocksdb/slice.h"
+#include "rocksdb/statistics.h"
+#include "rocksdb/table.h"
+
+#include "coding.h"
+#include "settings.h"
+
+namespace ZSET {
+
+/*
+  A rocksdb instance shared by many zsets. All of them share one block
+  cache, one WAL and one set of background threads, and every key of a
+  zset is prefixed with the varint length of the zset key followed by
+  the zset key itself, so that no prefix is a prefix of another.
+*/
+class RocksdbStore {
+ public:
+  RocksdbStore(std::string db_path,
+               bool error_if_exists = false,
+               size_t block_cache_size = 64 << 20,
+               size_t node_cache_size = ROCKSDB_NODE_CACHE_SIZE);
+  // Open with options tuned by the caller, e.g. WAL or compaction settings
+  RocksdbStore(std::string db_path,
+               const ROCKSDB_NAMESPACE::Options& options,
+               size_t node_cache_size = ROCKSDB_NODE_CACHE_SIZE);
+  ~RocksdbStore() = default;
+  RocksdbStore(const RocksdbStore& s) = delete;
+  RocksdbStore& operator=(const RocksdbStore& s) = delete;
+
+  ROCKSDB_NAMESPACE::DB* db() { return rocksdb_.get(); }
+  const ROCKSDB_NAMESPACE::Options& options() const { return options_; }
+  // Memory budget of the node cache of each zset in this store
+  size_t node_cache_size() const { return node_cache_size_; }
+  static std::string KeyPrefix(const std::string& zset_key);
+
+ private:
+  void Open(const std::string& db_path);
+
+  std::unique_ptr<ROCKSDB_NAMESPACE::DB> rocksdb_;
+  ROCKSDB_NAMESPACE::Options options_;
+  ROCKSDB_NAMESPACE::Status status_;
+  size_t node_cache_size_;
+};
+
+inline RocksdbStore::RocksdbStore(std::string db_path, bool error_if_exists,
+                                  size_t block_cache_size, size_t node_cache_size)
+  : node_cache_size_(node_cache_size) {
+  // Db options
+  // options_.compression = ROCKSDB_NAMESPACE::kNoCompression;
+  options_.create_if_missing = true;
+  options_.error_if_exists = error_if_exists;
+  options_.bytes_per_sync = 1 << 20;
+  options_.max_background_compactions = 4;
+  options_.max_background_flushes = 2;
+  // Statistics, reported by Zset::Stats()
+  options_.statistics = ROCKSDB_NAMESPACE::CreateDBStatistics();
+  // Table options
+  ROCKSDB_NAMESPACE::BlockBasedTableOptions table_options;
+  //   1) Bloom filter
+  table_options.filter_policy.reset(
+    ROCKSDB_NAMESPACE::NewBloomFilterPolicy(10, false));
+  //   2) Block cache
+  table_options.block_cache = ROCKSDB_NAMESPACE::NewLRUCache(block_cache_size);
+  options_.table_factory.reset(
+    ROCKSDB_NAMESPACE::NewBlockBasedTableFactory(table_options));
+  Open(db_path);
+}
+
+inline RocksdbStore::RocksdbStore(std::string db_path,
+                                  const ROCKSDB_NAMESPACE::Options& options,
+                                  size_t node_cache_size)
+  : options_(options), node_cache_size_(node_cache_size) {
+  Open(db_path);
+}
+
+inline void RocksdbStore::Open(const std::string& db_path) {
+  ROCKSDB_NAMESPACE::DB* db_ptr = nullptr;
+  status_ = ROCKSDB_NAMESPACE::DB::Open(options_, db_path, &db_ptr);
+  assert(status_.ok());
+  rocksdb_.reset(db_ptr);
+}
+
+inline std::string RocksdbStore::KeyPrefix(const std::string& zset_key) {
+  std::string prefix;
+  PutVarint32(prefix, zset_key.size());
+  prefix.append(zset_key);
+  return prefix;
+}
+
+} // namespace ZSET
+
+#endif // __ROCKSDB_STORE_H__
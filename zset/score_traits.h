@@ -0,0 +1,181 @@
+ // coldcolacos@gmail.com
+
+#ifndef __SCORE_TRAITS_H__
+#define __SCORE_TRAITS_H__
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace ZSET {
+
+/*
+  Order-preserving byte encoding of a score type: a < b if and only if
+  the kSize bytes encoding a are bytewise less than those encoding b,
+  so that rocksdb keys of (score, member) sort as the skiplist does.
+  Integral and floating scores are encoded out of the box. To index a
+  custom score type, specialize ScoreTraits for it:
+
+    template <>
+    struct ZSET::ScoreTraits<MyScore> {
+      static constexpr bool kOrdered = true;
+      static constexpr size_t kSize = ...;
+      static void Encode(const MyScore& score, char* buf);
+      static MyScore Decode(const char* buf);
+    };
+*/
+template <typename _T, typename = void>
+struct ScoreTraits {
+  static constexpr bool kOrdered = false;
+};
+
+// Big endian unsigned integers sort bytewise
+template <typename _U>
+inline void EncodeBigEndian(_U u, char* buf) {
+  for (size_t i = 0; i < sizeof(_U); i ++) {
+    buf[i] = char(u >> ((sizeof(_U) - 1 - i) * 8));
+  }
+}
+
+template <typename _U>
+inline _U DecodeBigEndian(const char* buf) {
+  _U u = 0;
+  for (size_t i = 0; i < sizeof(_U); i ++) {
+    u = (u << 8) | uint8_t(buf[i]);
+  }
+  return u;
+}
+
+// Integers, with the sign bit of signed ones flipped
+template <typename _T>
+struct ScoreTraits<_T, std::enable_if_t<std::is_integral<_T>::value &&
+                                        !std::is_same<_T, bool>::value>> {
+  static constexpr bool kOrdered = true;
+  static constexpr size_t kSize = sizeof(_T);
+  using _U = std::make_unsigned_t<_T>;
+  static constexpr _U kFlip = std::is_signed<_T>::value ? _U(1) << (kSize * 8 - 1) : 0;
+
+  static void Encode(const _T& score, char* buf) {
+    EncodeBigEndian<_U>(_U(score) ^ kFlip, buf);
+  }
+  static _T Decode(const char* buf) {
+    return _T(DecodeBigEndian<_U>(buf) ^ kFlip);
+  }
+};
+
+// IEEE 754 floats: all bits flipped for negatives, the sign bit otherwise
+template <typename _T>
+struct ScoreTraits<_T, std::enable_if_t<std::is_floating_point<_T>::value &&
+                                        (sizeof(_T) == 4 || sizeof(_T) == 8)>> {
+  static constexpr bool kOrdered = true;
+  static constexpr size_t kSize = sizeof(_T);
+  using _U = std::conditional_t<kSize == 4, uint32_t, uint64_t>;
+  static constexpr _U kSign = _U(1) << (kSize * 8 - 1);
+
+  static void Encode(const _T& score, char* buf) {
+    // -0.0 equals 0.0 in the skiplist, so it must encode the same
+    _T s = score == 0 ? 0 : score;
+    _U u;
+    memcpy(&u, &s, kSize);
+    EncodeBigEndian<_U>(u & kSign ? ~u : u | kSign, buf);
+  }
+  static _T Decode(const char* buf) {
+    _U u = DecodeBigEndian<_U>(buf);
+    u = u & kSign ? u ^ kSign : ~u;
+    _T score;
+    memcpy(&score, &u, kSize);
+    return score;
+  }
+};
+
+/*
+  Normalized key of (score, member) for comparisons in memory: the
+  encoded score followed by the first bytes of the member, zero padded,
+  read as big endian words, one for scores of up to 4 bytes and two for
+  8 bytes. Keys order as (score, member) do, so most comparisons are
+  one or two integer compares, and only equal keys need the members.
+  Integral and floating scores only, see kNormalizedKey. Like Encode,
+  it keeps no sign of zero: zsets store -0.0 as 0.0.
+*/
+template <typename _T>
+struct NormalizedKey {
+  static constexpr int kWords = sizeof(_T) <= 4 ? 1 : 2;
+  static constexpr size_t kMemberSize = kWords * 8 - sizeof(_T);
+  uint64_t w[kWords];
+
+  // Sorts after all keys, for links to no node
+  static NormalizedKey Max() {
+    NormalizedKey key;
+    for (auto& word : key.w) {
+      word = ~uint64_t(0);
+    }
+    return key;
+  }
+  static NormalizedKey Of(const _T& score, const char* member) {
+    char buf[kWords * 8];
+    ScoreTraits<_T>::Encode(score, buf);
+    PutMember(member, buf);
+    return Read(buf);
+  }
+  _T Score() const {
+    char buf[kWords * 8];
+    Write(buf);
+    return ScoreTraits<_T>::Decode(buf);
+  }
+  void SetScore(const _T& score) {
+    char buf[kWords * 8];
+    Write(buf);
+    ScoreTraits<_T>::Encode(score, buf);
+    *this = Read(buf);
+  }
+  void SetMember(const char* member) {
+    char buf[kWords * 8];
+    Write(buf);
+    PutMember(member, buf);
+    *this = Read(buf);
+  }
+  // The member bytes alone, which order members of equal scores
+  uint64_t MemberBits() const {
+    if constexpr (kWords == 1) {
+      return w[0] & (~uint64_t(0) >> (sizeof(_T) * 8));
+    }
+    return w[kWords - 1];
+  }
+  friend bool operator<(const NormalizedKey& a, const NormalizedKey& b) {
+    if constexpr (kWords == 1) {
+      return a.w[0] < b.w[0];
+    }
+    return a.w[0] < b.w[0] || (a.w[0] == b.w[0] && a.w[1] < b.w[1]);
+  }
+
+ private:
+  static void PutMember(const char* member, char* buf) {
+    size_t i = 0;
+    for (; i < kMemberSize && member[i] != '\0'; i ++) {
+      buf[sizeof(_T) + i] = member[i];
+    }
+    memset(buf + sizeof(_T) + i, 0, kMemberSize - i);
+  }
+  static NormalizedKey Read(const char* buf) {
+    NormalizedKey key;
+    for (int i = 0; i < kWords; i ++) {
+      key.w[i] = DecodeBigEndian<uint64_t>(buf + i * 8);
+    }
+    return key;
+  }
+  void Write(char* buf) const {
+    for (int i = 0; i < kWords; i ++) {
+      EncodeBigEndian<uint64_t>(w[i], buf + i * 8);
+    }
+  }
+};
+
+// Scores whose links carry a NormalizedKey instead of the score
+template <typename _T>
+inline constexpr bool kNormalizedKey =
+    std::is_arithmetic<_T>::value && !std::is_same<_T, bool>::value &&
+    sizeof(_T) <= 8 && ScoreTraits<_T>::kOrdered;
+
+} // namespace ZSET
+
+#endif // __SCORE_TRAITS_H__
@@ -5,6 +5,13 @@
 #define __SETTINGS_H__
 
 #define ROCKSDB_BULK_WRITE_SIZE (1 << 16)
+#define ROCKSDB_NODE_CACHE_SIZE (size_t(256) << 20)
+#define ROCKSDB_NODE_CACHE_PIN_LEVEL 4
+#define ROCKSDB_INDEX_READAHEAD_SIZE (size_t(2) << 20)
+// Bytes of a LOG_DICT segment before it is sealed
+#ifndef LOG_DICT_SEGMENT_SIZE
+#define LOG_DICT_SEGMENT_SIZE (size_t(64) << 20)
+#endif
 #define SKIPLIST_P (1.0 / 2.72)
 
 #endif // __SETTINGS_H__
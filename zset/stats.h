@@ -0,0 +1,283 @@
+ // coldcolacos@gmail.com
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "lru.h"
+
+namespace ZSET {
+
+enum StatsLevel {
+  STATS_NONE = 0,   // Record nothing
+  STATS_COUNTERS,   // Calls, dict finds and rocksdb reads per operation
+  STATS_LATENCY     // As STATS_COUNTERS, plus latency per operation
+};
+
+enum ZsetOp {
+  OP_BULKLOAD = 0,
+  OP_ZADD,          // Zadd, ZaddMany
+  OP_ZINCRBY,
+  OP_ZREM,          // Zrem, ZremMany
+  OP_ZREMRANGE,     // Zremrangebylex, Zremrangebyrank, Zremrangebyscore
+  OP_ZPOP,          // Zpopmax, Zpopmin
+  OP_ZSCORE,        // Zscore, ZscoreMany
+  OP_ZRANK,         // Zrank, Zrevrank
+  OP_ZCOUNT,        // Zcount, Zlexcount, ZsumByRank, ZsumByScore
+  OP_ZRANGE,        // Zrange*, Zrev*, and opening a cursor
+  OP_ZSTORE,        // Zinterstore, Zunionstore
+  OP_COUNT
+};
+
+inline const char* ZsetOpName(int op) {
+  static const char* names[OP_COUNT] = {
+    "BulkLoad", "Zadd", "Zincrby", "Zrem", "Zremrange", "Zpop",
+    "Zscore", "Zrank", "Zcount", "Zrange", "Zstore"
+  };
+  return names[op];
+}
+
+// Counters of the calling thread, so that readers running in parallel
+// never write a shared cache line on every dict lookup
+struct ThreadCounters {
+  uint64_t dict_finds = 0;
+  uint64_t store_reads = 0;
+  // The recorder of the outermost operation in progress
+  const void* recorder = nullptr;
+};
+inline thread_local ThreadCounters thread_counters;
+
+struct DictStats {
+  uint64_t store_reads = 0;     // Keys read from rocksdb on node cache misses
+  uint64_t flushes = 0;         // Write batches written to rocksdb
+  uint64_t flushed_keys = 0;    // Put/Delete operations in those batches
+  uint64_t flushed_bytes = 0;
+  uint64_t dirty_count = 0;     // Nodes not yet written to rocksdb
+};
+
+struct OpStats {
+  uint64_t calls = 0;
+  uint64_t dict_finds = 0;
+  uint64_t store_reads = 0;
+  // Nanoseconds, 0 below STATS_LATENCY
+  uint64_t total_ns = 0;
+  uint64_t p50_ns = 0;
+  uint64_t p99_ns = 0;
+  uint64_t p999_ns = 0;
+};
+
+struct ZsetStats {
+  OpStats ops[OP_COUNT];
+  DictStats dict;
+  LRUStats cache;
+  // rocksdb::Statistics of the store, empty if not enabled
+  std::string store;
+
+  std::string ToString() const;
+};
+
+/*
+  Latency histogram with 4 buckets per power of two of nanoseconds, so
+  that a percentile is within 19% whatever the number of operations.
+  Buckets are atomic since readers of ConcurrentZset record in parallel.
+*/
+class LatencyHistogram {
+ public:
+  void      Record(uint64_t ns);
+  uint64_t  Percentile(double p) const;
+
+ private:
+  static constexpr int kSubBits = 2;
+  static constexpr int kBucketCount = 64 << kSubBits;
+
+  static int      Index(uint64_t ns);
+  static uint64_t Upper(int index);
+
+  std::atomic<uint64_t> buckets_[kBucketCount] = {};
+};
+
+/*
+  Per operation counters of a zset. Each public API opens an OpScope,
+  which attributes the dict finds and rocksdb reads of the calling
+  thread to its operation when it ends. An API called by another API
+  of the same zset (Zincrby calls Zadd) is recorded once, as the outer.
+*/
+class StatsRecorder {
+ public:
+  class OpScope {
+   public:
+    OpScope(const StatsRecorder* recorder, ZsetOp op);
+    ~OpScope();
+    OpScope(const OpScope& s) = delete;
+    OpScope& operator=(const OpScope& s) = delete;
+
+   private:
+    const StatsRecorder* recorder_;
+    const void* outer_;
+    ZsetOp op_;
+    uint64_t dict_finds_;
+    uint64_t store_reads_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  StatsRecorder() = default;
+  StatsRecorder(const StatsRecorder& r) = delete;
+  StatsRecorder& operator=(const StatsRecorder& r) = delete;
+
+  OpScope     Record(ZsetOp op) const { return OpScope(this, op); }
+  // Not thread-safe, call it while no operation is running
+  void        SetLevel(StatsLevel level);
+  void        Snapshot(OpStats* ops) const;
+
+ private:
+  struct Counters {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> dict_finds{0};
+    std::atomic<uint64_t> store_reads{0};
+    std::atomic<uint64_t> total_ns{0};
+  };
+
+  StatsLevel level_ = STATS_COUNTERS;
+  mutable Counters counters_[OP_COUNT];
+  // Allocated at STATS_LATENCY only, one per operation
+  std::unique_ptr<LatencyHistogram[]> histograms_;
+};
+
+////////////////////////////// BEGIN LatencyHistogram //////////////////////////////
+inline void LatencyHistogram::Record(uint64_t ns) {
+  buckets_[Index(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+inline uint64_t LatencyHistogram::Percentile(double p) const {
+  uint64_t count = 0;
+  for (auto& bucket : buckets_) {
+    count += bucket.load(std::memory_order_relaxed);
+  }
+  uint64_t target = std::ceil(count * p), seen = 0;
+  for (int i = 0; i < kBucketCount && count; i ++) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= target) {
+      return Upper(i);
+    }
+  }
+  return 0;
+}
+
+inline int LatencyHistogram::Index(uint64_t ns) {
+  if (ns < (1u << kSubBits)) {
+    return ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  return ((msb - kSubBits + 1) << kSubBits) +
+         ((ns >> (msb - kSubBits)) & ((1 << kSubBits) - 1));
+}
+
+// The largest latency of bucket index
+inline uint64_t LatencyHistogram::Upper(int index) {
+  if (index < (1 << kSubBits)) {
+    return index;
+  }
+  int msb = (index >> kSubBits) + kSubBits - 1;
+  uint64_t lower = (uint64_t(1) << msb) |
+                   (uint64_t(index & ((1 << kSubBits) - 1)) << (msb - kSubBits));
+  return lower + (uint64_t(1) << (msb - kSubBits)) - 1;
+}
+////////////////////////////// END LatencyHistogram //////////////////////////////
+
+////////////////////////////// BEGIN StatsRecorder //////////////////////////////
+inline StatsRecorder::OpScope::OpScope(const StatsRecorder* recorder, ZsetOp op)
+  : recorder_(recorder), outer_(thread_counters.recorder), op_(op) {
+  if (recorder_->level_ == STATS_NONE || outer_ == recorder_) {
+    recorder_ = nullptr;
+    return;
+  }
+  thread_counters.recorder = recorder_;
+  dict_finds_ = thread_counters.dict_finds;
+  store_reads_ = thread_counters.store_reads;
+  if (recorder_->histograms_) {
+    start_ = std::chrono::steady_clock::now();
+  }
+}
+
+inline StatsRecorder::OpScope::~OpScope() {
+  if (recorder_ == nullptr) {
+    return;
+  }
+  thread_counters.recorder = outer_;
+  auto& counters = recorder_->counters_[op_];
+  counters.calls.fetch_add(1, std::memory_order_relaxed);
+  counters.dict_finds.fetch_add(thread_counters.dict_finds - dict_finds_,
+                                std::memory_order_relaxed);
+  counters.store_reads.fetch_add(thread_counters.store_reads - store_reads_,
+                                 std::memory_order_relaxed);
+  if (recorder_->histograms_) {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_).count();
+    counters.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    recorder_->histograms_[op_].Record(ns);
+  }
+}
+
+inline void StatsRecorder::SetLevel(StatsLevel level) {
+  level_ = level;
+  if (level_ == STATS_LATENCY && !histograms_) {
+    histograms_.reset(new LatencyHistogram[OP_COUNT]);
+  } else if (level_ != STATS_LATENCY) {
+    histograms_.reset();
+  }
+}
+
+inline void StatsRecorder::Snapshot(OpStats* ops) const {
+  for (int op = 0; op < OP_COUNT; op ++) {
+    auto& counters = counters_[op];
+    ops[op].calls = counters.calls.load(std::memory_order_relaxed);
+    ops[op].dict_finds = counters.dict_finds.load(std::memory_order_relaxed);
+    ops[op].store_reads = counters.store_reads.load(std::memory_order_relaxed);
+    ops[op].total_ns = counters.total_ns.load(std::memory_order_relaxed);
+    if (histograms_) {
+      ops[op].p50_ns = histograms_[op].Percentile(0.5);
+      ops[op].p99_ns = histograms_[op].Percentile(0.99);
+      ops[op].p999_ns = histograms_[op].Percentile(0.999);
+    }
+  }
+}
+////////////////////////////// END StatsRecorder //////////////////////////////
+
+inline std::string ZsetStats::ToString() const {
+  std::string s;
+  char line[256];
+  snprintf(line, sizeof(line), "%-10s %12s %12s %12s %10s %10s %10s\n",
+           "op", "calls", "dict_finds", "store_reads", "p50_us", "p99_us", "p999_us");
+  s += line;
+  for (int op = 0; op < OP_COUNT; op ++) {
+    if (ops[op].calls == 0) {
+      continue;
+    }
+    snprintf(line, sizeof(line), "%-10s %12lu %12lu %12lu %10.2f %10.2f %10.2f\n",
+             ZsetOpName(op), (unsigned long)ops[op].calls,
+             (unsigned long)ops[op].dict_finds, (unsigned long)ops[op].store_reads,
+             ops[op].p50_ns / 1e3, ops[op].p99_ns / 1e3, ops[op].p999_ns / 1e3);
+    s += line;
+  }
+  snprintf(line, sizeof(line),
+           "cache: hits %lu misses %lu charge %lu pinned %lu\n"
+           "dict: store_reads %lu flushes %lu flushed_keys %lu flushed_bytes %lu dirty %lu\n",
+           (unsigned long)cache.hit_count, (unsigned long)cache.miss_count,
+           (unsigned long)cache.charge, (unsigned long)cache.pinned_charge,
+           (unsigned long)dict.store_reads, (unsigned long)dict.flushes,
+           (unsigned long)dict.flushed_keys, (unsigned long)dict.flushed_bytes,
+           (unsigned long)dict.dirty_count);
+  s += line;
+  return s + store;
+}
+
+} // namespace ZSET
+
+#endif // __STATS_H__
@@ -4,15 +4,29 @@
 #ifndef __ZSET_H__
 #define __ZSET_H__
 
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <functional>
+#include <future>
 #include <memory>
+#include <queue>
 #include <random>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <utility>
+#include <vector>
 
+#include "coding.h"
+#include "log_dict.h"
 #include "robin_map_dict.h"
+#include "score_traits.h"
 
 #ifndef NO_ROCKSDB
 #include "rocksdb_dict.h"
@@ -26,124 +40,377 @@ template <typename _T>
 using pairs = std::vector<std::pair<std::string, _T>>;
 
 #ifdef NO_ROCKSDB
-enum ZsetDictType { ROBIN_MAP_DICT };
+enum ZsetDictType { ROBIN_MAP_DICT, LOG_DICT = 2 };
 static constexpr auto ZSET_DEFAULT_DICT = ROBIN_MAP_DICT;
 #else
-enum ZsetDictType { ROBIN_MAP_DICT, ROCKSDB_DICT };
+enum ZsetDictType { ROBIN_MAP_DICT, ROCKSDB_DICT, LOG_DICT };
 static constexpr auto ZSET_DEFAULT_DICT = ROCKSDB_DICT;
 #endif
 
+// How Zinterstore/Zunionstore combine the scores of a member
+enum ZsetAggregate { AGGREGATE_SUM, AGGREGATE_MIN, AGGREGATE_MAX };
 
 
-int GetRandLevel(int level_limit) {
-  static constexpr int kRandThreshold = RAND_MAX * SKIPLIST_P;
-  int x = 1;
-  while (rand() < kRandThreshold  && x < level_limit) ++ x;
-  return x;
-}
+#define ZSET_TEMPLATE   template <typename _T, int _MaxMemberLen, int _MaxLevel, bool _SpanSums, \
+                                  template <typename> class _Dict>
+#define ZSET_TYPE       Zset<_T, _MaxMemberLen, _MaxLevel, _SpanSums, _Dict>
 
+/*
+  With _SpanSums, every link also holds the sum of the scores of the
+  members it spans, as its step holds their number, so that the sum of
+  a range of ranks or scores takes two descents instead of a scan.
 
-#define ZSET_TEMPLATE   template <typename _T, int _MaxMemberLen, int _MaxLevel>
-#define ZSET_TYPE       Zset<_T, _MaxMemberLen, _MaxLevel>
+  Nodes get a random level of at most _MaxLevel, and about log(card)
+  with base 1 / SKIPLIST_P, so that the height of the skiplist follows
+  the number of members. Links are sized to the level of each node.
 
-template <typename _T, int _MaxMemberLen = 10, int _MaxLevel = 15>
+  _Dict picks the dict backend. DictInterface chooses it at runtime from
+  ZsetDictType; RobinMapDict or RocksdbDict fix it at compile time, so
+  that lookups are called directly and inlined into the skiplist loops
+*/
+template <typename _T, int _MaxMemberLen = 1024, int _MaxLevel = 32,
+          bool _SpanSums = false, template <typename> class _Dict = DictInterface>
 class Zset {
+  static_assert(!_SpanSums || std::is_arithmetic<_T>::value,
+                "span sums require an arithmetic score type");
+
  public:
+  // Sums of scores, exact for integral scores
+  using sum_t = std::conditional_t<std::is_integral<_T>::value, int64_t, double>;
+
+  // (score, member) looked for in the skiplist, with its normalized key,
+  // built once per descent
+  struct Probe {
+    Probe(const _T& score, const char* member) : score(score), member(member) {
+      if constexpr (kNormalizedKey<_T>) {
+        key = NormalizedKey<_T>::Of(score, member);
+      }
+    }
+    _T score;
+    const char* member;
+    NormalizedKey<_T> key;
+  };
+
   ////////////////////////////// BEGIN class MemberScore //////////////////////////////
   class MemberScore {
    public:
     MemberScore() = default;
-    explicit MemberScore(int level) {
-      Clear();
-      set_level(level);
-    }
-    MemberScore(const char* member, _T score, int level) {
-      Clear();
-      set_member(0, member);
-      set_score(0, score);
-      set_level(level);
-    }
     ~MemberScore() = default;
     MemberScore(const MemberScore& ms) = delete;
     MemberScore& operator=(const MemberScore& ms) = delete;
+    // Drop all links but keep the member, which is the dict key
+    inline void Reset(_T score, int level) {
+      score_ = canonical_score(score);
+      links_.clear();
+      links_.resize(level);
+      members_.clear();
+      back_ = nullptr;
+      back_member_.clear();
+    }
     // getters & setters
     //   score
     inline _T get_score(int lvl = 0) {
-      return *get_score_addr(lvl);
+      return lvl ? get_link_score(get_link(lvl)) : score_;
     }
     inline void set_score(int lvl, _T score) {
-      *get_score_addr(lvl) = score;
+      score = canonical_score(score);
+      if (lvl == 0) {
+        score_ = score;
+      } else if constexpr (kNormalizedKey<_T>) {
+        get_link(lvl).key.SetScore(score);
+      } else {
+        get_link(lvl).score = score;
+      }
     }
-    //   member
+    //   member, of the next node if lvl > 0: a copy in nodes linked by
+    //   member, otherwise read from the next node, "" if there is none,
+    //   also above the level of the node
     inline char* get_member(int lvl = 0) {
-      return get_member_addr(lvl);
+      if (lvl == 0) {
+        return key_.data();
+      }
+      if (lvl > get_level()) {
+        return kNoMember;
+      }
+      if (size_t(lvl) <= members_.size()) {
+        return members_[lvl - 1].data();
+      }
+      MemberScore* next = get_link(lvl).next;
+      return next ? next->key_.data() : kNoMember;
     }
+    //   only for nodes linked by member, see set_next
     inline void set_member(int lvl, const char* member) {
-      memcpy(get_member_addr(lvl), member, strlen(member) + 1);
+      if (lvl == 0) {
+        key_.assign(member);
+        return;
+      }
+      if (members_.size() < links_.size()) {
+        members_.resize(links_.size());
+      }
+      members_[lvl - 1].assign(member);
+      set_link_key_member(get_link(lvl), member);
+    }
+    //   drop the copies of members, once the node is linked by pointer
+    inline void clear_members() {
+      members_.clear();
+      members_.shrink_to_fit();
     }
     //   level
     inline uint8_t get_level() {
-      return *get_level_addr();
+      return links_.size();
     }
     inline void set_level(uint8_t level) {
-      *get_level_addr() = level;
+      links_.resize(level);
+      if (members_.size() > level) {
+        members_.resize(level);
+      }
+    }
+    //   approximate memory held by this node
+    inline size_t get_memory_size() {
+      size_t size = sizeof(MemberScore) + key_.capacity() +
+                    back_member_.capacity() + links_.capacity() * sizeof(Link) +
+                    members_.capacity() * sizeof(std::string);
+      for (auto& member : members_) {
+        size += member.capacity();
+      }
+      return size;
     }
     //   lru state
     inline uint8_t get_lru_state() {
-      return *get_lru_state_addr();
+      return lru_state_;
     }
     inline void set_lru_state(uint8_t deleted) {
-      *get_lru_state_addr() = deleted;
+      lru_state_ = deleted;
     }
     //   step
-    inline uint32_t get_step(int lvl = 0) {
-      return lvl <= get_level() ? *get_step_addr(lvl) : 0;
+    inline uint64_t get_step(int lvl = 0) {
+      return lvl && lvl <= get_level() ? get_link(lvl).step : 0;
     }
-    inline void set_step(int lvl, uint32_t step) {
-      *get_step_addr(lvl) = step;
+    inline void set_step(int lvl, uint64_t step) {
+      get_link(lvl).step = step;
     }
     inline void inc_step(int lvl = 0) {
-      ++ *get_step_addr(lvl);
+      ++ get_link(lvl).step;
     }
     inline void dec_step(int lvl = 0) {
-      -- *get_step_addr(lvl);
+      -- get_link(lvl).step;
+    }
+    //   sum of the scores spanned, 0 without _SpanSums
+    inline sum_t get_sum(int lvl) {
+      if constexpr (_SpanSums) {
+        return lvl <= get_level() ? get_link(lvl).sum : 0;
+      }
+      return 0;
+    }
+    inline void set_sum(int lvl, sum_t sum) {
+      if constexpr (_SpanSums) {
+        get_link(lvl).sum = sum;
+      }
+    }
+    //   next node, only maintained by pointer stable dicts, whose nodes
+    //   are linked by pointer instead of by member
+    inline MemberScore* get_next(int lvl) {
+      return get_link(lvl).next;
+    }
+    inline void set_next(int lvl, MemberScore* next) {
+      Link& link = get_link(lvl);
+      link.next = next;
+      set_link_key_member(link, next ? next->key_.data() : kNoMember);
+    }
+    //   previous node at level 1, the root links back to the last node
+    //   by pointer in pointer stable dicts, by member in others
+    inline MemberScore* get_back() {
+      return back_;
+    }
+    inline void set_back(MemberScore* back) {
+      back_ = back;
+    }
+    inline char* get_back_member() {
+      return back_member_.data();
+    }
+    inline void set_back_member(const char* member) {
+      back_member_.assign(member);
+    }
+    //   false if loaded from a value written before back links
+    inline bool has_back_member() {
+      return format_ >= kBackLinkValueFormat;
+    }
+    //   false if loaded from a value written without _SpanSums
+    inline bool has_span_sums() {
+      return format_ == kSpanSumValueFormat || format_ == kVarintSpanSumValueFormat;
+    }
+    // -0.0 is kept as 0.0, as the normalized and index keys encode it,
+    // so that every read returns the same score
+    static inline _T canonical_score(const _T& score) {
+      if constexpr (std::is_floating_point<_T>::value) {
+        return score == 0 ? _T(0) : score;
+      } else {
+        return score;
+      }
     }
     // comparison functions
-    inline int Compare(int lvl, const _T& score, const char* member) {
-      char* mbr = get_member_addr(lvl);
-      _T* scr = get_score_addr(lvl);
-      if (*mbr == '\0' || score < *scr) return 1;
-      if (*scr < score) return -1;
-      return strcmp(mbr, member);
+    inline int Compare(int lvl, const Probe& probe) {
+      if (lvl == 0) {
+        if (probe.score < score_) return 1;
+        if (score_ < probe.score) return -1;
+        return strcmp(key_.data(), probe.member);
+      }
+      // The cached score, or normalized key, of the next node spares
+      // reading it, unless they tie
+      Link& link = get_link(lvl);
+      if constexpr (kNormalizedKey<_T>) {
+        // Links to no node have the greatest key
+        if (link.key < probe.key) return -1;
+        if (probe.key < link.key) return 1;
+        char* mbr = get_member(lvl);
+        return *mbr == '\0' ? 1 : strcmp(mbr, probe.member);
+      } else {
+        char* mbr = get_member(lvl);
+        if (*mbr == '\0' || probe.score < link.score) return 1;
+        if (link.score < probe.score) return -1;
+        return strcmp(mbr, probe.member);
+      }
     }
-    inline int MemberCompare(int lvl, const char* member) {
-      char* mbr = get_member_addr(lvl);
-      return *mbr == '\0' ? 1 : strcmp(mbr, member);
+    inline int MemberCompare(int lvl, const Probe& probe) {
+      if constexpr (kNormalizedKey<_T>) {
+        if (lvl) {
+          uint64_t bits = get_link(lvl).key.MemberBits();
+          uint64_t probe_bits = probe.key.MemberBits();
+          if (bits != probe_bits) return bits < probe_bits ? -1 : 1;
+        }
+      }
+      char* mbr = get_member(lvl);
+      return *mbr == '\0' ? 1 : strcmp(mbr, probe.member);
     }
     inline int ScoreCompare(int lvl, const _T& score) {
-      char* mbr = get_member_addr(lvl);
-      _T* scr = get_score_addr(lvl);
-      if (*mbr == '\0' || score < *scr) return 1;
-      if (*scr < score) return -1;
+      if (lvl == 0) {
+        if (score < score_) return 1;
+        if (score_ < score) return -1;
+        return 0;
+      }
+      if (*get_member(lvl) == '\0') return 1;
+      _T link_score = get_link_score(get_link(lvl));
+      if (score < link_score) return 1;
+      if (link_score < score) return -1;
       return 0;
     }
     // functions to parse from/to key/value
+    //   own score of an encoded value, without decoding the links
+    static inline _T get_value_score(const std::string& s) {
+      if (s.size() < kHeaderSize + kScoreSize) {
+        throw std::runtime_error("corrupted member score value");
+      }
+      _T score;
+      memcpy(&score, s.data() + kHeaderSize, kScoreSize);
+      return score;
+    }
     inline char* get_key_string() {
-      return get_member();
+      return key_.data();
     }
     inline void set_key_string(const char* s) {
-      set_member(0, s);
+      key_.assign(s);
     }
     inline std::string_view get_key_string_view() {
-      char* mbr = get_member();
-      return {mbr, strlen(mbr)};
+      return key_;
     }
-    inline std::string_view get_value_string_view() {
-      static constexpr size_t offset = 4 + kTupleSize;
-      return {buffer_, offset + kTupleSize * get_level()};
+    /*
+      value contains:
+        - format      (1 byte : uint8_t, kValueFormat)
+        - level       (1 byte : uint8_t )
+        - score size  (2 bytes: uint16_t)
+        - score
+        - back member size (varint32), back member
+        - (score i, step i: varint64, [sum i,] member size i: varint32, member i),
+          1 <= i <= L
+      Values of format 1 have no back member. Formats 1 to 3 have fixed
+      4-byte steps and are still read, so that existing data moves to
+      format 4 or 5 as its nodes are written. Sums are in formats 3 and
+      5 only, which are written with _SpanSums.
+    */
+    inline void get_value_string(std::string& s) {
+      uint16_t score_size = kScoreSize;
+      s.clear();
+      s.push_back(char(kValueFormat));
+      s.push_back(char(get_level()));
+      PutFixed(s, &score_size, sizeof score_size);
+      PutFixed(s, &score_, kScoreSize);
+      PutVarint32(s, back_member_.size());
+      s.append(back_member_);
+      for (int i = 1; i <= get_level(); i ++) {
+        Link& link = get_link(i);
+        char* member = get_member(i);
+        _T score = *member ? get_link_score(link) : _T();
+        PutFixed(s, &score, kScoreSize);
+        PutVarint64(s, link.step);
+        if constexpr (_SpanSums) {
+          PutFixed(s, &link.sum, sizeof link.sum);
+        }
+        size_t member_size = strlen(member);
+        PutVarint32(s, member_size);
+        s.append(member, member_size);
+      }
     }
     inline void set_value_string(std::string& s) {
-      memcpy(buffer_, s.data(), s.size());
+      const char* p = s.data();
+      const char* limit = p + s.size();
+      uint16_t score_size = 0;
+      if (s.size() >= kHeaderSize) {
+        memcpy(&score_size, p + 2, sizeof score_size);
+      }
+      if (s.size() < kHeaderSize + kScoreSize || score_size != kScoreSize) {
+        throw std::runtime_error("corrupted member score value");
+      }
+      if (p[0] == kLegacyValueFormat) {
+        return set_legacy_value_string(s);
+      }
+      // Values are byte strings, the score may be unaligned
+      Reset(get_value_score(s), uint8_t(p[1]));
+      format_ = p[0];
+      p += kHeaderSize + kScoreSize;
+      if (format_ >= kBackLinkValueFormat) {
+        uint32_t member_size = 0;
+        p = GetVarint32(p, limit, &member_size);
+        if (p == nullptr || p + member_size > limit) {
+          throw std::runtime_error("corrupted member score value");
+        }
+        back_member_.assign(p, member_size);
+        p += member_size;
+      }
+      members_.resize(links_.size());
+      for (size_t i = 0; i < links_.size(); i ++) {
+        Link& link = links_[i];
+        if (p + kScoreSize > limit) {
+          throw std::runtime_error("corrupted member score value");
+        }
+        _T score;
+        memcpy(&score, p, kScoreSize);
+        p += kScoreSize;
+        if (format_ >= kVarintStepValueFormat) {
+          p = GetVarint64(p, limit, &link.step);
+        } else {
+          p = GetFixedStep(p, limit, &link.step);
+        }
+        if (p == nullptr) {
+          throw std::runtime_error("corrupted member score value");
+        }
+        if (has_span_sums()) {
+          if (p + sizeof(sum_t) > limit) {
+            throw std::runtime_error("corrupted member score value");
+          }
+          if constexpr (_SpanSums) {
+            memcpy(&link.sum, p, sizeof link.sum);
+          }
+          p += sizeof(sum_t);
+        }
+        uint32_t member_size = 0;
+        p = GetVarint32(p, limit, &member_size);
+        if (p == nullptr || p + member_size > limit) {
+          throw std::runtime_error("corrupted member score value");
+        }
+        members_[i].assign(p, member_size);
+        p += member_size;
+        set_link(link, score, members_[i].data());
+      }
     }
 
     /*
@@ -159,174 +426,675 @@ class Zset {
 
    private:
     static constexpr int kScoreSize = sizeof(_T);
-    // tuple = (score, member, step)
-    static constexpr int kTupleSize = kScoreSize + _MaxMemberLen + 1 + 4;
-    static constexpr int kBufferSize = 4 + kTupleSize * (_MaxLevel + 1);
+    static constexpr int kHeaderSize = 4;
+    static constexpr char kLegacyValueFormat = 0;
+    static constexpr char kBackLinkValueFormat = 2;
+    static constexpr char kSpanSumValueFormat = 3;
+    static constexpr char kVarintStepValueFormat = 4;
+    static constexpr char kVarintSpanSumValueFormat = 5;
+    static constexpr char kValueFormat = _SpanSums ? 5 : 4;
+    struct LinkSum {
+      sum_t sum = 0;
+    };
+    struct NoLinkSum {};
+    // tuple = (score, step) of the next node at some level, and the sum
+    // of scores up to it with _SpanSums. Arithmetic scores are kept in a
+    // normalized key with the first bytes of the next member
+    struct LinkScore {
+      _T score = _T();
+    };
+    // The score and the first bytes of the member, see NormalizedKey
+    struct LinkKey {
+      NormalizedKey<_T> key = NormalizedKey<_T>::Max();
+    };
+    struct Link : std::conditional_t<_SpanSums, LinkSum, NoLinkSum>,
+                  std::conditional_t<kNormalizedKey<_T>, LinkKey, LinkScore> {
+      uint64_t step = 0;
+      // Direct link to the next node, never persisted
+      MemberScore* next = nullptr;
+    };
+    static inline char kNoMember[1] = "";
+    // The member is also the key in dict, so it lives apart from links_,
+    // whose storage moves whenever the level changes
+    std::string key_;
+    _T score_ = _T();
+    uint8_t lru_state_ = 0;
+    uint8_t format_ = kValueFormat;
+    // Links of level 1 .. L, sized to the level of this node
+    std::vector<Link> links_;
+    // Members of the next nodes at level 1 .. L, kept only by nodes
+    // linked by member, as pointers of other dicts do not last. A node
+    // linked by pointer is identified by its address, which stays the
+    // same for the life of the node, so links hold no member copies
+    std::vector<std::string> members_;
+    MemberScore* back_ = nullptr;
+    std::string back_member_;
+
+    inline Link& get_link(int lvl) {
+      return links_[lvl - 1];
+    }
+    static inline _T get_link_score(const Link& link) {
+      if constexpr (kNormalizedKey<_T>) {
+        return link.key.Score();
+      } else {
+        return link.score;
+      }
+    }
+    static inline void set_link_key_member(Link& link, const char* member) {
+      if constexpr (kNormalizedKey<_T>) {
+        if (*member == '\0') {
+          link.key = NormalizedKey<_T>::Max();
+        } else {
+          link.key.SetMember(member);
+        }
+      }
+    }
+    static inline void set_link(Link& link, const _T& score, const char* member) {
+      if constexpr (kNormalizedKey<_T>) {
+        link.key = *member == '\0' ? NormalizedKey<_T>::Max()
+                                   : NormalizedKey<_T>::Of(score, member);
+      } else {
+        link.score = score;
+      }
+    }
+    //   4-byte steps of formats before 4
+    static inline const char* GetFixedStep(const char* p, const char* limit,
+                                           uint64_t* step) {
+      uint32_t v = 0;
+      if (p + sizeof v > limit) {
+        return nullptr;
+      }
+      memcpy(&v, p, sizeof v);
+      *step = v;
+      return p + sizeof v;
+    }
     /*
-      buffer contains:
-        - lru state   (1 byte : uint8_t )
-        - level       (1 byte : uint8_t )
-        - score size  (2 bytes: uint16_t)
-        - member score list
-            - (score, member, step)
-            - (score 1, member 1, step 1)
-            - (score 2, member 2, step 2)
-            - ...
-            - (score L, member L, step L)
+      Values written before members became variable-length are
+      fixed arrays of (L + 1) tuples (score, member\0 padding, step),
+      so the padded member size can be derived from the value size
     */
-    char buffer_[kBufferSize];
+    inline void set_legacy_value_string(std::string& s) {
+      const char* p = s.data();
+      int level = uint8_t(p[1]);
+      size_t tuple_size = (s.size() - kHeaderSize) / (level + 1);
+      if (tuple_size <= kScoreSize + 4 ||
+          kHeaderSize + tuple_size * (level + 1) != s.size()) {
+        throw std::runtime_error("corrupted member score value");
+      }
+      size_t member_size = tuple_size - kScoreSize - 4;
+      p += kHeaderSize;
+      Reset(get_value_score(s), level);
+      format_ = kLegacyValueFormat;
+      members_.resize(level);
+      for (int i = 0; i < level; i ++) {
+        Link& link = links_[i];
+        p += tuple_size;
+        _T score;
+        memcpy(&score, p, kScoreSize);
+        members_[i].assign(p + kScoreSize,
+                           strnlen(p + kScoreSize, member_size));
+        set_link(link, score, members_[i].data());
+        GetFixedStep(p + kScoreSize + member_size, p + tuple_size, &link.step);
+      }
+    }
+  };
+  ////////////////////////////// END class MemberScore //////////////////////////////
 
-    inline void Clear() {
-      memset(buffer_, 0, sizeof buffer_);
-      *get_score_size_addr() = kScoreSize;
+  ////////////////////////////// BEGIN class Cursor //////////////////////////////
+  /*
+    Forward or reverse cursor over a range of ranks, which yields members
+    without building result vectors. member() is valid until the cursor
+    moves. Any write to the zset invalidates the cursor, so to page on
+    after writes, open a new cursor from rank() + 1 (or rank() - 1).
+  */
+  class Cursor {
+   public:
+    inline bool Valid() const {
+      return remaining_ > 0;
     }
-    inline _T* get_score_addr(int lvl = 0) {
-      return reinterpret_cast<_T*>(buffer_ + 4 + kTupleSize * lvl);
+    inline std::string_view member() const {
+      return zset_->linked_ ? ms_->get_key_string_view()
+                            : std::string_view(member_);
     }
-    inline char* get_member_addr(int lvl = 0) {
-      static constexpr int offset = 4 + kScoreSize;
-      return buffer_ + offset + kTupleSize * lvl;
+    inline const _T& score() const {
+      return score_;
     }
-    inline uint32_t* get_step_addr(int lvl = 0) {
-      static constexpr int offset = 4 + kScoreSize + _MaxMemberLen + 1;
-      return reinterpret_cast<uint32_t*>(buffer_ + offset + kTupleSize * lvl);
+    inline uint64_t rank() const {
+      return rank_;
     }
-    inline uint8_t* get_level_addr() {
-      return reinterpret_cast<uint8_t*>(buffer_ + 1);
+    inline void Next() {
+      if (remaining_ == 0 || -- remaining_ == 0) {
+        return;
+      }
+      // Pointers of non pointer stable dicts may be recycled meanwhile
+      MemberScore* ms = zset_->linked_ ? ms_ : zset_->dict_->Find(member_.data());
+      if (reverse_) {
+        -- rank_;
+        Load(zset_->Prev(ms));
+      } else {
+        ++ rank_;
+        Load(zset_->Next(ms, 1));
+      }
     }
-    inline uint8_t* get_lru_state_addr() {
-      return reinterpret_cast<uint8_t*>(buffer_);
+
+   private:
+    friend class Zset;
+    Cursor(const Zset* zset, uint64_t first, uint64_t last, bool reverse)
+      : zset_(zset), reverse_(reverse) {
+      if (first > last) {
+        return;
+      }
+      remaining_ = last - first + 1;
+      rank_ = reverse ? last : first;
+      Load(zset_->FindByRank(rank_));
     }
-    inline uint16_t* get_score_size_addr() {
-      return reinterpret_cast<uint16_t*>(buffer_ + 2);
+    inline void Load(MemberScore* ms) {
+      ms_ = ms;
+      score_ = ms->get_score();
+      if (!zset_->linked_) {
+        member_.assign(ms->get_key_string_view());
+      }
     }
+
+    const Zset* zset_;
+    MemberScore* ms_ = nullptr;
+    bool reverse_;
+    uint64_t rank_ = 0;
+    uint64_t remaining_ = 0;
+    _T score_ = _T();
+    // Copy of the member, for dicts which are not pointer stable
+    std::string member_;
   };
-  ////////////////////////////// END class MemberScore //////////////////////////////
+  ////////////////////////////// END class Cursor //////////////////////////////
+
+  using Dict = _Dict<MemberScore>;
+  // False if the backend is chosen at runtime, through DictInterface
+  static constexpr bool kFixedDict = !std::is_same<Dict, DictInterface<MemberScore>>::value;
+  static constexpr ZsetDictType kDefaultDict =
+      std::is_same<Dict, RobinMapDict<MemberScore>>::value ? ROBIN_MAP_DICT :
+      std::is_same<Dict, LogDict<MemberScore>>::value ? LOG_DICT : ZSET_DEFAULT_DICT;
 
   Zset(std::string key,
-       ZsetDictType dict_type = ZSET_DEFAULT_DICT,
+       ZsetDictType dict_type = kDefaultDict,
        bool error_if_exists = false)
     : key_(key), max_level_(0), card_(0) {
 
     static_assert(std::is_pod<_T>::value);
 
-    if (dict_type == ROBIN_MAP_DICT) {
-      dict_.reset(new RobinMapDict<MemberScore>());
-    }
+    dict_.reset(NewDict(dict_type, key, error_if_exists));
+    InitRoot();
+  }
 
 #ifndef NO_ROCKSDB
-    else if (dict_type == ROCKSDB_DICT) {
-      dict_.reset(new RocksdbDict<MemberScore>(key, error_if_exists));
-    }
-#endif
+  // Host the zset in a rocksdb instance shared with other zsets
+  Zset(std::shared_ptr<RocksdbStore> store,
+       std::string key,
+       bool error_if_exists = false)
+    : key_(key), max_level_(0), card_(0), store_(store) {
 
-    root_ = dict_->NewKeyBuffer(kZsetRoot, true);
-    if (root_->get_lru_state() == LRU_OK) {
-      new (root_) MemberScore(kZsetRoot, _T(), 0);
-    } else {
-      max_level_ = root_->get_level();
-      card_ = FindLast();
-      root_->set_lru_state(LRU_OK);
+    static_assert(std::is_pod<_T>::value);
+    static_assert(!kFixedDict || std::is_same<Dict, RocksdbDict<MemberScore>>::value,
+                  "a shared store requires a rocksdb dict");
+
+    dict_.reset(new RocksdbDict<MemberScore>(store, key));
+    if (error_if_exists &&
+        dict_->NewKeyBuffer(kZsetRoot, true)->get_lru_state() != LRU_OK) {
+      throw std::invalid_argument("zset already exists in store");
     }
-    dict_->Persist(root_);
+    InitRoot();
   }
+#endif
+
   ~Zset() = default;
   Zset(const Zset& z) = delete;
   Zset& operator=(const Zset& z) = delete;
 
   ////////////////////////////// BEGIN Definition of Zset APIs //////////////////////////////
 
-  uint32_t                      Zadd(const char* member, const _T& score);
-  uint32_t                      Zadd(const std::string& member, const _T& score);
-  uint32_t                      Zcard() const;
-  uint32_t                      Zcount(const _T& min_score, const _T& max_score) const;
+  uint64_t                      BulkLoad(pairs<_T> members_and_scores, bool sorted = false);
+  uint64_t                      Zadd(const char* member, const _T& score);
+  uint64_t                      Zadd(const std::string& member, const _T& score);
+  uint64_t                      ZaddMany(const pairs<_T>& members_and_scores);
+  uint64_t                      Zcard() const;
+  uint64_t                      Zcount(const _T& min_score, const _T& max_score) const;
   _T                            Zincrby(const char* member, _T increment);
   _T                            Zincrby(const std::string& member, _T increment);
   std::unique_ptr<ZSET_TYPE>    Zinterstore(ZSET_TYPE* b,
                                             const std::string& inter_zset_name,
-                                            ZsetDictType dict_type = ZSET_DEFAULT_DICT);
-  uint32_t                      Zlexcount(const char* start, bool with_start,
+                                            ZsetDictType dict_type = kDefaultDict);
+  std::unique_ptr<ZSET_TYPE>    Zinterstore(const std::vector<ZSET_TYPE*>& others,
+                                            const std::string& inter_zset_name,
+                                            ZsetDictType dict_type = kDefaultDict,
+                                            const std::vector<double>& weights = {},
+                                            ZsetAggregate aggregate = AGGREGATE_SUM);
+  uint64_t                      Zlexcount(const char* start, bool with_start,
                                           const char* stop, bool with_stop) const;
-  uint32_t                      Zlexcount(const std::string& start, bool with_start,
+  uint64_t                      Zlexcount(const std::string& start, bool with_start,
                                           const std::string& stop, bool with_stop) const;
-  uint32_t                      Zpopmax(strs* members, uint32_t count = 1);
-  uint32_t                      Zpopmax(pairs<_T>* members_and_scores, uint32_t count = 1);
-  uint32_t                      Zpopmin(strs* members, uint32_t count = 1);
-  uint32_t                      Zpopmin(pairs<_T>* members_and_scores, uint32_t count = 1);
-  uint32_t                      Zrange(strs* members,
-                                       uint32_t start, uint32_t stop, uint32_t limit = 0) const;
-  uint32_t                      Zrange(pairs<_T>* members_and_scores,
-                                       uint32_t start, uint32_t stop, uint32_t limit = 0) const;
-  uint32_t                      Zrangebylex(strs* members,
+  uint64_t                      Zpopmax(strs* members, uint64_t count = 1);
+  uint64_t                      Zpopmax(pairs<_T>* members_and_scores, uint64_t count = 1);
+  uint64_t                      Zpopmin(strs* members, uint64_t count = 1);
+  uint64_t                      Zpopmin(pairs<_T>* members_and_scores, uint64_t count = 1);
+  uint64_t                      Zrange(strs* members,
+                                       uint64_t start, uint64_t stop, uint64_t limit = 0) const;
+  uint64_t                      Zrange(pairs<_T>* members_and_scores,
+                                       uint64_t start, uint64_t stop, uint64_t limit = 0) const;
+  Cursor                        ZrangeCursor(uint64_t start, uint64_t stop,
+                                             bool reverse = false) const;
+  uint64_t                      Zrangebylex(strs* members,
                                             const char* start, bool with_start,
                                             const char* stop, bool with_stop,
-                                            uint32_t limit = 0) const;
-  uint32_t                      Zrangebylex(pairs<_T>* members_and_scores,
+                                            uint64_t limit = 0) const;
+  uint64_t                      Zrangebylex(pairs<_T>* members_and_scores,
                                             const char* start, bool with_start,
                                             const char* stop, bool with_stop,
-                                            uint32_t limit = 0) const;
-  uint32_t                      Zrangebyscore(strs* members,
+                                            uint64_t limit = 0) const;
+  Cursor                        ZrangebylexCursor(const char* start, bool with_start,
+                                                  const char* stop, bool with_stop,
+                                                  bool reverse = false) const;
+  uint64_t                      Zrangebyscore(strs* members,
                                               const _T& min_score, const _T& max_score,
-                                              uint32_t limit = 0) const;
-  uint32_t                      Zrangebyscore(pairs<_T>* members_and_scores,
+                                              uint64_t limit = 0) const;
+  uint64_t                      Zrangebyscore(pairs<_T>* members_and_scores,
                                               const _T& min_score, const _T& max_score,
-                                              uint32_t limit = 0) const;
-  uint32_t                      Zrank(const char* member) const;
-  uint32_t                      Zrank(const std::string& member) const;
-  uint32_t                      Zrem(const char* member);
-  uint32_t                      Zrem(const std::string& member);
-  uint32_t                      Zremrangebylex(const char* start, bool with_start,
+                                              uint64_t limit = 0) const;
+  Cursor                        ZrangebyscoreCursor(const _T& min_score, const _T& max_score,
+                                                    bool reverse = false) const;
+  uint64_t                      Zrank(const char* member) const;
+  uint64_t                      Zrank(const std::string& member) const;
+  uint64_t                      Zrem(const char* member);
+  uint64_t                      Zrem(const std::string& member);
+  uint64_t                      ZremMany(const strs& members);
+  uint64_t                      Zremrangebylex(const char* start, bool with_start,
                                                const char* stop, bool with_stop);
-  uint32_t                      Zremrangebyrank(uint32_t start, uint32_t stop);
-  uint32_t                      Zremrangebyscore(const _T& min_score, const _T& max_score);
-  uint32_t                      Zrevrange(strs* members, uint32_t start, uint32_t stop,
-                                          uint32_t limit = 0) const;
-  uint32_t                      Zrevrangebyscore(strs* members,
+  uint64_t                      Zremrangebyrank(uint64_t start, uint64_t stop);
+  uint64_t                      Zremrangebyscore(const _T& min_score, const _T& max_score);
+  uint64_t                      Zrevrange(strs* members, uint64_t start, uint64_t stop,
+                                          uint64_t limit = 0) const;
+  uint64_t                      Zrevrangebyscore(strs* members,
                                                  const _T& max_score, const _T& min_score,
-                                                 uint32_t limit = 0) const;
-  uint32_t                      Zrevrank(const char* member) const;
-  uint32_t                      Zrevrank(const std::string& member) const;
+                                                 uint64_t limit = 0) const;
+  uint64_t                      Zrevrank(const char* member) const;
+  uint64_t                      Zrevrank(const std::string& member) const;
   std::pair<bool, _T>           Zscore(const char* member) const;
   std::pair<bool, _T>           Zscore(const std::string& member) const;
+  void                          ZscoreMany(const strs& members,
+                                           std::vector<std::pair<bool, _T>>* scores) const;
+  // Sum of the scores of a range, with _SpanSums
+  sum_t                         ZsumByRank(uint64_t start, uint64_t stop) const;
+  sum_t                         ZsumByScore(const _T& min_score, const _T& max_score) const;
   std::unique_ptr<ZSET_TYPE>    Zunionstore(ZSET_TYPE* b,
                                             const std::string& union_zset_name,
-                                            ZsetDictType dict_type = ZSET_DEFAULT_DICT);
+                                            ZsetDictType dict_type = kDefaultDict);
+  std::unique_ptr<ZSET_TYPE>    Zunionstore(const std::vector<ZSET_TYPE*>& others,
+                                            const std::string& union_zset_name,
+                                            ZsetDictType dict_type = kDefaultDict,
+                                            const std::vector<double>& weights = {},
+                                            ZsetAggregate aggregate = AGGREGATE_SUM);
 
   ////////////////////////////// END Declaration of Zset APIs //////////////////////////////
 
+  // True if const APIs never mutate shared state, so that they may run
+  // in parallel with each other, see ConcurrentZset
+  bool                          ConcurrentReads() const { return dict_->ConcurrentFind(); }
+  // Hits, misses and memory of the node cache of ROCKSDB_DICT
+  LRUStats                      CacheStats() const { return dict_->CacheStats(); }
+  // Counters per operation, node cache, write batches and rocksdb
+  ZsetStats                     Stats() const;
+  //   STATS_COUNTERS by default, STATS_LATENCY adds two clock reads per call
+  void                          SetStatsLevel(StatsLevel level) { stats_.SetLevel(level); }
+  // Trade write latency against the updates lost on crash, see Durability
+  void                          SetDurability(const Durability& durability) {
+    dict_->SetDurability(durability);
+  }
+  // Snapshot files, to restart zsets without replaying Zadds
+  void                          SaveSnapshot(const std::string& path) const;
+  std::future<bool>             BgSaveSnapshot(const std::string& path) const;
+  uint64_t                      LoadSnapshot(const std::string& path);
+
  private:
   ////////////////////////////// BEGIN Declaration of Zset Internal Implementations //////////////////////////////
 
+  void                          InitRoot();
+  //   Random level of a new node in a zset of card members
+  int                           RandLevel(uint64_t card);
+  uint64_t                      ImplBulkLoad(const pairs<_T>& v,
+                                             const std::vector<uint8_t>& levels);
+  bool                          WriteSnapshot(int fd, std::string& buffer) const;
   MemberScore*                  FindByLex(const char* member) const;
-  MemberScore*                  FindByRank(uint32_t rank) const;
+  MemberScore*                  FindByRank(uint64_t rank) const;
   MemberScore*                  FindByScore(_T score) const;
-  uint32_t                      FindLast() const;
-  void                          ImplZadd(const char* member, _T score);
-  uint32_t                      ImplZcount(const _T& score, bool equal_ok) const;
-  uint32_t                      ImplZrank(const char* member, _T score) const;
-  MemberScore*                  ImplZrem(const char* member, _T score);
+  //   The last node of level lvl, see tail_
+  MemberScore*                  FindTail(int lvl) const;
+  /*
+    With resume, the descent starts at each level from the predecessor
+    left by the previous ImplZadd/ImplZrem when that one is further,
+    which requires member/score to be greater than the previous one
+  */
+  //   A level of 0 draws a random one
+  void                          ImplZadd(const char* member, _T score,
+                                         bool resume = false, int level = 0);
+  //   Also the sum of their scores, with _SpanSums
+  uint64_t                      ImplZcount(const _T& score, bool equal_ok,
+                                           sum_t* sum = nullptr) const;
+  uint64_t                      ImplZlexcount(const char* member, bool equal_ok) const;
+  //   Walk up and forward from ms to the last node of a level, whose
+  //   rank is in tail_, so that ranks near the end take a few steps
+  uint64_t                      ImplZrank(MemberScore* ms) const;
+  //   Sum of the scores of the first rank members
+  sum_t                         ImplPrefixSum(uint64_t rank) const;
+  MemberScore*                  ImplZrem(const char* member, _T score,
+                                         bool resume = false);
+  void                          ImplZupdate(MemberScore* ms, const _T& score);
+  uint64_t                      ImplZremRange(uint64_t start, uint64_t stop,
+                                              const std::function<void(MemberScore*)>& f);
+  std::unique_ptr<ZSET_TYPE>    ImplZstore(const std::vector<ZSET_TYPE*>& others,
+                                           const std::string& zset_name,
+                                           ZsetDictType dict_type,
+                                           const std::vector<double>& weights,
+                                           ZsetAggregate aggregate, bool inter);
+  void                          MemberOrderedScan(pairs<_T>* run) const;
+  /*
+    Score index of the dict: keys are the order-preserving encoding of
+    the score followed by the member, see ScoreTraits
+  */
+  static void                   AppendIndexKey(const _T& score, const char* member,
+                                               std::string& key);
+  static std::string            IndexKey(const _T& score, const char* member);
+  //   The key right after all keys of score, empty if there is none
+  static std::string            IndexKeyAfter(const _T& score);
+  //   Visit (score, member) as IndexScan, false if there is no index
+  bool                          IndexRange(const std::string& key, bool reverse,
+                                           const std::function<bool(const _T&,
+                                                                    std::string_view)>& f) const;
+  MemberScore*                  Next(MemberScore* ms, int lvl) const;
+  MemberScore*                  Prev(MemberScore* ms) const;
+  void                          RebuildNextLinks();
+  void                          RebuildBackLinks();
+  void                          RebuildSpanSums();
+  void                          RebuildTail();
+  void                          SetBack(MemberScore* ms, MemberScore* back);
+  void                          SetTail(int lvl, MemberScore* ms, uint64_t rank,
+                                        sum_t sum);
+  static sum_t                  ToSum(const _T& score) {
+    if constexpr (_SpanSums) {
+      return sum_t(score);
+    }
+    return 0;
+  }
+  //   The lowest level whose last node is before (score, member), or
+  //   max_level_ + 1 if there is none
+  int                           TailLevel(const _T& score, const char* member) const;
+  void                          SortByScore(std::vector<std::pair<_T, const char*>>& v) const;
+  std::unique_ptr<ZSET_TYPE>    NewZset(const std::string& key,
+                                        ZsetDictType dict_type) const;
 
   ////////////////////////////// END Declaration of Zset Internal Implementations //////////////////////////////
 
   // Database in memory/rocksdb
-  std::unique_ptr<DictInterface<MemberScore>> dict_;
-  // Key of zset, used as db path
+  static Dict*                  NewDict(ZsetDictType dict_type,
+                                        const std::string& key,
+                                        bool error_if_exists);
+
+  std::unique_ptr<Dict> dict_;
+  // Key of zset, used as db path, or as key prefix in a shared store
   std::string key_;
+  // Follow next_ pointers instead of looking up member keys in dict
+  bool linked_;
   // The first node of skiplist
   MemberScore* root_;
   // The max level in the skiplist
   int max_level_;
   // The number of members
-  uint32_t card_;
-  // Buffer array for zadd
+  uint64_t card_;
+  // Buffer array for zadd/zrem, predecessors and their ranks per level,
+  // and the sums of scores up to them with _SpanSums
   MemberScore* prev_[_MaxLevel + 1];
-  uint32_t prev_step_[_MaxLevel + 1];
+  uint64_t prev_step_[_MaxLevel + 1];
+  sum_t prev_sum_[_MaxLevel + 1];
+  // The last node of every level, kept by member since cached nodes may
+  // be evicted between calls, and by pointer too if linked_. A member
+  // after it at some level goes after it at every level above, where no
+  // descent is needed, so appends and updates near the end start from
+  // here instead of the root. Rank 0 stands for the root
+  struct TailNode {
+    std::string member;
+    MemberScore* node = nullptr;
+    _T score;
+    uint64_t rank = 0;
+    sum_t sum = 0;
+  };
+  TailNode tail_[_MaxLevel + 1];
+  // State of the xorshift generator of node levels, never 0
+  uint64_t rand_state_ = uint64_t(std::random_device()()) << 32 | std::random_device()() | 1;
+  // Counters per public API
+  StatsRecorder stats_;
+  // Ranges of fewer members are read from the skiplist, whose nodes are
+  // likely cached, rather than through a new rocksdb iterator
+  static constexpr uint32_t kIndexMinRange = 16;
+  // Predecessors of an updated node are looked for this many nodes back
+  // at most, before a descent from the root
+  static constexpr int kWalkBackLimit = 8;
+  // Snapshot format, see SaveSnapshot
+  static constexpr char kSnapshotMagic[] = "ZSNP";
+  static constexpr char kSnapshotVersion = 2;
+  static constexpr size_t kSnapshotEntrySize = 1 + sizeof(_T) + 5 + _MaxMemberLen;
+  static constexpr size_t kSnapshotBufferSize = std::max(size_t(1) << 20,
+                                                         kSnapshotEntrySize * 2);
+
+#ifndef NO_ROCKSDB
+  // Shared rocksdb instance hosting this zset, if any
+  std::shared_ptr<RocksdbStore> store_;
+#endif
 };
 
 ////////////////////////////// BEGIN Zset APIs //////////////////////////////
 
+/*
+  Fill an empty zset in one linear pass instead of one Zadd per member.
+  Unless sorted is true, which promises members_and_scores to be
+  strictly ascending by (score, member), the last score of each member
+  is kept and pairs are sorted first. Nodes are then built from the
+  last one backwards, so that the successor of a node at every level
+  is already known when the node is built.
+*/
+ZSET_TEMPLATE
+uint64_t ZSET_TYPE::BulkLoad(pairs<_T> members_and_scores, bool sorted) {
+  auto scope = stats_.Record(OP_BULKLOAD);
+  if (card_ != 0) {
+    throw std::logic_error("bulk load requires an empty zset");
+  }
+  auto& v = members_and_scores;
+  for (auto& [member, score] : v) {
+    if (member.size() > _MaxMemberLen) {
+      throw std::length_error("member length exceeds limit");
+    }
+    if (member.empty()) {
+      throw std::length_error("member cannot be empty string");
+    }
+  }
+  auto less = [](const std::pair<std::string, _T>& a,
+                 const std::pair<std::string, _T>& b) {
+    if (a.second < b.second) return true;
+    if (b.second < a.second) return false;
+    return a.first < b.first;
+  };
+  if (!sorted) {
+    std::vector<bool> is_last(v.size(), false);
+    {
+      tsl::robin_set<std::string_view> seen;
+      for (size_t i = v.size(); i -- > 0; ) {
+        is_last[i] = seen.insert(v[i].first).second;
+      }
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < v.size(); i ++) {
+      if (is_last[i]) {
+        std::swap(v[n ++], v[i]);
+      }
+    }
+    v.resize(n);
+    std::sort(v.begin(), v.end(), less);
+  } else {
+    for (size_t i = 1; i < v.size(); i ++) {
+      if (!less(v[i - 1], v[i])) {
+        throw std::invalid_argument("bulk load input is not strictly sorted");
+      }
+    }
+  }
+
+  std::vector<uint8_t> levels(v.size());
+  for (auto& level : levels) {
+    level = RandLevel(v.size());
+  }
+  return ImplBulkLoad(v, levels);
+}
+
+/*
+  Snapshot of the zset in level-1 order, read back by LoadSnapshot in
+  one pass through ImplBulkLoad:
+    - magic       (4 bytes: "ZSNP")
+    - version     (1 byte : kSnapshotVersion)
+    - score size  (2 bytes: uint16_t)
+    - card        (8 bytes: uint64_t, 4 bytes in version 1)
+    - (level i, score i, member size i: varint32, member i), 1 <= i <= card
+    - crc32 of all the above (4 bytes)
+  Steps and links follow from the levels, so they are not written.
+*/
+ZSET_TEMPLATE
+void ZSET_TYPE::SaveSnapshot(const std::string& path) const {
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open snapshot " + tmp);
+  }
+  std::string buffer;
+  buffer.reserve(kSnapshotBufferSize);
+  bool ok = WriteSnapshot(fd, buffer) && fsync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tmp.data(), path.data()) != 0) {
+    unlink(tmp.data());
+    throw std::runtime_error("snapshot write failed: " + path);
+  }
+}
+
+/*
+  Save a snapshot without blocking the writer: a forked child writes
+  the zset as of the fork, whose pages the kernel copies on write, and
+  the future tells whether it succeeded. The child only follows node
+  pointers and writes through a buffer allocated before the fork, so
+  this requires a pointer stable dict, ROBIN_MAP_DICT or LOG_DICT.
+  The child is reaped by a detached thread, so dropping the future
+  never waits for the save.
+*/
+ZSET_TEMPLATE
+std::future<bool> ZSET_TYPE::BgSaveSnapshot(const std::string& path) const {
+  if (!linked_) {
+    throw std::logic_error("background snapshots require a pointer stable dict");
+  }
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open snapshot " + tmp);
+  }
+  std::string buffer;
+  buffer.reserve(kSnapshotBufferSize);
+  pid_t pid = fork();
+  if (pid == 0) {
+    bool ok = WriteSnapshot(fd, buffer) && fsync(fd) == 0 &&
+              rename(tmp.data(), path.data()) == 0;
+    _exit(ok ? 0 : 1);
+  }
+  close(fd);
+  if (pid < 0) {
+    unlink(tmp.data());
+    throw std::runtime_error("snapshot fork failed");
+  }
+  std::promise<bool> done;
+  auto saved = done.get_future();
+  std::thread([pid, tmp, done = std::move(done)]() mutable {
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!ok) {
+      unlink(tmp.data());
+    }
+    done.set_value(ok);
+  }).detach();
+  return saved;
+}
+
+ZSET_TEMPLATE
+uint64_t ZSET_TYPE::LoadSnapshot(const std::string& path) {
+  auto scope = stats_.Record(OP_BULKLOAD);
+  if (card_ != 0) {
+    throw std::logic_error("loading a snapshot requires an empty zset");
+  }
+  std::string data;
+  FILE* fp = fopen(path.data(), "rb");
+  if (fp == nullptr) {
+    throw std::runtime_error("cannot open snapshot " + path);
+  }
+  long size = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+  if (size < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+    fclose(fp);
+    throw std::runtime_error("cannot read snapshot " + path);
+  }
+  data.resize(size);
+  size_t read = fread(data.data(), 1, data.size(), fp);
+  fclose(fp);
+
+  const char* p = data.data();
+  uint16_t score_size = 0;
+  uint64_t card = 0;
+  uint32_t crc = 0;
+  // Version 1 has a 4-byte card
+  size_t card_size = data.size() > 4 && p[4] == 1 ? 4 : sizeof card;
+  if (read != data.size() || data.size() < 7 + card_size + sizeof crc ||
+      memcmp(p, kSnapshotMagic, 4) != 0 || p[4] < 1 || p[4] > kSnapshotVersion) {
+    throw std::runtime_error("corrupted snapshot " + path);
+  }
+  const char* limit = p + data.size() - sizeof crc;
+  memcpy(&score_size, p + 5, sizeof score_size);
+  memcpy(&card, p + 7, card_size);
+  memcpy(&crc, limit, sizeof crc);
+  if (score_size != sizeof(_T) || Crc32(p, limit - p) != crc ||
+      card > uint64_t(limit - p) / (2 + sizeof(_T))) {
+    throw std::runtime_error("corrupted snapshot " + path);
+  }
+  p += 7 + card_size;
+
+  pairs<_T> v(card);
+  std::vector<uint8_t> levels(card);
+  for (uint64_t i = 0; i < card; i ++) {
+    if (size_t(limit - p) < 1 + sizeof(_T) || p[0] == 0) {
+      throw std::runtime_error("corrupted snapshot " + path);
+    }
+    // Snapshots of zsets with more levels are cut to _MaxLevel
+    levels[i] = std::min(int(uint8_t(p[0])), _MaxLevel);
+    memcpy(&v[i].second, p + 1, sizeof(_T));
+    uint32_t member_size = 0;
+    p = GetVarint32(p + 1 + sizeof(_T), limit, &member_size);
+    if (p == nullptr || member_size == 0 || member_size > _MaxMemberLen ||
+        member_size > size_t(limit - p)) {
+      throw std::runtime_error("corrupted snapshot " + path);
+    }
+    v[i].first.assign(p, member_size);
+    p += member_size;
+    if (i && !(v[i - 1].second < v[i].second ||
+               (!(v[i].second < v[i - 1].second) && v[i - 1].first < v[i].first))) {
+      throw std::runtime_error("corrupted snapshot " + path);
+    }
+  }
+  if (p != limit) {
+    throw std::runtime_error("corrupted snapshot " + path);
+  }
+  return ImplBulkLoad(v, levels);
+}
+
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zadd(const char* member, const _T& score) {
+uint64_t ZSET_TYPE::Zadd(const char* member, const _T& score) {
+  auto scope = stats_.Record(OP_ZADD);
   int len = strlen(member);
   if (len > _MaxMemberLen) {
     throw std::length_error("member length exceeds limit");
@@ -337,30 +1105,80 @@ uint32_t ZSET_TYPE::Zadd(const char* member, const _T& score) {
 
   auto ms = dict_->Find(member);
   if (ms != nullptr) {
-    if(ms->ScoreCompare(0, score) == 0) {
-      return 0;
+    if(ms->ScoreCompare(0, score) != 0) {
+      ImplZupdate(ms, score);
     }
-    ImplZrem(member, ms->get_score());
+    return 0;
   }
   ImplZadd(member, score);
-  if (ms == nullptr) {
-    dict_->ResizeLRUCapacity(card_);
-  }
-  return uint32_t(ms == nullptr);
+  return 1;
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zadd(const std::string& member, const _T& score) {
+uint64_t ZSET_TYPE::Zadd(const std::string& member, const _T& score) {
   return Zadd(member.data(), score);
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zcard() const {
+uint64_t ZSET_TYPE::ZaddMany(const pairs<_T>& members_and_scores) {
+  auto scope = stats_.Record(OP_ZADD);
+  // Keep the last score of each member, as a sequence of Zadd would
+  std::vector<const char*> members;
+  std::vector<_T> scores;
+  tsl::robin_map<std::string_view, size_t> index;
+  for (auto& [member, score] : members_and_scores) {
+    if (member.size() > _MaxMemberLen) {
+      throw std::length_error("member length exceeds limit");
+    }
+    if (member.empty()) {
+      throw std::length_error("member cannot be empty string");
+    }
+    auto [it, inserted] = index.try_emplace(member, members.size());
+    if (inserted) {
+      members.push_back(member.data());
+      scores.push_back(score);
+    } else {
+      scores[it->second] = score;
+    }
+  }
+  // Lookup all members at once
+  std::vector<std::pair<_T, const char*>> removed, added;
+  std::vector<bool> found(members.size(), false);
+  dict_->FindMany(members, [&](size_t i, MemberScore* ms) {
+    found[i] = true;
+    if (ms->ScoreCompare(0, scores[i]) != 0) {
+      removed.emplace_back(ms->get_score(), members[i]);
+      added.emplace_back(scores[i], members[i]);
+    }
+  });
+  uint64_t added_count = 0;
+  for (size_t i = 0; i < members.size(); i ++) {
+    if (!found[i]) {
+      added.emplace_back(scores[i], members[i]);
+      added_count ++;
+    }
+  }
+  // Visit the skiplist in order, so that every descent resumes
+  // from the predecessors of the previous one
+  SortByScore(removed);
+  for (size_t i = 0; i < removed.size(); i ++) {
+    ImplZrem(removed[i].second, removed[i].first, i > 0);
+  }
+  SortByScore(added);
+  for (size_t i = 0; i < added.size(); i ++) {
+    ImplZadd(added[i].second, added[i].first, i > 0);
+  }
+  return added_count;
+}
+
+ZSET_TEMPLATE
+uint64_t ZSET_TYPE::Zcard() const {
   return card_;
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zcount(const _T& min_score, const _T& max_score) const {
+uint64_t ZSET_TYPE::Zcount(const _T& min_score, const _T& max_score) const {
+  auto scope = stats_.Record(OP_ZCOUNT);
   if (min_score > max_score) {
     return 0;
   }
@@ -369,14 +1187,17 @@ uint32_t ZSET_TYPE::Zcount(const _T& min_score, const _T& max_score) const {
 
 ZSET_TEMPLATE
 _T ZSET_TYPE::Zincrby(const char* member, _T increment) {
+  auto scope = stats_.Record(OP_ZINCRBY);
   if (*member == '\0') {
     throw std::length_error("member cannot be empty string");
   }
   auto ms = dict_->Find(member);
-  if (ms != nullptr) {
-    increment += ms->get_score();
+  increment = MemberScore::canonical_score(ms ? increment + ms->get_score() : increment);
+  if (ms == nullptr) {
+    Zadd(member, increment);
+  } else if (ms->ScoreCompare(0, increment) != 0) {
+    ImplZupdate(ms, increment);
   }
-  Zadd(member, increment);
   return increment;
 }
 
@@ -389,37 +1210,30 @@ ZSET_TEMPLATE
 std::unique_ptr<ZSET_TYPE> ZSET_TYPE::Zinterstore(ZSET_TYPE* b,
                                                   const std::string& inter_zset_name,
                                                   ZsetDictType dict_type) {
-  if (Zcard() > b->Zcard()) {
-    return std::move(b->Zinterstore(this, inter_zset_name, dict_type));
-  }
-  auto inter_zset =
-    std::unique_ptr<ZSET_TYPE>(new ZSET_TYPE(inter_zset_name, dict_type, true));
-  for (auto ms = root_; ; ) {
-    char* mbr = ms->get_member(1);
-    if (*mbr == '\0') {
-      break;
-    }
-    _T score_a = ms->get_score(1);
-    auto [found_b, score_b] = b->Zscore(mbr);
-    if (found_b) {
-      score_a += score_b;
-      inter_zset->Zadd(mbr, score_a);
-    }
-    ms = dict_->Find(mbr);
-  }
-  return std::move(inter_zset);
+  return Zinterstore(std::vector<ZSET_TYPE*>{b}, inter_zset_name, dict_type);
+}
+
+ZSET_TEMPLATE
+std::unique_ptr<ZSET_TYPE> ZSET_TYPE::Zinterstore(const std::vector<ZSET_TYPE*>& others,
+                                                  const std::string& inter_zset_name,
+                                                  ZsetDictType dict_type,
+                                                  const std::vector<double>& weights,
+                                                  ZsetAggregate aggregate) {
+  auto scope = stats_.Record(OP_ZSTORE);
+  return ImplZstore(others, inter_zset_name, dict_type, weights, aggregate, true);
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zlexcount(const char* start, bool with_start,
+uint64_t ZSET_TYPE::Zlexcount(const char* start, bool with_start,
                               const char* stop, bool with_stop) const {
+  auto scope = stats_.Record(OP_ZCOUNT);
   if (card_ == 0 || strcmp(start, stop) > 0) {
     return 0;
   }
 
   std::string mbr;
-  uint32_t start_rank = 0;
-  uint32_t stop_rank = card_;
+  uint64_t start_rank = 0;
+  uint64_t stop_rank = card_;
   bool start_found = false;
   bool stop_found = false;
 
@@ -437,7 +1251,7 @@ uint32_t ZSET_TYPE::Zlexcount(const char* start, bool with_start,
     stop_found = (cmp == 0);
   }
 
-  uint32_t count = stop_rank + 1 - start_rank;
+  uint64_t count = stop_rank + 1 - start_rank;
   if (start_found && !with_start) {
     count --;
   }
@@ -448,92 +1262,76 @@ uint32_t ZSET_TYPE::Zlexcount(const char* start, bool with_start,
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zlexcount(const std::string& start, bool with_start,
+uint64_t ZSET_TYPE::Zlexcount(const std::string& start, bool with_start,
                               const std::string& stop, bool with_stop) const {
   return Zlexcount(start.data(), with_start, stop.data(), with_stop);
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zpopmax(strs* members, uint32_t count) {
+uint64_t ZSET_TYPE::Zpopmax(strs* members, uint64_t count) {
+  auto scope = stats_.Record(OP_ZPOP);
   members->clear();
-  if (count == 0) {
-    return 0;
-  }
-  uint32_t prev_rank = card_ > count ? card_ - count : 0;
-  MemberScore* prev = FindByRank(prev_rank);
-  uint32_t pop_count = card_ - prev_rank;
-  for (uint32_t i = 0; i < pop_count; i ++) {
-    members->push_back(prev->get_member(1));
-    ImplZrem(prev->get_member(1), prev->get_score(1));
-  }
-  if (pop_count) {
-    std::reverse(members->begin(), members->end());
-  }
+  uint64_t pop_count = std::min(count, card_);
+  ImplZremRange(card_ + 1 - pop_count, card_, [&](MemberScore* ms) {
+    members->push_back(ms->get_member());
+  });
+  std::reverse(members->begin(), members->end());
   return pop_count;
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zpopmax(pairs<_T>* members_and_scores, uint32_t count) {
+uint64_t ZSET_TYPE::Zpopmax(pairs<_T>* members_and_scores, uint64_t count) {
+  auto scope = stats_.Record(OP_ZPOP);
   members_and_scores->clear();
-  if (count == 0) {
-    return 0;
-  }
-  uint32_t prev_rank = card_ > count ? card_ - count : 0;
-  MemberScore* prev = FindByRank(prev_rank);
-  uint32_t pop_count = card_ - prev_rank;
-  for (uint32_t i = 0; i < pop_count; i ++) {
-    members_and_scores->emplace_back(prev->get_member(1), prev->get_score(1));
-    ImplZrem(prev->get_member(1), prev->get_score(1));
-  }
-  if (pop_count) {
-    std::reverse(members_and_scores->begin(), members_and_scores->end());
-  }
+  uint64_t pop_count = std::min(count, card_);
+  ImplZremRange(card_ + 1 - pop_count, card_, [&](MemberScore* ms) {
+    members_and_scores->emplace_back(ms->get_member(), ms->get_score());
+  });
+  std::reverse(members_and_scores->begin(), members_and_scores->end());
   return pop_count;
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zpopmin(strs* members, uint32_t count) {
+uint64_t ZSET_TYPE::Zpopmin(strs* members, uint64_t count) {
+  auto scope = stats_.Record(OP_ZPOP);
   members->clear();
-  if (count == 0) {
-    return 0;
-  }
-  MemberScore* prev = root_;
-  uint32_t pop_count = card_ > count ? count : card_;
-  for (uint32_t i = 0; i < pop_count; i ++) {
-    members->push_back(prev->get_member(1));
-    ImplZrem(prev->get_member(1), prev->get_score(1));
-  }
-  return pop_count;
+  return ImplZremRange(1, std::min(count, card_), [&](MemberScore* ms) {
+    members->push_back(ms->get_member());
+  });
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zpopmin(pairs<_T>* members_and_scores, uint32_t count) {
+uint64_t ZSET_TYPE::Zpopmin(pairs<_T>* members_and_scores, uint64_t count) {
+  auto scope = stats_.Record(OP_ZPOP);
   members_and_scores->clear();
-  if (count == 0) {
-    return 0;
-  }
-  MemberScore* prev = root_;
-  uint32_t pop_count = card_ > count ? count : card_;
-  for (uint32_t i = 0; i < pop_count; i ++) {
-    members_and_scores->emplace_back(prev->get_member(1), prev->get_score(1));
-    ImplZrem(prev->get_member(1), prev->get_score(1));
-  }
-  return pop_count;
+  return ImplZremRange(1, std::min(count, card_), [&](MemberScore* ms) {
+    members_and_scores->emplace_back(ms->get_member(), ms->get_score());
+  });
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrange(strs* members, uint32_t start, uint32_t stop,
-                           uint32_t limit) const {
+uint64_t ZSET_TYPE::Zrange(strs* members, uint64_t start, uint64_t stop,
+                           uint64_t limit) const {
+  auto scope = stats_.Record(OP_ZRANGE);
   members->clear();
-  start = std::max(1u, start);
+  start = std::max<uint64_t>(1, start);
   stop = std::min(card_, stop);
   if (start > stop) {
     return 0;
   }
   auto ms = FindByRank(start - 1);
-  uint32_t count = 0;
-  for (int i = start; i <= stop; i ++) {
-    ms = dict_->Find(ms->get_member(1));
+  uint64_t total = limit ? std::min(limit, stop - start + 1) : stop - start + 1;
+  if (total >= kIndexMinRange &&
+      IndexRange(IndexKey(ms->get_score(1), ms->get_member(1)), false,
+                 [&](const _T& score, std::string_view member) {
+                   members->emplace_back(member);
+                   return members->size() < total;
+                 })) {
+    return members->size();
+  }
+  uint64_t count = 0;
+  for (uint64_t i = start; i <= stop; i ++) {
+    ms = Next(ms, 1);
     members->push_back(ms->get_member());
     if (++ count == limit) {
       return count;
@@ -543,19 +1341,29 @@ uint32_t ZSET_TYPE::Zrange(strs* members, uint32_t start, uint32_t stop,
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrange(pairs<_T>* members_and_scores,
-                       uint32_t start, uint32_t stop,
-                       uint32_t limit) const {
+uint64_t ZSET_TYPE::Zrange(pairs<_T>* members_and_scores,
+                       uint64_t start, uint64_t stop,
+                       uint64_t limit) const {
+  auto scope = stats_.Record(OP_ZRANGE);
   members_and_scores->clear();
-  start = std::max(1u, start);
+  start = std::max<uint64_t>(1, start);
   stop = std::min(card_, stop);
   if (start > stop) {
     return 0;
   }
   auto ms = FindByRank(start - 1);
-  uint32_t count = 0;
-  for (int i = start; i <= stop; i ++) {
-    ms = dict_->Find(ms->get_member(1));
+  uint64_t total = limit ? std::min(limit, stop - start + 1) : stop - start + 1;
+  if (total >= kIndexMinRange &&
+      IndexRange(IndexKey(ms->get_score(1), ms->get_member(1)), false,
+                 [&](const _T& score, std::string_view member) {
+                   members_and_scores->emplace_back(member, score);
+                   return members_and_scores->size() < total;
+                 })) {
+    return members_and_scores->size();
+  }
+  uint64_t count = 0;
+  for (uint64_t i = start; i <= stop; i ++) {
+    ms = Next(ms, 1);
     members_and_scores->push_back(
       std::make_pair(ms->get_member(), ms->get_score()));
     if (++ count == limit) {
@@ -565,79 +1373,112 @@ uint32_t ZSET_TYPE::Zrange(pairs<_T>* members_and_scores,
   return count;
 }
 
+ZSET_TEMPLATE typename
+ZSET_TYPE::Cursor ZSET_TYPE::ZrangeCursor(uint64_t start, uint64_t stop,
+                                          bool reverse) const {
+  auto scope = stats_.Record(OP_ZRANGE);
+  return Cursor(this, std::max<uint64_t>(1, start), std::min(card_, stop), reverse);
+}
+
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrangebylex(
+uint64_t ZSET_TYPE::Zrangebylex(
   strs* members,
   const char* start, bool with_start,
   const char* stop, bool with_stop,
-  uint32_t limit) const {
+  uint64_t limit) const {
+  auto scope = stats_.Record(OP_ZRANGE);
 
   members->clear();
-  uint32_t count = Zlexcount(start, with_start, stop, with_stop);
+  uint64_t count = Zlexcount(start, with_start, stop, with_stop);
   if (count == 0) {
     return 0;
   }
   auto ms = FindByLex(start);
   if (!with_start && strcmp(ms->get_member(1), start) == 0) {
-    ms = dict_->Find(ms->get_member(1));
+    ms = Next(ms, 1);
   }
   if (limit != 0 && limit < count) {
     count = limit;
   }
-  for (int i = 1; i <= count; i ++) {
+  for (uint64_t i = 1; i <= count; i ++) {
     members->push_back(ms->get_member(1));
     if (i < count) {
-      ms = dict_->Find(ms->get_member(1));
+      ms = Next(ms, 1);
     }
   }
   return members->size();
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrangebylex(
+uint64_t ZSET_TYPE::Zrangebylex(
   pairs<_T>* members_and_scores,
   const char* start, bool with_start,
   const char* stop, bool with_stop,
-  uint32_t limit) const {
+  uint64_t limit) const {
+  auto scope = stats_.Record(OP_ZRANGE);
 
   members_and_scores->clear();
-  uint32_t count = Zlexcount(start, with_start, stop, with_stop);
+  uint64_t count = Zlexcount(start, with_start, stop, with_stop);
   if (count == 0) {
     return 0;
   }
   auto ms = FindByLex(start);
   if (!with_start && strcmp(ms->get_member(1), start) == 0) {
-    ms = dict_->Find(ms->get_member(1));
+    ms = Next(ms, 1);
   }
   if (limit != 0 && limit < count) {
     count = limit;
   }
-  for (int i = 1; i <= count; i ++) {
+  for (uint64_t i = 1; i <= count; i ++) {
     members_and_scores->emplace_back(ms->get_member(1), ms->get_score(1));
     if (i < count) {
-      ms = dict_->Find(ms->get_member(1));
+      ms = Next(ms, 1);
     }
   }
   return members_and_scores->size();
 }
 
+ZSET_TEMPLATE typename
+ZSET_TYPE::Cursor ZSET_TYPE::ZrangebylexCursor(const char* start, bool with_start,
+                                               const char* stop, bool with_stop,
+                                               bool reverse) const {
+  auto scope = stats_.Record(OP_ZRANGE);
+  if (strcmp(start, stop) > 0) {
+    return Cursor(this, 1, 0, reverse);
+  }
+  return Cursor(this, ImplZlexcount(start, !with_start) + 1,
+                ImplZlexcount(stop, with_stop), reverse);
+}
+
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrangebyscore(
+uint64_t ZSET_TYPE::Zrangebyscore(
   strs* members, const _T& min_score, const _T& max_score,
-  uint32_t limit) const {
+  uint64_t limit) const {
+  auto scope = stats_.Record(OP_ZRANGE);
 
   members->clear();
-  if (min_score > max_score) {
+  if (card_ == 0 || min_score > max_score) {
     return 0;
   }
+  if ((limit == 0 || limit >= kIndexMinRange) &&
+      IndexRange(IndexKey(min_score, kZsetRoot), false,
+                 [&](const _T& score, std::string_view member) {
+                   if (max_score < score) {
+                     return false;
+                   }
+                   members->emplace_back(member);
+                   return members->size() != limit;
+                 })) {
+    return members->size();
+  }
   MemberScore* ms = FindByScore(min_score);
-  uint32_t count = 0;
+  uint64_t count = 0;
   for (;;) {
-    std::string mbr = ms->get_member(1);
+    char* mbr = ms->get_member(1);
     _T scr = ms->get_score(1);
-    if (mbr.size() != 0 && scr <= max_score) {
-      ms = dict_->Find(mbr.data());
-      members->emplace_back(std::move(mbr));
+    if (*mbr != '\0' && scr <= max_score) {
+      members->emplace_back(mbr);
+      ms = Next(ms, 1);
       if (++ count == limit) {
         return count;
       }
@@ -649,22 +1490,34 @@ uint32_t ZSET_TYPE::Zrangebyscore(
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrangebyscore(
+uint64_t ZSET_TYPE::Zrangebyscore(
   pairs<_T>* members_and_scores, const _T& min_score, const _T& max_score,
-  uint32_t limit) const {
+  uint64_t limit) const {
+  auto scope = stats_.Record(OP_ZRANGE);
 
   members_and_scores->clear();
-  if (min_score > max_score) {
+  if (card_ == 0 || min_score > max_score) {
     return 0;
   }
+  if ((limit == 0 || limit >= kIndexMinRange) &&
+      IndexRange(IndexKey(min_score, kZsetRoot), false,
+                 [&](const _T& score, std::string_view member) {
+                   if (max_score < score) {
+                     return false;
+                   }
+                   members_and_scores->emplace_back(member, score);
+                   return members_and_scores->size() != limit;
+                 })) {
+    return members_and_scores->size();
+  }
   MemberScore* ms = FindByScore(min_score);
-  uint32_t count = 0;
+  uint64_t count = 0;
   for (;;) {
-    std::string mbr = ms->get_member(1);
+    char* mbr = ms->get_member(1);
     _T scr = ms->get_score(1);
-    if (mbr.size() != 0 && scr <= max_score) {
-      ms = dict_->Find(mbr.data());
-      members_and_scores->emplace_back(std::move(mbr), scr);
+    if (*mbr != '\0' && scr <= max_score) {
+      members_and_scores->emplace_back(mbr, scr);
+      ms = Next(ms, 1);
       if (++ count == limit) {
         return count;
       }
@@ -675,8 +1528,20 @@ uint32_t ZSET_TYPE::Zrangebyscore(
   return count;
 }
 
+ZSET_TEMPLATE typename
+ZSET_TYPE::Cursor ZSET_TYPE::ZrangebyscoreCursor(const _T& min_score, const _T& max_score,
+                                                 bool reverse) const {
+  auto scope = stats_.Record(OP_ZRANGE);
+  if (min_score > max_score) {
+    return Cursor(this, 1, 0, reverse);
+  }
+  return Cursor(this, ImplZcount(min_score, false) + 1,
+                ImplZcount(max_score, true), reverse);
+}
+
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrank(const char* member) const {
+uint64_t ZSET_TYPE::Zrank(const char* member) const {
+  auto scope = stats_.Record(OP_ZRANK);
   if (*member == '\0') {
     return 0;
   }
@@ -684,16 +1549,17 @@ uint32_t ZSET_TYPE::Zrank(const char* member) const {
   if (ms == nullptr) {
     return 0;
   }
-  return ImplZrank(member, ms->get_score());
+  return ImplZrank(ms);
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrank(const std::string& member) const {
+uint64_t ZSET_TYPE::Zrank(const std::string& member) const {
   return Zrank(member.data());
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrem(const char* member) {
+uint64_t ZSET_TYPE::Zrem(const char* member) {
+  auto scope = stats_.Record(OP_ZREM);
   if (*member == '\0') {
     return 0;
   }
@@ -706,101 +1572,129 @@ uint32_t ZSET_TYPE::Zrem(const char* member) {
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrem(const std::string& member) {
+uint64_t ZSET_TYPE::Zrem(const std::string& member) {
   return Zrem(member.data());
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zremrangebylex(const char* start, bool with_start,
-                                   const char* stop, bool with_stop) {
-
-  uint32_t removed = Zlexcount(start, with_start, stop, with_stop);
-  if (removed == 0) {
-    return 0;
-  }
-  auto ms = FindByLex(start);
-  if (!with_start && strcmp(ms->get_member(1), start) == 0) {
-    ms = dict_->Find(ms->get_member(1));
+uint64_t ZSET_TYPE::ZremMany(const strs& members) {
+  auto scope = stats_.Record(OP_ZREM);
+  std::vector<const char*> keys;
+  tsl::robin_set<std::string_view> unique_members;
+  for (auto& member : members) {
+    if (!member.empty() && unique_members.insert(member).second) {
+      keys.push_back(member.data());
+    }
   }
-  for (int i = 0; i < removed; i ++) {
-    ImplZrem(ms->get_member(1), ms->get_score(1));
+  std::vector<std::pair<_T, const char*>> removed;
+  dict_->FindMany(keys, [&](size_t i, MemberScore* ms) {
+    removed.emplace_back(ms->get_score(), keys[i]);
+  });
+  SortByScore(removed);
+  for (size_t i = 0; i < removed.size(); i ++) {
+    ImplZrem(removed[i].second, removed[i].first, i > 0);
   }
-  return removed;
+  return removed.size();
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zremrangebyrank(uint32_t start, uint32_t stop) {
-  start = std::max(1u, start);
-  stop = std::min(card_, stop);
-  if (start > stop) {
+uint64_t ZSET_TYPE::Zremrangebylex(const char* start, bool with_start,
+                                   const char* stop, bool with_stop) {
+  auto scope = stats_.Record(OP_ZREMRANGE);
+  if (strcmp(start, stop) > 0) {
     return 0;
   }
-  auto ms = FindByRank(start - 1);
-  std::string mbr;
-  for (uint32_t i = start; i <= stop; i ++) {
-    mbr = ms->get_member(1);
-    _T scr = ms->get_score(1);
-    ImplZrem(mbr.data(), scr);
-  }
-  return stop - start + 1;
+  return ImplZremRange(ImplZlexcount(start, !with_start) + 1,
+                       ImplZlexcount(stop, with_stop), [](MemberScore* ms) {});
+}
+
+ZSET_TEMPLATE
+uint64_t ZSET_TYPE::Zremrangebyrank(uint64_t start, uint64_t stop) {
+  auto scope = stats_.Record(OP_ZREMRANGE);
+  return ImplZremRange(std::max<uint64_t>(1, start), std::min(card_, stop),
+                       [](MemberScore* ms) {});
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zremrangebyscore(const _T& min_score, const _T& max_score) {
+uint64_t ZSET_TYPE::Zremrangebyscore(const _T& min_score, const _T& max_score) {
+  auto scope = stats_.Record(OP_ZREMRANGE);
   if (min_score > max_score) {
     return 0;
   }
-  MemberScore* ms = FindByScore(min_score);
-  uint32_t removed = 0;
-  for (;;) {
-    std::string mbr = ms->get_member(1);
-    _T scr = ms->get_score(1);
-    if (mbr.size() != 0 && scr <= max_score) {
-      ImplZrem(mbr.data(), scr);
-      removed ++;
-    } else {
-      break;
-    }
-  }
-  return removed;
+  return ImplZremRange(ImplZcount(min_score, false) + 1,
+                       ImplZcount(max_score, true), [](MemberScore* ms) {});
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrevrange(
-  strs* members, uint32_t start, uint32_t stop, uint32_t limit) const {
+uint64_t ZSET_TYPE::Zrevrange(
+  strs* members, uint64_t start, uint64_t stop, uint64_t limit) const {
+  auto scope = stats_.Record(OP_ZRANGE);
 
-  start = std::max(1u, start);
+  members->clear();
+  start = std::max<uint64_t>(1, start);
   stop = std::min(card_, stop);
   if (start > stop) {
     return 0;
   }
-  if (stop - start + 1 > limit) {
-    start = stop - limit + 1;
-  }
-  Zrange(start, stop, members);
-  if (!members->empty()) {
-    std::reverse(members->begin(), members->end());
+  uint64_t total = limit ? std::min(limit, stop - start + 1) : stop - start + 1;
+  std::string key;
+  if (total >= kIndexMinRange && start > 1) {
+    auto ms = FindByRank(card_ + 1 - start);
+    key = IndexKey(ms->get_score(), ms->get_member());
+  }
+  if (total >= kIndexMinRange &&
+      IndexRange(key, true, [&](const _T& score, std::string_view member) {
+        members->emplace_back(member);
+        return members->size() < total;
+      })) {
+    return members->size();
+  }
+  uint64_t count = 0;
+  for (auto c = ZrangeCursor(card_ + 1 - stop, card_ + 1 - start, true);
+       c.Valid(); c.Next()) {
+    members->emplace_back(c.member());
+    if (++ count == limit) {
+      break;
+    }
   }
-  return members->size();
+  return count;
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrevrangebyscore(
+uint64_t ZSET_TYPE::Zrevrangebyscore(
   strs* members, const _T& max_score, const _T& min_score,
-  uint32_t limit) const {
+  uint64_t limit) const {
+  auto scope = stats_.Record(OP_ZRANGE);
 
-  Zrangebyscore(min_score, max_score, members);
-  if (!members->empty()) {
-    std::reverse(members->begin(), members->end());
-    if (limit < members->size()) {
-      *members = {members->begin(), members->begin() + limit};
+  members->clear();
+  if (max_score < min_score) {
+    return 0;
+  }
+  if ((limit == 0 || limit >= kIndexMinRange) &&
+      IndexRange(IndexKeyAfter(max_score), true,
+                 [&](const _T& score, std::string_view member) {
+                   if (score < min_score) {
+                     return false;
+                   }
+                   members->emplace_back(member);
+                   return members->size() != limit;
+                 })) {
+    return members->size();
+  }
+  uint64_t count = 0;
+  for (auto c = ZrangebyscoreCursor(min_score, max_score, true);
+       c.Valid(); c.Next()) {
+    members->emplace_back(c.member());
+    if (++ count == limit) {
+      break;
     }
   }
-  return members->size();
+  return count;
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrevrank(const char* member) const {
+uint64_t ZSET_TYPE::Zrevrank(const char* member) const {
+  auto scope = stats_.Record(OP_ZRANK);
   if (*member == '\0') {
     return 0;
   }
@@ -808,16 +1702,17 @@ uint32_t ZSET_TYPE::Zrevrank(const char* member) const {
   if (ms == nullptr) {
     return 0;
   }
-  return card_ + 1 - ImplZrank(member, ms->get_score());
+  return card_ + 1 - ImplZrank(ms);
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::Zrevrank(const std::string& member) const {
+uint64_t ZSET_TYPE::Zrevrank(const std::string& member) const {
   return Zrevrank(member.data());
 }
 
 ZSET_TEMPLATE
 std::pair<bool, _T> ZSET_TYPE::Zscore(const char* member) const {
+  auto scope = stats_.Record(OP_ZSCORE);
   if (*member == '\0') {
     return std::make_pair(false, _T());
   }
@@ -834,57 +1729,292 @@ std::pair<bool, _T> ZSET_TYPE::Zscore(const std::string& member) const {
 }
 
 ZSET_TEMPLATE
-std::unique_ptr<ZSET_TYPE> ZSET_TYPE::Zunionstore(ZSET_TYPE* b,
-                                                  const std::string& union_zset_name,
-                                                  ZsetDictType dict_type) {
-  if (Zcard() > b->Zcard()) {
-    return std::move(b->Zunionstore(this, union_zset_name, dict_type));
-  }
-  auto union_zset =
-    std::unique_ptr<ZSET_TYPE>(new ZSET_TYPE(union_zset_name, dict_type, true));
-  // iterate over zset a
-  for (auto ms = root_; ; ) {
-    char* mbr_a = ms->get_member(1);
-    if (*mbr_a == '\0') {
-      break;
+void ZSET_TYPE::ZscoreMany(const strs& members,
+                           std::vector<std::pair<bool, _T>>* scores) const {
+  auto scope = stats_.Record(OP_ZSCORE);
+  scores->assign(members.size(), std::make_pair(false, _T()));
+  std::vector<const char*> keys;
+  std::vector<size_t> positions;
+  for (size_t i = 0; i < members.size(); i ++) {
+    if (!members[i].empty()) {
+      keys.push_back(members[i].data());
+      positions.push_back(i);
     }
-    _T score_a = ms->get_score(1);
-    union_zset->Zadd(mbr_a, score_a);
-    ms = dict_->Find(mbr_a);
   }
-  // iterate over zset b
-  for (auto ms = b->root_; ; ) {
-    char* mbr_b = ms->get_member(1);
-    if (*mbr_b == '\0') {
-      break;
-    }
-    _T score_b = ms->get_score(1);
-    union_zset->Zincrby(mbr_b, score_b);
-    ms = b->dict_->Find(mbr_b);
+  dict_->FindMany(keys, [&](size_t i, MemberScore* ms) {
+    (*scores)[positions[i]] = std::make_pair(true, ms->get_score());
+  });
+}
+
+ZSET_TEMPLATE
+typename ZSET_TYPE::sum_t ZSET_TYPE::ZsumByRank(uint64_t start, uint64_t stop) const {
+  static_assert(_SpanSums, "ZsumByRank requires _SpanSums");
+  auto scope = stats_.Record(OP_ZCOUNT);
+  start = std::max<uint64_t>(1, start);
+  stop = std::min(card_, stop);
+  if (start > stop) {
+    return 0;
   }
-  return std::move(union_zset);
+  return ImplPrefixSum(stop) - ImplPrefixSum(start - 1);
 }
 
-////////////////////////////// END Zset APIs //////////////////////////////
+ZSET_TEMPLATE
+typename ZSET_TYPE::sum_t ZSET_TYPE::ZsumByScore(const _T& min_score,
+                                                 const _T& max_score) const {
+  static_assert(_SpanSums, "ZsumByScore requires _SpanSums");
+  auto scope = stats_.Record(OP_ZCOUNT);
+  if (max_score < min_score) {
+    return 0;
+  }
+  sum_t min_sum = 0, max_sum = 0;
+  ImplZcount(min_score, false, &min_sum);
+  ImplZcount(max_score, true, &max_sum);
+  return max_sum - min_sum;
+}
+
+ZSET_TEMPLATE
+std::unique_ptr<ZSET_TYPE> ZSET_TYPE::Zunionstore(ZSET_TYPE* b,
+                                                  const std::string& union_zset_name,
+                                                  ZsetDictType dict_type) {
+  return Zunionstore(std::vector<ZSET_TYPE*>{b}, union_zset_name, dict_type);
+}
+
+ZSET_TEMPLATE
+std::unique_ptr<ZSET_TYPE> ZSET_TYPE::Zunionstore(const std::vector<ZSET_TYPE*>& others,
+                                                  const std::string& union_zset_name,
+                                                  ZsetDictType dict_type,
+                                                  const std::vector<double>& weights,
+                                                  ZsetAggregate aggregate) {
+  auto scope = stats_.Record(OP_ZSTORE);
+  return ImplZstore(others, union_zset_name, dict_type, weights, aggregate, false);
+}
+
+ZSET_TEMPLATE
+ZsetStats ZSET_TYPE::Stats() const {
+  ZsetStats stats;
+  stats_.Snapshot(stats.ops);
+  stats.dict = dict_->Stats();
+  stats.cache = dict_->CacheStats();
+  stats.store = dict_->StoreStatistics();
+  return stats;
+}
+
+////////////////////////////// END Zset APIs //////////////////////////////
 
 
 
 ////////////////////////////// BEGIN Zset Internal Implementations //////////////////////////////
 
+// Build the nodes of v, strictly ascending by (score, member), at the
+// given levels
+ZSET_TEMPLATE
+uint64_t ZSET_TYPE::ImplBulkLoad(const pairs<_T>& v, const std::vector<uint8_t>& levels) {
+  uint64_t n = v.size();
+  int max_level = 0;
+  for (auto level : levels) {
+    max_level = std::max(max_level, int(level));
+  }
+  // The next node at each level, n if none
+  std::vector<uint64_t> next(max_level + 1, n);
+  std::vector<MemberScore*> next_ms(max_level + 1, nullptr);
+  // Sums of the scores of the first k members
+  std::vector<sum_t> prefix_sum(_SpanSums ? n + 1 : 0);
+  for (uint64_t k = 0; _SpanSums && k < n; k ++) {
+    prefix_sum[k + 1] = prefix_sum[k] + ToSum(v[k].second);
+  }
+  auto link = [&](MemberScore* ms, int lvl, uint64_t rank) {
+    if (next[lvl] != n) {
+      if (linked_) {
+        ms->set_next(lvl, next_ms[lvl]);
+      } else {
+        ms->set_member(lvl, v[next[lvl]].first.data());
+      }
+      ms->set_score(lvl, v[next[lvl]].second);
+      ms->set_step(lvl, next[lvl] + 1 - rank);
+      if constexpr (_SpanSums) {
+        ms->set_sum(lvl, prefix_sum[next[lvl] + 1] - prefix_sum[rank]);
+      }
+    }
+  };
+  MemberScore* tail = root_;
+  for (uint64_t j = n; j -- > 0; ) {
+    MemberScore* ms = dict_->BulkLoadBuffer(v[j].first.data());
+    ms->Reset(v[j].second, levels[j]);
+    // The previous node is not built yet, but its member is known
+    if (linked_) {
+      ms->set_back(j ? nullptr : root_);
+      if (next_ms[1] != nullptr) {
+        next_ms[1]->set_back(ms);
+      }
+    } else {
+      ms->set_back_member(j ? v[j - 1].first.data() : kZsetRoot);
+    }
+    if (j + 1 == n) {
+      tail = ms;
+    }
+    for (int i = 1; i <= levels[j]; i ++) {
+      link(ms, i, j + 1);
+      next[i] = j;
+      next_ms[i] = ms;
+    }
+    dict_->BulkLoadAdd(ms);
+  }
+  dict_->BulkLoadFinish();
+
+  root_->Reset(_T(), max_level);
+  for (int i = 1; i <= max_level; i ++) {
+    link(root_, i, 0);
+  }
+  if (linked_) {
+    root_->set_back(n ? tail : nullptr);
+  } else {
+    root_->set_back_member(n ? v[n - 1].first.data() : kZsetRoot);
+  }
+  max_level_ = max_level;
+  card_ = n;
+  RebuildTail();
+  dict_->Persist(root_);
+  return card_;
+}
+
+// Write the snapshot through buffer, which the caller reserved so that
+// it is never reallocated, as a forked child must not allocate
+ZSET_TEMPLATE
+bool ZSET_TYPE::WriteSnapshot(int fd, std::string& buffer) const {
+  uint32_t crc = 0;
+  auto flush = [&]() {
+    crc = Crc32(buffer.data(), buffer.size(), crc);
+    const char* p = buffer.data();
+    size_t n = buffer.size();
+    while (n > 0) {
+      ssize_t written = write(fd, p, n);
+      if (written < 0 && errno != EINTR) {
+        return false;
+      }
+      p += std::max<ssize_t>(written, 0);
+      n -= std::max<ssize_t>(written, 0);
+    }
+    buffer.clear();
+    return true;
+  };
+  uint16_t score_size = sizeof(_T);
+  buffer.append(kSnapshotMagic, 4);
+  buffer.push_back(kSnapshotVersion);
+  PutFixed(buffer, &score_size, sizeof score_size);
+  PutFixed(buffer, &card_, sizeof card_);
+  for (MemberScore* ms = root_; max_level_ && *ms->get_member(1) != '\0'; ) {
+    ms = Next(ms, 1);
+    if (buffer.size() + kSnapshotEntrySize > buffer.capacity() && !flush()) {
+      return false;
+    }
+    _T score = ms->get_score();
+    auto member = ms->get_key_string_view();
+    buffer.push_back(char(ms->get_level()));
+    PutFixed(buffer, &score, sizeof score);
+    PutVarint32(buffer, member.size());
+    buffer.append(member);
+  }
+  if (!flush()) {
+    return false;
+  }
+  PutFixed(buffer, &crc, sizeof crc);
+  return flush();
+}
+
+ZSET_TEMPLATE
+typename ZSET_TYPE::Dict* ZSET_TYPE::NewDict(ZsetDictType dict_type,
+                                             const std::string& key,
+                                             bool error_if_exists) {
+  if (kFixedDict && dict_type != kDefaultDict) {
+    throw std::invalid_argument("dict type differs from the zset dict backend");
+  }
+  if constexpr (std::is_same<Dict, RobinMapDict<MemberScore>>::value) {
+    return new Dict();
+  } else if constexpr (std::is_same<Dict, LogDict<MemberScore>>::value) {
+    return new Dict(key, error_if_exists);
+  }
+#ifndef NO_ROCKSDB
+  else if constexpr (std::is_same<Dict, RocksdbDict<MemberScore>>::value) {
+    return new Dict(key, error_if_exists);
+  }
+#endif
+  else {
+    if (dict_type == LOG_DICT) {
+      return new LogDict<MemberScore>(key, error_if_exists);
+    }
+#ifndef NO_ROCKSDB
+    if (dict_type == ROCKSDB_DICT) {
+      return new RocksdbDict<MemberScore>(key, error_if_exists);
+    }
+#endif
+    return new RobinMapDict<MemberScore>();
+  }
+}
+
+ZSET_TEMPLATE
+int ZSET_TYPE::RandLevel(uint64_t card) {
+  static constexpr uint64_t kThreshold = SKIPLIST_P * 18446744073709551616.0;
+  static const double kLevelsPerBit = std::log(2.0) / std::log(1 / SKIPLIST_P);
+  // Levels far above log(card) would link almost no node
+  int bits = 64 - __builtin_clzll(uint64_t(card) + 1);
+  int limit = std::min(_MaxLevel, int(bits * kLevelsPerBit) + 2);
+  int level = 1;
+  while (level < limit) {
+    // xorshift64*
+    rand_state_ ^= rand_state_ >> 12;
+    rand_state_ ^= rand_state_ << 25;
+    rand_state_ ^= rand_state_ >> 27;
+    if (rand_state_ * 0x2545f4914f6cdd1d >= kThreshold) {
+      break;
+    }
+    ++ level;
+  }
+  return level;
+}
+
+ZSET_TEMPLATE
+void ZSET_TYPE::InitRoot() {
+  linked_ = dict_->PointerStable();
+  root_ = dict_->NewKeyBuffer(kZsetRoot, true);
+  if (root_->get_lru_state() == LRU_OK) {
+    root_->Reset(_T(), 0);
+  } else {
+    max_level_ = root_->get_level();
+    root_->set_lru_state(LRU_OK);
+    if (linked_) {
+      RebuildNextLinks();
+    }
+    if (!root_->has_back_member()) {
+      RebuildBackLinks();
+    }
+    if (_SpanSums && !root_->has_span_sums()) {
+      RebuildSpanSums();
+    }
+  }
+  RebuildTail();
+  card_ = tail_[1].rank;
+  dict_->Persist(root_);
+  if constexpr (ScoreTraits<_T>::kOrdered) {
+    dict_->EnableIndex([](MemberScore* ms, std::string& key) {
+      AppendIndexKey(ms->get_score(), ms->get_key_string(), key);
+    });
+  }
+}
+
 ZSET_TEMPLATE typename
 ZSET_TYPE::MemberScore* ZSET_TYPE::FindByLex(const char* member) const {
+  Probe probe(_T(), member);
   MemberScore* ms = root_;
   for (int i = max_level_; i > 0; -- i) {
-    while (ms->MemberCompare(i, member) < 0) {
-      char* mbr = ms->get_member(i);
-      ms = dict_->Find(mbr);
+    while (ms->MemberCompare(i, probe) < 0) {
+      ms = Next(ms, i);
     }
   }
   return ms;
 }
 
 ZSET_TEMPLATE typename
-ZSET_TYPE::MemberScore* ZSET_TYPE::FindByRank(uint32_t rank) const {
+ZSET_TYPE::MemberScore* ZSET_TYPE::FindByRank(uint64_t rank) const {
   if (rank > card_) {
     return nullptr;
   }
@@ -898,11 +2028,11 @@ ZSET_TYPE::MemberScore* ZSET_TYPE::FindByRank(uint32_t rank) const {
       if (*mbr == '\0') {
         break;
       }
-      int cur_step = ms->get_step(i);
+      uint64_t cur_step = ms->get_step(i);
       if (cur_step > rank) {
         break;
       }
-      ms = dict_->Find(mbr);
+      ms = Next(ms, i);
       rank -= cur_step;
       if (rank == 0) {
         return ms;
@@ -917,70 +2047,111 @@ ZSET_TYPE::MemberScore* ZSET_TYPE::FindByScore(_T score) const {
   MemberScore* ms = root_;
   for (int i = max_level_; i > 0; -- i) {
     while (ms->ScoreCompare(i, score) < 0) {
-      char* mbr = ms->get_member(i);
-      ms = dict_->Find(mbr);
+      ms = Next(ms, i);
     }
   }
   return ms;
 }
 
-ZSET_TEMPLATE
-uint32_t ZSET_TYPE::FindLast() const {
-  uint32_t total_step = 0;
-  MemberScore* ms = root_;
-  for (int i = max_level_; i > 0; -- i) {
-    while (true) {
-      char* mbr = ms->get_member(i);
-      if (*mbr == '\0') {
-        break;
-      }
-      total_step += ms->get_step(i);
-      ms = dict_->Find(mbr);
-    }
+ZSET_TEMPLATE typename
+ZSET_TYPE::MemberScore* ZSET_TYPE::FindTail(int lvl) const {
+  if (tail_[lvl].rank == 0) {
+    return root_;
   }
-  return total_step;
+  return linked_ ? tail_[lvl].node : dict_->Find(tail_[lvl].member.data());
 }
 
 ZSET_TEMPLATE
-void ZSET_TYPE::ImplZadd(const char* member, _T score) {
-  int rand_level = GetRandLevel(_MaxLevel);
-  MemberScore* ms = root_;
-  prev_step_[1] = 0;
-  uint32_t total_step = 0;
-  for (int i = max_level_; i > 0; -- i) {
-    while (ms->Compare(i, score, member) < 0) {
+void ZSET_TYPE::ImplZadd(const char* member, _T score, bool resume, int level) {
+  int rand_level = level ? level : RandLevel(card_);
+  // From tail_level up, the predecessors are the last nodes, only looked
+  // up at the levels the new node is linked at
+  int tail_level = TailLevel(score, member);
+  MemberScore* tail = nullptr;
+  for (int i = tail_level; i <= max_level_; ++ i) {
+    if (i > tail_level && i > rand_level) {
+      prev_[i] = root_;
+      prev_step_[i] = 0;
+      prev_sum_[i] = 0;
+      continue;
+    }
+    if (tail == nullptr || tail_[i].rank != tail_[i-1].rank) {
+      tail = FindTail(i);
+    }
+    prev_[i] = tail;
+    prev_step_[i] = tail_[i].rank;
+    prev_sum_[i] = tail_[i].sum;
+  }
+  MemberScore* ms = tail ? prev_[tail_level] : root_;
+  uint64_t total_step = tail ? prev_step_[tail_level] : 0;
+  sum_t total_sum = tail ? prev_sum_[tail_level] : 0;
+  Probe probe(score, member);
+  for (int i = tail_level - 1; i > 0; -- i) {
+    if (resume && prev_step_[i] > total_step) {
+      ms = prev_[i];
+      total_step = prev_step_[i];
+      total_sum = prev_sum_[i];
+      dict_->Touch(ms);
+    }
+    while (ms->Compare(i, probe) < 0) {
       total_step += ms->get_step(i);
-      ms = dict_->Find(ms->get_member(i));
+      total_sum += ms->get_sum(i);
+      ms = Next(ms, i);
     }
     prev_step_[i] = total_step;
+    prev_sum_[i] = total_sum;
     prev_[i] = ms;
   }
+  // Rank of the predecessor at level 1, also for an empty skiplist
+  prev_step_[1] = total_step;
+  prev_sum_[1] = total_sum;
+  // Neighbours at level 1, the root stands for both ends
+  MemberScore* pred = max_level_ ? prev_[1] : root_;
+  MemberScore* succ = max_level_ && *pred->get_member(1) ? Next(pred, 1) : root_;
 
-  MemberScore* new_ms = new (dict_->NewKeyBuffer(member))
-                        MemberScore(member, score, rand_level);
+  if (rand_level > max_level_) {
+    root_->set_level(rand_level);
+  }
+  MemberScore* new_ms = dict_->NewKeyBuffer(member);
+  new_ms->Reset(score, rand_level);
+  dict_->IndexAdd(new_ms);
   for (int i = 1; i <= rand_level; ++ i) {
     if (i <= max_level_) {
       char* mbr = prev_[i]->get_member(i);
-      uint32_t left_size = prev_step_[1] - prev_step_[i];
+      uint64_t left_size = prev_step_[1] - prev_step_[i];
+      sum_t left_sum = prev_sum_[1] - prev_sum_[i];
       if (*mbr != '\0') {
-        new_ms->set_member(i, mbr);
+        if (!linked_) {
+          new_ms->set_member(i, mbr);
+        }
         new_ms->set_score(i, prev_[i]->get_score(i));
         new_ms->set_step(i, prev_[i]->get_step(i) - left_size);
+        new_ms->set_sum(i, prev_[i]->get_sum(i) - left_sum);
       }
       prev_[i]->set_step(i, left_size + 1);
+      prev_[i]->set_sum(i, left_sum + ToSum(score));
     } else {
       prev_[i] = root_;
       prev_[i]->set_step(i, prev_step_[1] + 1);
+      prev_[i]->set_sum(i, prev_sum_[1] + ToSum(score));
     }
-    prev_[i]->set_member(i, member);
     prev_[i]->set_score(i, score);
+    if (linked_) {
+      new_ms->set_next(i, prev_[i]->get_next(i));
+      prev_[i]->set_next(i, new_ms);
+    } else {
+      prev_[i]->set_member(i, member);
+    }
   }
+  SetBack(new_ms, pred);
+  SetBack(succ, new_ms);
   int updated_level = rand_level;
-  for (int i = rand_level + 1; i <= max_level_; ++ i) {
+  for (int i = rand_level + 1; i <= max_level_ && i < tail_level; ++ i) {
     if (*prev_[i]->get_member(i) == '\0') {
       break;
     }
     prev_[i]->inc_step(i);
+    prev_[i]->set_sum(i, prev_[i]->get_sum(i) + ToSum(score));
     updated_level = i;
   }
   // Persist to ROCKSDB_DICT
@@ -990,6 +2161,23 @@ void ZSET_TYPE::ImplZadd(const char* member, _T score) {
     }
   }
   dict_->BatchAdd(new_ms);
+  dict_->BatchAdd(succ);
+  // The new node is the predecessor of a resumed descent
+  uint64_t new_rank = prev_step_[1] + 1;
+  sum_t new_sum = prev_sum_[1] + ToSum(score);
+  for (int i = 1; i <= std::max(max_level_, rand_level); ++ i) {
+    if (i <= rand_level && *new_ms->get_member(i) == '\0') {
+      SetTail(i, new_ms, new_rank, new_sum);
+    } else if (tail_[i].rank >= new_rank) {
+      tail_[i].rank ++;
+      tail_[i].sum += ToSum(score);
+    }
+  }
+  for (int i = 1; i <= rand_level; ++ i) {
+    prev_[i] = new_ms;
+    prev_step_[i] = new_rank;
+    prev_sum_[i] = new_sum;
+  }
   // Update card and max level
   card_ ++;
   max_level_ = std::max(max_level_, rand_level);
@@ -998,75 +2186,144 @@ void ZSET_TYPE::ImplZadd(const char* member, _T score) {
 }
 
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::ImplZcount(const _T& score, bool equal_ok) const {
+uint64_t ZSET_TYPE::ImplZcount(const _T& score, bool equal_ok, sum_t* sum) const {
   MemberScore* ms = root_;
-  uint32_t total_step = 0;
+  uint64_t total_step = 0;
+  sum_t total_sum = 0;
   int cmp_result = equal_ok ? 0 : -1;
   for (int i = max_level_; i > 0; -- i) {
     while (ms->ScoreCompare(i, score) <= cmp_result) {
       total_step += ms->get_step(i);
-      char* mbr = ms->get_member(i);
-      ms = dict_->Find(mbr);
+      total_sum += ms->get_sum(i);
+      ms = Next(ms, i);
     }
   }
+  if (sum != nullptr) {
+    *sum = total_sum;
+  }
   return total_step;
 }
 
+// The number of members less than (or equal to) member, all scores equal
 ZSET_TEMPLATE
-uint32_t ZSET_TYPE::ImplZrank(const char* member, _T score) const {
+uint64_t ZSET_TYPE::ImplZlexcount(const char* member, bool equal_ok) const {
   MemberScore* ms = root_;
-  uint32_t total_step = 0;
+  uint64_t total_step = 0;
+  int cmp_result = equal_ok ? 0 : -1;
+  Probe probe(_T(), member);
   for (int i = max_level_; i > 0; -- i) {
-    while (ms->Compare(i, score, member) <= 0) {
+    while (ms->MemberCompare(i, probe) <= cmp_result) {
       total_step += ms->get_step(i);
-      char* mbr = ms->get_member(i);
-      ms = dict_->Find(mbr);
+      ms = Next(ms, i);
     }
-    if (ms->Compare(0, score, member) == 0) {
-      return total_step;
+  }
+  return total_step;
+}
+
+ZSET_TEMPLATE
+typename ZSET_TYPE::sum_t ZSET_TYPE::ImplPrefixSum(uint64_t rank) const {
+  MemberScore* ms = root_;
+  uint64_t total_step = 0;
+  sum_t total_sum = 0;
+  for (int i = max_level_; i > 0; -- i) {
+    while (*ms->get_member(i) != '\0' &&
+           total_step + ms->get_step(i) <= rank) {
+      total_step += ms->get_step(i);
+      total_sum += ms->get_sum(i);
+      ms = Next(ms, i);
+    }
+  }
+  return total_sum;
+}
+
+ZSET_TEMPLATE
+uint64_t ZSET_TYPE::ImplZrank(MemberScore* ms) const {
+  uint64_t total_step = 0;
+  for (;;) {
+    int lvl = ms->get_level();
+    if (*ms->get_member(lvl) == '\0') {
+      return tail_[lvl].rank - total_step;
     }
+    total_step += ms->get_step(lvl);
+    ms = Next(ms, lvl);
   }
-  return 0;
 }
 
 ZSET_TEMPLATE typename
-ZSET_TYPE::MemberScore* ZSET_TYPE::ImplZrem(const char* member, _T score) {
+ZSET_TYPE::MemberScore* ZSET_TYPE::ImplZrem(const char* member, _T score,
+                                            bool resume) {
+  // From tail_level up, member is not linked and nothing follows the
+  // last nodes, which are left as they are
+  int tail_level = TailLevel(score, member);
+  for (int i = tail_level + 1; i <= max_level_; ++ i) {
+    prev_[i] = root_;
+    prev_step_[i] = 0;
+    prev_sum_[i] = 0;
+  }
   MemberScore* ms = root_;
+  uint64_t total_step = 0;
+  sum_t total_sum = 0;
+  if (tail_level <= max_level_) {
+    ms = prev_[tail_level] = FindTail(tail_level);
+    total_step = prev_step_[tail_level] = tail_[tail_level].rank;
+    total_sum = prev_sum_[tail_level] = tail_[tail_level].sum;
+  }
   int cmp = -1;
-  for (int i = max_level_; i > 0; -- i) {
+  Probe probe(score, member);
+  for (int i = tail_level - 1; i > 0; -- i) {
+    if (resume && prev_step_[i] > total_step) {
+      ms = prev_[i];
+      total_step = prev_step_[i];
+      total_sum = prev_sum_[i];
+      dict_->Touch(ms);
+    }
     for (;;) {
-      cmp = ms->Compare(i, score, member);
+      cmp = ms->Compare(i, probe);
       if (cmp >= 0) {
         break;
       }
-      ms = dict_->Find(ms->get_member(i));
+      total_step += ms->get_step(i);
+      total_sum += ms->get_sum(i);
+      ms = Next(ms, i);
     }
+    prev_step_[i] = total_step;
+    prev_sum_[i] = total_sum;
     prev_[i] = ms;
   }
   if (cmp != 0) {
     return nullptr;
   }
-  auto next = dict_->Find(ms->get_member(1));
+  auto next = Next(ms, 1);
   int level = next->get_level();
+  sum_t removed_sum = ToSum(next->get_score());
+  MemberScore* succ = *next->get_member(1) ? Next(next, 1) : root_;
+  SetBack(succ, prev_[1]);
 
   for (int i = 1; i <= level; ++ i) {
+    // The tuple of next at level i already holds its successor
     char* mbr = next->get_member(i);
+    if (linked_) {
+      prev_[i]->set_next(i, next->get_next(i));
+    } else {
+      prev_[i]->set_member(i, mbr);
+    }
     if (*mbr == '\0') {
-      prev_[i]->set_member(i, "");
       prev_[i]->set_step(i, 0);
+      prev_[i]->set_sum(i, 0);
     } else {
-      auto next2 = dict_->Find(mbr);
-      prev_[i]->set_member(i, next2->get_member());
-      prev_[i]->set_score(i, next2->get_score());
+      prev_[i]->set_score(i, next->get_score(i));
       prev_[i]->set_step(i,
         prev_[i]->get_step(i) + next->get_step(i) - 1);
+      prev_[i]->set_sum(i,
+        prev_[i]->get_sum(i) + next->get_sum(i) - removed_sum);
     }
   }
   int updated_level = level;
-  for (int i = level + 1; i <= max_level_; ++ i) {
+  for (int i = level + 1; i <= max_level_ && i < tail_level; ++ i) {
     char* mbr = prev_[i]->get_member(i);
     if (*mbr != '\0') {
       prev_[i]->dec_step(i);
+      prev_[i]->set_sum(i, prev_[i]->get_sum(i) - removed_sum);
       updated_level = i;
     } else {
       break;
@@ -1078,6 +2335,17 @@ ZSET_TYPE::MemberScore* ZSET_TYPE::ImplZrem(const char* member, _T score) {
       dict_->BatchAdd(prev_[i]);
     }
   }
+  dict_->BatchAdd(succ);
+  uint64_t rank = prev_step_[1] + 1;
+  for (int i = 1; i < tail_level; ++ i) {
+    if (tail_[i].rank == rank) {
+      SetTail(i, prev_[i], prev_step_[i], prev_sum_[i]);
+    } else if (tail_[i].rank > rank) {
+      tail_[i].rank --;
+      tail_[i].sum -= removed_sum;
+    }
+  }
+  dict_->IndexDelete(next);
   dict_->BatchDelete(next);
   // Erase from memory
   dict_->Erase(next);
@@ -1091,6 +2359,482 @@ ZSET_TYPE::MemberScore* ZSET_TYPE::ImplZrem(const char* member, _T score) {
   return ms;
 }
 
+/*
+  Change the score of ms. If the member keeps its rank, only the copies
+  of its score in the predecessors' tuples are rewritten, found through
+  the back links for most nodes, which are only linked at low levels.
+  Otherwise the member moves, at the same level, and a higher score
+  resumes the insertion from the predecessors of its old position.
+*/
+ZSET_TEMPLATE
+void ZSET_TYPE::ImplZupdate(MemberScore* ms, const _T& score) {
+  std::string member = ms->get_key_string();
+  _T old_score = ms->get_score();
+  int level = ms->get_level();
+  // Spans of levels below tail_level cover the member, their sums change
+  int tail_level = TailLevel(old_score, member.data());
+  int top = _SpanSums ? tail_level - 1 : level;
+  sum_t delta = ToSum(score) - ToSum(old_score);
+  MemberScore* pred = Prev(ms);
+  Probe probe(score, member.data());
+  if ((pred != root_ && pred->Compare(0, probe) >= 0) || ms->Compare(1, probe) <= 0) {
+    ImplZrem(member.data(), old_score);
+    ImplZadd(member.data(), score, old_score < score, level);
+    return;
+  }
+  dict_->IndexDelete(ms);
+  ms->set_score(0, score);
+  dict_->IndexAdd(ms);
+  dict_->BatchAdd(ms);
+  // The predecessor at level i is the first node back of level i or
+  // above, found by walking back while that is cheaper than a descent
+  int lvl = 1;
+  MemberScore* node = pred;
+  auto update = [&](int i) {
+    if (i <= level) {
+      node->set_score(i, score);
+    }
+    node->set_sum(i, node->get_sum(i) + delta);
+    dict_->BatchAdd(node);
+  };
+  for (int hops = 0; lvl <= top && hops <= kWalkBackLimit; ) {
+    if (node == root_ || node->get_level() >= lvl) {
+      update(lvl ++);
+    } else {
+      node = Prev(node);
+      hops ++;
+    }
+  }
+  if (lvl <= top) {
+    node = tail_level <= max_level_ ? FindTail(tail_level) : root_;
+    Probe old_probe(old_score, member.data());
+    for (int i = tail_level - 1; i >= lvl; -- i) {
+      while (node->Compare(i, old_probe) < 0) {
+        node = Next(node, i);
+      }
+      if (i <= top) {
+        update(i);
+      }
+    }
+  }
+  for (int i = 1; i < tail_level; ++ i) {
+    if (tail_[i].member == member) {
+      tail_[i].score = score;
+    }
+    tail_[i].sum += delta;
+  }
+  dict_->BatchPersist();
+}
+
+/*
+  Remove the members ranked start to stop, calling f on each in order.
+  Two descents find the predecessors of start and the last nodes up to
+  stop at every level, which are spliced in O(log n) instead of one
+  ImplZrem per member. The predecessors are relinked before the removed
+  nodes are deleted, so that a batch written in between never leaves
+  the skiplist pointing at a deleted node.
+*/
+ZSET_TEMPLATE
+uint64_t ZSET_TYPE::ImplZremRange(uint64_t start, uint64_t stop,
+                                  const std::function<void(MemberScore*)>& f) {
+  if (start == 0 || start > stop || stop > card_) {
+    return 0;
+  }
+  uint64_t count = stop - start + 1;
+  // Predecessors of start, and the last nodes up to stop, per level
+  MemberScore* last[_MaxLevel + 1];
+  uint64_t last_step[_MaxLevel + 1];
+  sum_t last_sum[_MaxLevel + 1];
+  MemberScore* ms = root_;
+  uint64_t total_step = 0;
+  sum_t total_sum = 0;
+  for (int i = max_level_; i > 0; -- i) {
+    while (*ms->get_member(i) != '\0' &&
+           total_step + ms->get_step(i) < start) {
+      total_step += ms->get_step(i);
+      total_sum += ms->get_sum(i);
+      ms = Next(ms, i);
+    }
+    prev_[i] = ms;
+    prev_step_[i] = total_step;
+    prev_sum_[i] = total_sum;
+  }
+  ms = root_;
+  total_step = 0;
+  total_sum = 0;
+  for (int i = max_level_; i > 0; -- i) {
+    if (prev_step_[i] > total_step) {
+      ms = prev_[i];
+      total_step = prev_step_[i];
+      total_sum = prev_sum_[i];
+    }
+    while (*ms->get_member(i) != '\0' &&
+           total_step + ms->get_step(i) <= stop) {
+      total_step += ms->get_step(i);
+      total_sum += ms->get_sum(i);
+      ms = Next(ms, i);
+    }
+    last[i] = ms;
+    last_step[i] = total_step;
+    last_sum[i] = total_sum;
+  }
+  sum_t removed_sum = last_sum[1] - prev_sum_[1];
+  MemberScore* succ = *last[1]->get_member(1) ? Next(last[1], 1) : root_;
+  ms = Next(prev_[1], 1);
+
+  // Splice out the range, the tuple of last at level i already holds
+  // the successor of the range
+  for (int i = 1; i <= max_level_; ++ i) {
+    if (last[i] != prev_[i]) {
+      char* mbr = last[i]->get_member(i);
+      if (linked_) {
+        prev_[i]->set_next(i, last[i]->get_next(i));
+      } else {
+        prev_[i]->set_member(i, mbr);
+      }
+      if (*mbr == '\0') {
+        prev_[i]->set_step(i, 0);
+        prev_[i]->set_sum(i, 0);
+      } else {
+        prev_[i]->set_score(i, last[i]->get_score(i));
+        prev_[i]->set_step(i, last_step[i] + last[i]->get_step(i) -
+                              prev_step_[i] - count);
+        prev_[i]->set_sum(i, last_sum[i] + last[i]->get_sum(i) -
+                             prev_sum_[i] - removed_sum);
+      }
+    } else if (*prev_[i]->get_member(i) != '\0') {
+      prev_[i]->set_step(i, prev_[i]->get_step(i) - count);
+      prev_[i]->set_sum(i, prev_[i]->get_sum(i) - removed_sum);
+    } else {
+      continue;
+    }
+    dict_->BatchAdd(prev_[i]);
+  }
+  SetBack(succ, prev_[1]);
+  dict_->BatchAdd(succ);
+  for (int i = 1; i <= max_level_; ++ i) {
+    if (tail_[i].rank >= start && tail_[i].rank <= stop) {
+      SetTail(i, prev_[i], prev_step_[i], prev_sum_[i]);
+    } else if (tail_[i].rank > stop) {
+      tail_[i].rank -= count;
+      tail_[i].sum -= removed_sum;
+    }
+  }
+
+  // Delete the removed nodes, following their own links
+  for (uint64_t i = 0; i < count; i ++) {
+    f(ms);
+    MemberScore* next = i + 1 < count ? Next(ms, 1) : nullptr;
+    dict_->IndexDelete(ms);
+    dict_->BatchDelete(ms);
+    dict_->Erase(ms);
+    ms = next;
+  }
+  card_ -= count;
+  while (max_level_ && *root_->get_member(max_level_) == '\0') {
+    max_level_ --;
+  }
+  root_->set_level(max_level_);
+  dict_->BatchPersist();
+  return count;
+}
+
+/*
+  Combine this zset and others into a new zset. Every input is read as
+  one run ordered by member, the runs are merged with a heap, and the
+  new zset is built by BulkLoad instead of one Zadd per member.
+*/
+ZSET_TEMPLATE
+std::unique_ptr<ZSET_TYPE> ZSET_TYPE::ImplZstore(const std::vector<ZSET_TYPE*>& others,
+                                                 const std::string& zset_name,
+                                                 ZsetDictType dict_type,
+                                                 const std::vector<double>& weights,
+                                                 ZsetAggregate aggregate, bool inter) {
+  size_t k = others.size() + 1;
+  if (!weights.empty() && weights.size() != k) {
+    throw std::invalid_argument("weights must match the number of zsets");
+  }
+  std::vector<pairs<_T>> runs(k);
+  for (size_t i = 0; i < k; i ++) {
+    (i ? others[i - 1] : this)->MemberOrderedScan(&runs[i]);
+    if (weights.empty() || weights[i] == 1) {
+      continue;
+    }
+    if constexpr (std::is_arithmetic<_T>::value) {
+      for (auto& [member, score] : runs[i]) {
+        score = _T(score * weights[i]);
+      }
+    } else {
+      throw std::invalid_argument("weights require an arithmetic score type");
+    }
+  }
+
+  pairs<_T> result;
+  using Head = std::pair<std::string_view, size_t>;
+  auto greater = [](const Head& a, const Head& b) {
+    return b.first < a.first || (a.first == b.first && b.second < a.second);
+  };
+  std::priority_queue<Head, std::vector<Head>, decltype(greater)> heap(greater);
+  std::vector<size_t> pos(k, 0);
+  for (size_t i = 0; i < k; i ++) {
+    if (!runs[i].empty()) {
+      heap.emplace(runs[i][0].first, i);
+    }
+  }
+  while (!heap.empty()) {
+    std::string_view member = heap.top().first;
+    _T score = _T();
+    size_t count = 0;
+    while (!heap.empty() && heap.top().first == member) {
+      size_t i = heap.top().second;
+      heap.pop();
+      const _T& s = runs[i][pos[i]].second;
+      if (count ++ == 0) {
+        score = s;
+      } else if (aggregate == AGGREGATE_SUM) {
+        score += s;
+      } else if (aggregate == AGGREGATE_MIN ? s < score : score < s) {
+        score = s;
+      }
+      if (++ pos[i] < runs[i].size()) {
+        heap.emplace(runs[i][pos[i]].first, i);
+      }
+    }
+    if (!inter || count == k) {
+      result.emplace_back(member, score);
+    }
+  }
+
+  std::sort(result.begin(), result.end(), [](const auto& a, const auto& b) {
+    if (a.second < b.second) return true;
+    if (b.second < a.second) return false;
+    return a.first < b.first;
+  });
+  auto zset = NewZset(zset_name, dict_type);
+  zset->BulkLoad(std::move(result), true);
+  return zset;
+}
+
+ZSET_TEMPLATE
+void ZSET_TYPE::AppendIndexKey(const _T& score, const char* member, std::string& key) {
+  if constexpr (ScoreTraits<_T>::kOrdered) {
+    size_t size = key.size();
+    key.resize(size + ScoreTraits<_T>::kSize);
+    ScoreTraits<_T>::Encode(score, &key[size]);
+    key.append(member);
+  }
+}
+
+ZSET_TEMPLATE
+std::string ZSET_TYPE::IndexKey(const _T& score, const char* member) {
+  std::string key;
+  AppendIndexKey(score, member, key);
+  return key;
+}
+
+ZSET_TEMPLATE
+std::string ZSET_TYPE::IndexKeyAfter(const _T& score) {
+  std::string key = IndexKey(score, kZsetRoot);
+  // Increment the encoded score as a big endian integer
+  while (!key.empty() && key.back() == '\xff') {
+    key.pop_back();
+  }
+  if (!key.empty()) {
+    key.back() ++;
+  }
+  return key;
+}
+
+ZSET_TEMPLATE
+bool ZSET_TYPE::IndexRange(const std::string& key, bool reverse,
+                           const std::function<bool(const _T&,
+                                                    std::string_view)>& f) const {
+  if constexpr (ScoreTraits<_T>::kOrdered) {
+    return dict_->IndexScan(key, reverse, [&](std::string_view index_key) {
+      return f(ScoreTraits<_T>::Decode(index_key.data()),
+               index_key.substr(ScoreTraits<_T>::kSize));
+    });
+  }
+  return false;
+}
+
+// Read all members into run, ordered by member
+ZSET_TEMPLATE
+void ZSET_TYPE::MemberOrderedScan(pairs<_T>* run) const {
+  run->clear();
+  run->reserve(card_);
+  // Dicts ordered by key are scanned without a lookup per member
+  if (dict_->IterBegin(kZsetRoot)) {
+    std::string value;
+    for (; dict_->IterValid(); dict_->IterNext()) {
+      run->emplace_back();
+      dict_->IterKey(run->back().first);
+      dict_->IterValue(value);
+      run->back().second = MemberScore::get_value_score(value);
+    }
+    return;
+  }
+  for (auto ms = root_; max_level_ && *ms->get_member(1) != '\0'; ms = Next(ms, 1)) {
+    run->emplace_back(ms->get_member(1), ms->get_score(1));
+  }
+  std::sort(run->begin(), run->end(), [](const auto& a, const auto& b) {
+    return a.first < b.first;
+  });
+}
+
+ZSET_TEMPLATE typename
+ZSET_TYPE::MemberScore* ZSET_TYPE::Next(MemberScore* ms, int lvl) const {
+  return linked_ ? ms->get_next(lvl) : dict_->Find(ms->get_member(lvl));
+}
+
+ZSET_TEMPLATE typename
+ZSET_TYPE::MemberScore* ZSET_TYPE::Prev(MemberScore* ms) const {
+  if (linked_) {
+    return ms->get_back() ? ms->get_back() : root_;
+  }
+  char* mbr = ms->get_back_member();
+  return *mbr == '\0' ? root_ : dict_->Find(mbr);
+}
+
+// Link recovered nodes by pointer, as they are linked by member, then
+// drop their copies of members
+ZSET_TEMPLATE
+void ZSET_TYPE::RebuildNextLinks() {
+  for (int i = 1; i <= max_level_; i ++) {
+    for (MemberScore* ms = root_; *ms->get_member(i) != '\0'; ) {
+      MemberScore* next = dict_->Find(ms->get_member(i));
+      ms->set_next(i, next);
+      if (i == 1) {
+        next->set_back(ms);
+        root_->set_back(next);
+      }
+      ms = next;
+    }
+  }
+  for (MemberScore* ms = root_; ms; ms = ms->get_level() ? ms->get_next(1) : nullptr) {
+    ms->clear_members();
+  }
+}
+
+// Fill in back links of nodes written before back links existed
+ZSET_TEMPLATE
+void ZSET_TYPE::RebuildBackLinks() {
+  MemberScore* ms = root_;
+  while (max_level_ && *ms->get_member(1) != '\0') {
+    MemberScore* next = Next(ms, 1);
+    SetBack(next, ms);
+    dict_->BatchAdd(next);
+    ms = next;
+  }
+  SetBack(root_, ms);
+  dict_->BatchPersist(true);
+}
+
+// Fill in span sums of nodes written without _SpanSums, in one pass
+// over level 1 that closes the span of every level a node is linked at
+ZSET_TEMPLATE
+void ZSET_TYPE::RebuildSpanSums() {
+  // The last node seen at every level, by member, and the sum up to it
+  std::string last[_MaxLevel + 1];
+  sum_t last_sum[_MaxLevel + 1] = {};
+  sum_t total_sum = 0;
+  auto find = [&](int lvl) {
+    return last[lvl].empty() ? root_ : dict_->Find(last[lvl].data());
+  };
+  MemberScore* ms = root_;
+  while (max_level_ && *ms->get_member(1) != '\0') {
+    ms = Next(ms, 1);
+    total_sum += ToSum(ms->get_score());
+    std::string member = ms->get_key_string();
+    int level = ms->get_level();
+    for (int i = 1; i <= level; i ++) {
+      MemberScore* prev = find(i);
+      prev->set_sum(i, total_sum - last_sum[i]);
+      dict_->BatchAdd(prev);
+      last[i] = member;
+      last_sum[i] = total_sum;
+    }
+    ms = find(1);
+  }
+  // Nothing follows the last nodes
+  for (int i = 1; i <= max_level_; i ++) {
+    MemberScore* prev = find(i);
+    prev->set_sum(i, 0);
+    dict_->BatchAdd(prev);
+  }
+  dict_->BatchPersist(true);
+}
+
+// Find the last node of every level, the last of level 1 ranks card_
+ZSET_TEMPLATE
+void ZSET_TYPE::RebuildTail() {
+  MemberScore* ms = root_;
+  uint64_t total_step = 0;
+  sum_t total_sum = 0;
+  for (int i = _MaxLevel; i > 0; -- i) {
+    while (i <= max_level_ && *ms->get_member(i) != '\0') {
+      total_step += ms->get_step(i);
+      total_sum += ms->get_sum(i);
+      ms = Next(ms, i);
+    }
+    SetTail(i, ms, total_step, total_sum);
+  }
+}
+
+ZSET_TEMPLATE
+void ZSET_TYPE::SetBack(MemberScore* ms, MemberScore* back) {
+  if (linked_) {
+    ms->set_back(back);
+  } else {
+    ms->set_back_member(back->get_key_string());
+  }
+}
+
+ZSET_TEMPLATE
+void ZSET_TYPE::SetTail(int lvl, MemberScore* ms, uint64_t rank, sum_t sum) {
+  tail_[lvl].member = rank ? ms->get_key_string() : kZsetRoot;
+  tail_[lvl].node = ms;
+  tail_[lvl].score = ms->get_score();
+  tail_[lvl].rank = rank;
+  tail_[lvl].sum = sum;
+}
+
+ZSET_TEMPLATE
+int ZSET_TYPE::TailLevel(const _T& score, const char* member) const {
+  int lvl = 1;
+  for (; lvl <= max_level_; lvl ++) {
+    auto& tail = tail_[lvl];
+    if (tail.rank == 0 || tail.score < score ||
+        (!(score < tail.score) && strcmp(tail.member.data(), member) < 0)) {
+      break;
+    }
+  }
+  return lvl;
+}
+
+ZSET_TEMPLATE
+std::unique_ptr<ZSET_TYPE> ZSET_TYPE::NewZset(const std::string& key,
+                                              ZsetDictType dict_type) const {
+#ifndef NO_ROCKSDB
+  // Keep the new zset in the same store
+  if constexpr (!kFixedDict || std::is_same<Dict, RocksdbDict<MemberScore>>::value) {
+    if (store_ && dict_type == ROCKSDB_DICT) {
+      return std::unique_ptr<ZSET_TYPE>(new ZSET_TYPE(store_, key, true));
+    }
+  }
+#endif
+  return std::unique_ptr<ZSET_TYPE>(new ZSET_TYPE(key, dict_type, true));
+}
+
+ZSET_TEMPLATE
+void ZSET_TYPE::SortByScore(std::vector<std::pair<_T, const char*>>& v) const {
+  std::sort(v.begin(), v.end(), [](const auto& a, const auto& b) {
+    if (a.first < b.first) return true;
+    if (b.first < a.first) return false;
+    return strcmp(a.second, b.second) < 0;
+  });
+}
+
 ////////////////////////////// END Zset Interval Implementations //////////////////////////////
 
 #undef ZSET_TYPE